@@ -40,11 +40,14 @@ class AismclNode : public MCL<AismclNode>
   friend class MCL;
   public:
     typedef std::vector<boost::shared_ptr<pf_sample_t> > pf_sample_ptr_vector_t;  
-    AismclNode();
+    AismclNode(const std::string& ns = "");
     ~AismclNode();
 
   protected:
-    void laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan);
+    //stages of MCL::laserReceived
+    void sensorStage(amcl::AMCLLaserData& ldata, const ros::Time& stamp);
+    bool fusionSupported() const { return false; }
+    bool resampleInitialUpdate() const { return true; }
     void GLCB()
     {
       ROS_INFO("AismclNode::GLCB() is called. Build density tree..");
@@ -88,9 +91,12 @@ class AismclNode : public MCL<AismclNode>
    * @param[in] mapy The minimum and maximum of y coordinate value of maps in meter
    * @param[in] mapx_range The difference of mapx, or width
    * @param[in] mapy_range The difference of mapy, or length
-   * @param[in] rng The random number generator
+   * @param[in] random The streams of the filter the proposal and acceptance streams are taken from
+   * @param[in] parallel Whether the measurement model may be evaluated by several threads at once
+   * @param[in] bounded The bounded evaluation of ldata or NULL, with it a proposal is given up as soon as it cannot be accepted
    * @param[in,out] pf The object of Particle Filter. We need the two particle sets
-   * @return[out] Total weight of output particles
+   * @param[out] ess The effective sample size of the output particles
+   * @return[out] Log of the total weight of output particles, which are left normalized in the current set
    */
     static double AnnealedImportanceSampling(
       amcl::AMCLLaserData& ldata, 
@@ -101,8 +107,11 @@ class AismclNode : public MCL<AismclNode>
       std::pair<double, double> mapy,
       double mapx_range,
       double mapy_range,
-      random_numbers::RandomNumberGenerator rng,
-      pf_t* pf
+      RandomStreams& random,
+      bool parallel,
+      const BoundedLikelihoodField* bounded,
+      pf_t* pf,
+      double* ess
       //geometry_msgs::PoseArray& accepted_cloud,
       //geometry_msgs::PoseArray& rejected_cloud)
     );
@@ -6,11 +6,11 @@ class AmclNode : public MCL<AmclNode>
 {
   friend class MCL;
   public:
-    AmclNode();
+    AmclNode(const std::string& ns = "");
     ~AmclNode();
 
   protected:
-    void laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan);
+    //the default stages of MCL are plain amcl
     void GLCB(){};
     void AIP(){};
     void RCCB();
@@ -0,0 +1,21 @@
+#ifndef PF_CLUSTER_H
+#define PF_CLUSTER_H
+#include "amcl/pf/pf.h"
+#include "amcl/pf/pf_kdtree.h"
+
+//Parallel replacement of the kd-tree histogram and pf_cluster_stats.
+//Samples are binned by the same keys as pf_kdtree_insert, the (key, sample) pairs are sorted in parallel,
+//neighbouring bins are joined into clusters as in pf_kdtree_cluster and the moments are reduced per bin
+//in parallel before they are summed per cluster, so pf_get_cluster_stats reports the same clusters.
+//Cluster labels follow the key order of the bins rather than the node order of the kd-tree,
+//except that the heaviest cluster is swapped to the front.
+
+/**
+ * @brief computes the histogram, clusters and cluster statistics of a set.
+ * The kd-tree of the set is rebuilt with one leaf per occupied bin, the bin sizes are taken from it.
+ * @param[in,out] set sample set, its clusters, mean and cov are written, clusters[0] is the heaviest
+ * @return number of occupied bins, the leaf count of the equivalent kd-tree
+ */
+int pf_cluster_stats_parallel(pf_sample_set_t* set);
+
+#endif //PF_CLUSTER_H
@@ -1,14 +1,136 @@
 #ifndef PF_RESAMPLE_H
 #define PF_RESAMPLE_H
+#include <cmath>
+#include <limits>
+#include <string>
 #include "amcl/pf/pf.h"
 #include "amcl/pf/pf_pdf.h"
 #include "amcl/pf/pf_vector.h"
 #include "amcl/pf/pf_kdtree.h"
-#include "mcl/MCL.h"//for random number generator MCL::rng_
+#include "mcl/philox.h"//the draws come from RandomStreams::bound()
 
 
 void pf_update_resample_kld(pf_t* pf);
 void pf_update_resample_lowvariance(pf_t* pf_);
 void pf_update_without_resample(pf_t* pf);
 
+//O(N) resampling schemes, every draw is a single merge walk over the cumulative weights
+typedef enum
+{
+  PF_RESAMPLE_MULTINOMIAL,
+  PF_RESAMPLE_SYSTEMATIC,
+  PF_RESAMPLE_STRATIFIED,
+  PF_RESAMPLE_RESIDUAL
+} pf_resample_scheme_t;
+
+typedef void (*pf_resample_fn_t)(pf_t*);
+
+//fixed count of max_samples
+void pf_update_resample_systematic(pf_t* pf);
+void pf_update_resample_stratified(pf_t* pf);
+void pf_update_resample_residual(pf_t* pf);
+//KLD-adaptive count between min_samples and max_samples
+void pf_update_resample_systematic_kld(pf_t* pf);
+void pf_update_resample_stratified_kld(pf_t* pf);
+void pf_update_resample_residual_kld(pf_t* pf);
+
+/**
+ * @brief draws parents of count samples.
+ * @param[in] c cumulative weights of n samples, c[0] = 0 and c[i+1] = c[i] + w_i, need not be normalized
+ * @param[in] n number of samples
+ * @param[in] count number of draws
+ * @param[in] scheme resampling scheme
+ * @param[out] parents count indices into [0, n), in ascending order
+ */
+void pf_resample_draw(const double* c, int n, int count, pf_resample_scheme_t scheme, int* parents);
+
+/**
+ * @brief KLD-adaptive subset of an ordered draw of max_samples.
+ * @details the draws are visited in bit reversed order and taken until their number exceeds the limit
+ * of the kd-tree bins they occupy, as pf_update_resample_kld stops its draw
+ * @param[in] pf filter of the sample count bounds and the KLD error
+ * @param[in] tree kd-tree of the bin size
+ * @param[in] poses pose of each draw
+ * @param[in,out] parents count parents in ascending order, the taken ones end up in front, still ascending
+ * @param[in] count number of draws
+ * @return number of taken draws
+ */
+int pf_resample_kld_select(pf_t* pf, const pf_kdtree_t* tree, const pf_vector_t* poses, int* parents, int count);
+
+/**
+ * @brief changes the sample limits of pf without reallocating the filter.
+ * The sample buffers of both sets are resized in place; if the current set holds more than
+ * max_samples samples it is resampled systematically down to max_samples.
+ * @param[in,out] pf the particle filter
+ * @param[in] min_samples new minimum number of samples
+ * @param[in] max_samples new maximum number of samples
+ */
+void pf_resize(pf_t* pf, int min_samples, int max_samples);
+
+//resample_type parameter names: kld, lowvariance (systematic), systematic, stratified, residual,
+//and systematic_kld, stratified_kld, residual_kld for the KLD-adaptive count.
+//returns false if name is none of them
+bool pf_resample_scheme_by_name(const std::string& name, pf_resample_scheme_t* scheme, bool* kld);
+//the resample function of a resample_type name, augmented is amcl pf_update_resample, NULL if unknown
+pf_resample_fn_t pf_resample_function(const std::string& name);
+
+//streaming log-sum-exp, keeps the running maximum and the sum of exp(x - max),
+//so one pass over log weights gives log(sum(exp(x))) without underflow or overflow
+typedef struct
+{
+  double max;
+  double sum;
+} pf_log_sum_t;
+
+static inline void pf_log_sum_init(pf_log_sum_t* acc)
+{
+  acc->max = -std::numeric_limits<double>::infinity();
+  acc->sum = 0.0;
+}
+
+static inline void pf_log_sum_add(pf_log_sum_t* acc, double x)
+{
+  if(x == -std::numeric_limits<double>::infinity())
+    return;
+  if(x <= acc->max)
+    acc->sum += exp(x - acc->max);
+  else
+  {
+    acc->sum = acc->sum * exp(acc->max - x) + 1.0;
+    acc->max = x;
+  }
+}
+
+//combine the partial sums of two threads
+static inline void pf_log_sum_merge(pf_log_sum_t* acc, const pf_log_sum_t* other)
+{
+  if(other->sum == 0.0)
+    return;
+  if(other->max <= acc->max)
+    acc->sum += other->sum * exp(other->max - acc->max);
+  else
+  {
+    acc->sum = acc->sum * exp(acc->max - other->max) + other->sum;
+    acc->max = other->max;
+  }
+}
+
+//log of the total, -inf if nothing was added
+static inline double pf_log_sum_value(const pf_log_sum_t* acc)
+{
+  return acc->sum > 0.0 ? acc->max + log(acc->sum) : -std::numeric_limits<double>::infinity();
+}
+
+//effective sample size (sum w)^2 / sum w^2 of a set, its weights need not be normalized
+double pf_effective_sample_size(const pf_sample_set_t* set);
+
+//normalize the current set of pf by total like pf_normalize and return the average weight,
+//the effective sample size is accumulated on the way into ess so that no other pass is needed
+double pf_normalize_ess(pf_t* pf, double total, double* ess);
+
+//normalize a set from its logWeight in the log domain, weight becomes exp(logWeight - lse)
+//and logWeight becomes logWeight - lse, returns lse, the log of the total weight,
+//the effective sample size is written to ess unless it is NULL
+double pf_normalize_log_weights(pf_sample_set_t* set, double* ess);
+
 #endif //PF_RESAMPLE_H
@@ -1,11 +1,17 @@
 #ifndef DEMC_H
 #define DEMC_H
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <map>
 #include <vector>
 #include "geometry_msgs/PoseArray.h"
-#include "random_numbers/random_numbers.h"
 #include <nuklei/KernelCollection.h>
 #include "amcl/pf/pf.h"
+#include "mcl/BoundedLikelihood.h"
+#include "mcl/parallel.h"
+#include "mcl/philox.h"
 
 namespace demc{
 /**
@@ -19,6 +25,129 @@ typedef struct
   double ori_bw;
 } demc_t;
 
+/**
+ * @brief Wraps an angle into [-pi, pi) without calling atan2, sin or cos.
+ */
+inline double wrapAngle(double a)
+{
+  return a - 2*M_PI*floor((a + M_PI)/(2*M_PI));
+}
+
+/**
+ * @brief Wraps x into [lower, lower + range) without calling fmod.
+ */
+inline double wrapRange(double x, double lower, double range)
+{
+  return x - range*floor((x - lower)/range);
+}
+
+/**
+ * @brief Structure of arrays layout of the poses of a sample set, the input of the parallel DEMC jump
+ */
+typedef struct
+{
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> a;
+  int size() const { return x.size(); }
+  void resize(int count)
+  {
+    x.resize(count);
+    y.resize(count);
+    a.resize(count);
+  }
+  void gather(const pf_sample_set_t* set)
+  {
+    resize(set->sample_count);
+    for(int i = 0 ; i < set->sample_count ; ++i)
+    {
+      x[i] = set->samples[i].pose.v[0];
+      y[i] = set->samples[i].pose.v[1];
+      a[i] = set->samples[i].pose.v[2];
+    }
+  }
+  //copies the poses back and resets every weight to one
+  void scatter(pf_sample_set_t* set) const
+  {
+    set->sample_count = size();
+    for(int i = 0 ; i < set->sample_count ; ++i)
+    {
+      set->samples[i].pose.v[0] = x[i];
+      set->samples[i].pose.v[1] = y[i];
+      set->samples[i].pose.v[2] = a[i];
+      set->samples[i].weight = 1.0;
+    }
+  }
+} population_t;
+
+/**
+ * @brief The per-sample Philox streams of the next DEMC jump.
+ *
+ * @param random The streams of the filter
+ * @return The streams, sample i draws from stream i
+ */
+inline Philox4x32 proposalStreams(RandomStreams& random)
+{
+  return random.next(RandomStreams::PROPOSAL);
+}
+
+/**
+ * @brief This function implements MCMC jump of DEMC algorithm over a structure of arrays population in parallel.
+ * @details Child i only draws from stream i of streams, so the result does not depend on the number of threads.
+ *
+ * @param[in] pool This gene pool of DEMC is the particles distributed over p(x_t|u_t,x_{t-1})
+ * @param[in] params This parameters of DEMC algorithm
+ * @param[in] mapx The pair of minimum and maximum values in X-axis of map coordinate in meters
+ * @param[in] mapy The pair of minimum and maximum values in Y-axis of map coordinate in meters
+ * @param[in] mapx_range The distance between the minimum and maximum in X-axis in meters
+ * @param[in] mapy_range The distance between the minimum and maximum in Y-axis in meters
+ * @param[in] streams The counter based generator, one stream per child
+ * @param[out] pop The output population of DEMC algorithm
+ */
+inline void proposal(
+  const population_t& pool,
+  const demc_t* params,
+  std::pair<double, double> mapx,
+  std::pair<double, double> mapy,
+  double mapx_range,
+  double mapy_range,
+  const Philox4x32& streams,
+  population_t& pop)
+{
+  const int count = pool.size();
+  pop.resize(count);
+  auto worker = [&](int beg, int end)
+  {
+    double g0, g1, g2, unused;
+    for(int i = beg ; i < end ; ++i)
+    {
+      Philox4x32::Block b0 = streams.block(i, 0);
+      Philox4x32::Block b1 = streams.block(i, 1);
+      //two distinct members without rejection, r2 is drawn from the others and skips r1
+      int r1 = 0, r2 = 0;
+      if(count > 1)
+      {
+        r1 = std::min((int)(Philox4x32::toUniform(b0.v[0])*count), count-1);
+        r2 = std::min((int)(Philox4x32::toUniform(b0.v[1])*(count-1)), count-2);
+        if(r2 >= r1)
+          ++r2;
+      }
+      Philox4x32::toGaussians(b0.v[2], b0.v[3], g0, g1);
+      Philox4x32::toGaussians(b1.v[0], b1.v[1], g2, unused);
+      double x = pool.x[i] + params->gamma * (pool.x[r1] - pool.x[r2]) + params->loc_bw * g0;
+      double y = pool.y[i] + params->gamma * (pool.y[r1] - pool.y[r2]) + params->loc_bw * g1;
+      if(x > mapx.second || x < mapx.first)
+        x = wrapRange(x, mapx.first, mapx_range);
+      if(y > mapy.second || y < mapy.first)
+        y = wrapRange(y, mapy.first, mapy_range);
+      pop.x[i] = x;
+      pop.y[i] = y;
+      pop.a[i] = wrapAngle(pool.a[i] + params->gamma * wrapAngle(pool.a[r1] - pool.a[r2]) + params->ori_bw * g2);
+    }
+  };
+  parallelFor(count, worker);
+}
+
 /**
  * @brief This function implements MCMC jump of DEMC algorithm.
  *
@@ -28,74 +157,137 @@ typedef struct
  * @param[in] mapy The pair of minimum and maximum values in Y-axis of map coordinate in meters
  * @param[in] mapx_range The distance between the minimum and maximum in X-axis in meters
  * @param[in] mapy_range The distance between the minimum and maximum in Y-axis in meters
- * @param[in] rng The generator of random values
+ * @param[in] random The streams of the filter the proposal streams are taken from
  * @param[out] pop The output population of DEMC algorithm
  */
-void proposal(
+inline void proposal(
   pf_sample_set_t* pool, 
   demc_t* params,
   std::pair<double, double> mapx,
   std::pair<double, double> mapy,
   double mapx_range,
   double mapy_range,
-  random_numbers::RandomNumberGenerator rng,
+  RandomStreams& random,
   pf_sample_set_t* pop)
 {
-  pop->sample_count = pool->sample_count;
-  pf_sample_t* child;
-  pf_sample_t* parent;
-  pf_sample_t* rand1;
-  pf_sample_t* rand2;
-  int r1, r2;
-  pf_vector_t diff;
-  double tmp;
-  for(int i = 0 ; i < pop->sample_count ; ++i)
+  population_t parents, children;
+  parents.gather(pool);
+  proposal(parents, params, mapx, mapy, mapx_range, mapy_range, proposalStreams(random), children);
+  children.scatter(pop);
+}
+
+/**
+ * @brief Evaluates the measurement model on a sample set, one range of samples per thread.
+ * @details Samples sharing pose and weight, as left behind by resampling, are evaluated once
+ * and their weight, preWeight, logWeight, likelihood and logLikelihood are copied to the duplicates.
+ * Beam skipping takes its statistics over the whole set, so with it every sample is evaluated as it is.
+ *
+ * @param[in] ldata The object for measurement model
+ * @param[in] parallel Whether the measurement model may be evaluated by several threads at once
+ * @param[in] bounded The bounded evaluation of ldata, which then evaluates every beam in place of the model, or NULL
+ * @param set The sample set to evaluate
+ * @return The number of distinct samples evaluated
+ */
+inline int updateSensorBatched(amcl::AMCLLaserData& ldata, bool parallel, const BoundedLikelihoodField* bounded, pf_sample_set_t* set)
+{
+  amcl::AMCLLaser* laser = (amcl::AMCLLaser*)ldata.sensor;
+  const int count = set->sample_count;
+  //the beams skipped depend on how many samples agree on them, duplicates included
+  if(!bounded && laser->model_type == amcl::LASER_MODEL_LIKELIHOOD_FIELD_PROB && laser->do_beamskip)
+  {
+    laser->UpdateSensorWithSet(set, &ldata);
+    return count;
+  }
+  std::vector<int> order(count);
+  for(int i = 0 ; i < count ; ++i)
+    order[i] = i;
+  auto less = [set](int a, int b)
+  {
+    const pf_sample_t& sa = set->samples[a];
+    const pf_sample_t& sb = set->samples[b];
+    for(int k = 0 ; k < 3 ; ++k)
+      if(sa.pose.v[k] != sb.pose.v[k])
+        return sa.pose.v[k] < sb.pose.v[k];
+    return sa.weight < sb.weight;
+  };
+  std::sort(order.begin(), order.end(), less);
+  std::vector<pf_sample_t> unique;
+  std::vector<int> representative(count);
+  for(int k = 0 ; k < count ; ++k)
   {
-    child = pop->samples + i;
-    parent = pool->samples + i;
-    r1 = rng.uniformInteger(0, pool->sample_count-1);
-    r2 = rng.uniformInteger(0, pool->sample_count-1);
-    while(r2==r1)
-      r2 = rng.uniformInteger(0, pool->sample_count-1);
-    rand1 = pool->samples + r1;
-    rand2 = pool->samples + r2;
-    diff = pf_vector_sub(rand1->pose, rand2->pose);
-    diff.v[0] = params->gamma * diff.v[0] + rng.gaussian(0, params->loc_bw);
-    diff.v[1] = params->gamma * diff.v[1] + rng.gaussian(0, params->loc_bw);
-    diff.v[2] = params->gamma * angle_diff( (rand1->pose.v[2]), (rand2->pose.v[2]) ) + rng.gaussian(0, params->ori_bw);
-    child->pose = pf_vector_add(parent->pose, diff);
-    if( child->pose.v[0] > mapx.second || child->pose.v[0] < mapx.first)
-      child->pose.v[0] = fmod( fmod( child->pose.v[0] - mapx.first , mapx_range) + mapx_range, mapx_range) + mapx.first;
-    if( child->pose.v[1] > mapy.second || child->pose.v[1] < mapy.first)
-      child->pose.v[1] = fmod( fmod( child->pose.v[1] - mapy.first , mapy_range) + mapy_range, mapy_range) + mapy.first;
-    child->pose.v[2] = normalize(child->pose.v[2]);
-    //set all weights to be one
-    child->weight = 1.0;
+    if(k == 0 || less(order[k-1], order[k]))
+      unique.push_back(set->samples[order[k]]);
+    representative[k] = unique.size() - 1;
   }
+  auto worker = [&](int beg, int end)
+  {
+    pf_sample_set_t view = *set;
+    view.samples = unique.data() + beg;
+    view.sample_count = end - beg;
+    if(bounded)
+      for(int k = beg ; k < end ; ++k)
+        bounded->evaluate(&unique[k], -std::numeric_limits<double>::infinity());
+    else
+      laser->UpdateSensorWithSet(&view, &ldata);
+  };
+  if(parallel)
+    parallelFor(unique.size(), worker);
+  else
+    worker(0, unique.size());
+  for(int k = 0 ; k < count ; ++k)
+  {
+    pf_sample_t* sample = set->samples + order[k];
+    const pf_sample_t& evaluated = unique[representative[k]];
+    sample->weight = evaluated.weight;
+    sample->preWeight = evaluated.preWeight;
+    sample->logWeight = evaluated.logWeight;
+    sample->likelihood = evaluated.likelihood;
+    sample->logLikelihood = evaluated.logLikelihood;
+  }
+  return unique.size();
 }
 
 /**
- * @brief This function implements Metropolis algorithm and weight mixing method of Mixture-MCL
+ * @brief Buffers of the fused Metropolis step, kept by the caller so that repeated steps do not allocate
+ */
+typedef struct
+{
+  population_t parents;
+  population_t children;
+  std::vector<double> log_likelihood;//of the current state of each chain
+  std::vector<unsigned char> accepted;//decisions of the last iteration
+  int accepted_count;//in the last iteration
+  geometry_msgs::PoseArray accepted_cloud;
+  geometry_msgs::PoseArray rejected_cloud;
+} metropolis_buffer_t;
+
+/**
+ * @brief This function implements Metropolis algorithm and weight mixing method of Mixture-MCL in a single pass per iteration
  * The particles accepted by Metropolis are seen as the samples drawn from measurement model.
  * Then it uses kernel density estimation to estimate the density probability of those particles.
+ * @details Each thread evaluates the measurement model on its own range of proposals, then accepts and weights them.
+ * The old chains are only evaluated once before the first iteration, later iterations reuse the cached log-likelihood of each chain.
  *
  * @param[in] ldata The object for measurement model
  * @param[in] ita The normalizer for Mixture-MCL
  * @param[in] kdt The object for Kernel Density Estimation
  * @param[in] demc_params The parameters for DEMC algorithm, a version of Metropolis algorithm
- * @param[in] mapx  
- * @param[in] mapy
- * @param[in] mapx_range
- * @param[in] mapy_range
- * @param[in] rng Random number generator
- * @param[in] old_chains Markov chains at current iteration
- * @param[out] new_chains Markov chains at next iteration
- * @param[out] accepted_cloud Pose array for publishing to topics
- * @param[out] rejected_cloud Pose array for publishing to topics
- * @return Total weight of all evaluated particles
+ * @param[in] mapx The pair of minimum and maximum values in X-axis of map coordinate in meters
+ * @param[in] mapy The pair of minimum and maximum values in Y-axis of map coordinate in meters
+ * @param[in] mapx_range The distance between the minimum and maximum in X-axis in meters
+ * @param[in] mapy_range The distance between the minimum and maximum in Y-axis in meters
+ * @param[in] random The streams of the filter the proposal and acceptance streams are taken from
+ * @param[in] iterations The number of Metropolis iterations
+ * @param[in] parallel Whether the measurement model may be evaluated by several threads at once
+ * @param[in] bounded The bounded evaluation of ldata or NULL, with it a proposal is given up as soon as it cannot be accepted
+ * @param[in] fill_clouds Whether accepted_cloud and rejected_cloud of buffer are filled with the last iteration
+ * @param old_chains Markov chains at current iteration, used as scratch space
+ * @param[out] new_chains Markov chains after the last iteration
+ * @param buffer The reused buffers, also reporting the acceptance of the last iteration
+ * @return Total weight of new_chains
  */
-double metropolisRejectAndCalculateWeight(
-  amcl::AMCLLaserData& ldata, 
+inline double metropolisStep(
+  amcl::AMCLLaserData& ldata,
   double ita,
   nuklei::KernelCollection* kdt,
   demc_t* demc_params,
@@ -103,79 +295,107 @@ double metropolisRejectAndCalculateWeight(
   std::pair<double, double> mapy,
   double mapx_range,
   double mapy_range,
-  random_numbers::RandomNumberGenerator rng,
+  RandomStreams& random,
+  int iterations,
+  bool parallel,
+  const BoundedLikelihoodField* bounded,
+  bool fill_clouds,
   pf_sample_set_t* old_chains, //source particles with weight
   pf_sample_set_t* new_chains, //sampled particles with weight
-  geometry_msgs::PoseArray& accepted_cloud,
-  geometry_msgs::PoseArray& rejected_cloud)
+  metropolis_buffer_t& buffer)
 {
-  //propose states of new chains
-  demc::proposal(old_chains, demc_params, mapx, mapy, mapx_range, mapy_range, rng, new_chains);
-  //update_measurement_model for both old_chains and new_chains
+  amcl::AMCLLaser* laser = (amcl::AMCLLaser*)ldata.sensor;
+  const int count = old_chains->sample_count;
+  buffer.parents.gather(old_chains);
+  buffer.log_likelihood.resize(count);
+  buffer.accepted.resize(count);
+  new_chains->sample_count = count;
   //note that old_chains is resampled particle set with equal weights
-  ((amcl::AMCLLaser*)ldata.sensor)->UpdateSensorWithSet(old_chains, &ldata);
-  ((amcl::AMCLLaser*)ldata.sensor)->UpdateSensorWithSet(new_chains, &ldata);
-  
-  //for each sample of new_chains, apply acceptance and rejection scheme
-  double total = 0;
-  double log_uniform, log_alpha;
-  pf_sample_t* old_state;
-  pf_sample_t* new_state;
-  pf_vector_t vec_pose;
-  nuklei::kernel::se3 se3_pose;
-  for(int i = 0 ; i < new_chains->sample_count ; ++i)
+  updateSensorBatched(ldata, parallel, bounded, old_chains);
+  for(int i = 0 ; i < count ; ++i)
+    buffer.log_likelihood[i] = old_chains->samples[i].logWeight;
+  for(int m = 0 ; m < std::max(1, iterations) ; ++m)
   {
-    old_state = old_chains->samples + i;
-    new_state = new_chains->samples + i;
-    //calculate alpha
-    log_alpha = new_state->logWeight - old_state->logWeight;
-    if(log_alpha < 0)
-      log_uniform = std::log(rng.uniform01());
-    else
-      log_uniform = 0;
-
-    //if accepted 
-    if(log_uniform <= log_alpha)
+    //proposal uses blocks 0 and 1 of each stream, the acceptance test block 2
+    Philox4x32 streams = proposalStreams(random);
+    proposal(buffer.parents, demc_params, mapx, mapy, mapx_range, mapy_range, streams, buffer.children);
+    auto worker = [&](int beg, int end)
     {
-      //calculate weight for new_state according to kernel density tree of previous poses
-      //move the sample from new_chains to old_chains
-      old_state->pose = new_state->pose;
-      //vec_pose = new_state->pose;
-      //nuklei::kernel::se3 se3_pose;
-      MixmclNode::poseToSe3(old_state->pose, se3_pose);
-      old_state->weight = ita * (kdt->evaluationAt(se3_pose));
-
-      //publish the accepted particle to particlecloud2
-      geometry_msgs::Pose p;
-      tf::poseTFToMsg(
-        tf::Pose(
-          tf::createQuaternionFromYaw(
-            old_state->pose.v[2]),
-          tf::Vector3(
-            old_state->pose.v[0],
-            old_state->pose.v[1], 
-            0)),
-          p);
-      accepted_cloud.poses.push_back(p);
-    }
-    //if rejected
+      for(int i = beg ; i < end ; ++i)
+      {
+        pf_sample_t* new_state = new_chains->samples + i;
+        new_state->pose.v[0] = buffer.children.x[i];
+        new_state->pose.v[1] = buffer.children.y[i];
+        new_state->pose.v[2] = buffer.children.a[i];
+        new_state->weight = 1.0;
+      }
+      //evaluate this range only, through a view of the sample sets
+      pf_sample_set_t view = *new_chains;
+      view.samples = new_chains->samples + beg;
+      view.sample_count = end - beg;
+      //a proposal is rejected once its bound falls below the log-likelihood of its chain plus the log of the
+      //acceptance draw, it keeps the bound so that the test below rejects it with the same draw
+      if(bounded)
+        for(int i = beg ; i < end ; ++i)
+          bounded->evaluate(new_chains->samples + i,
+                            buffer.log_likelihood[i] + std::log(Philox4x32::toUniform(streams.block(i, 2).v[0])));
+      else
+        laser->UpdateSensorWithSet(&view, &ldata);
+      nuklei::kernel::se3 se3_pose;
+      for(int i = beg ; i < end ; ++i)
+      {
+        pf_sample_t* old_state = old_chains->samples + i;
+        pf_sample_t* new_state = new_chains->samples + i;
+        double log_alpha = new_state->logWeight - buffer.log_likelihood[i];
+        double log_uniform = log_alpha < 0 ? std::log(Philox4x32::toUniform(streams.block(i, 2).v[0])) : 0;
+        buffer.accepted[i] = log_uniform <= log_alpha;
+        if(buffer.accepted[i])
+        {
+          //calculate weight for new_state according to kernel density tree of previous poses
+          old_state->pose = new_state->pose;
+          MixmclNode::poseToSe3(old_state->pose, se3_pose);
+          old_state->weight = ita * (kdt->evaluationAt(se3_pose));
+          buffer.log_likelihood[i] = new_state->logWeight;
+          buffer.parents.x[i] = buffer.children.x[i];
+          buffer.parents.y[i] = buffer.children.y[i];
+          buffer.parents.a[i] = buffer.children.a[i];
+        }
+      }
+    };
+    if(parallel)
+      parallelFor(count, worker);
     else
+      worker(0, count);
+  }
+
+  //the rejected proposals are still in new_chains, emit the clouds before they are overwritten
+  buffer.accepted_count = 0;
+  for(int i = 0 ; i < count ; ++i)
+    buffer.accepted_count += buffer.accepted[i];
+  if(fill_clouds)
+  {
+    buffer.accepted_cloud.poses.resize(buffer.accepted_count);
+    buffer.rejected_cloud.poses.resize(count - buffer.accepted_count);
+    int accepted_idx = 0, rejected_idx = 0;
+    for(int i = 0 ; i < count ; ++i)
     {
-      //publishe the rejected ones to particlecloud3 topic
-      geometry_msgs::Pose p;
+      const pf_vector_t& pose = buffer.accepted[i] ? old_chains->samples[i].pose : new_chains->samples[i].pose;
+      geometry_msgs::Pose& p = buffer.accepted[i] ?
+        buffer.accepted_cloud.poses[accepted_idx++] : buffer.rejected_cloud.poses[rejected_idx++];
       tf::poseTFToMsg(
         tf::Pose(
-          tf::createQuaternionFromYaw(
-            new_state->pose.v[2]),
-          tf::Vector3(
-            new_state->pose.v[0],
-            new_state->pose.v[1], 
-            0)),
-          p);
-      rejected_cloud.poses.push_back(p);
+          tf::createQuaternionFromYaw(pose.v[2]),
+          tf::Vector3(pose.v[0], pose.v[1], 0)),
+        p);
     }
-    
-    total += old_state->weight;
+  }
+
+  double total = 0;
+  for(int i = 0 ; i < count ; ++i)
+  {
+    new_chains->samples[i] = old_chains->samples[i];
+    new_chains->samples[i].logWeight = buffer.log_likelihood[i];
+    total += new_chains->samples[i].weight;
   }
   return total;
 }
@@ -0,0 +1,35 @@
+#ifndef LIKELIHOOD_PYRAMID_H
+#define LIKELIHOOD_PYRAMID_H
+#include <cstddef>
+#include <vector>
+#include "amcl/map/map.h"
+
+//Min-pooled pyramid of the obstacle distance field of a map.
+//A cell of level k holds the smallest occ_dist of its 2^k x 2^k block of map cells,
+//so the nearest obstacle to any point of a disc can be bounded from below by a few coarse lookups.
+class LikelihoodPyramid
+{
+  public:
+    LikelihoodPyramid();
+    /**
+     * @brief builds the pyramid from the occ_dist of the map.
+     * @param[in] map the occupancy map with its distance field computed, must outlive the pyramid
+     */
+    void init(const map_t* map);
+    int levels() const { return widths_.size(); }
+    /**
+     * @brief lower bound of occ_dist over every map cell a point within radius of (wx, wy) falls into.
+     * @param[in] wx x of the center in world coordinates
+     * @param[in] wy y of the center in world coordinates
+     * @param[in] radius radius of the disc in meters
+     * @return the bound, max_occ_dist if the disc lies off the map
+     */
+    double minDistance(double wx, double wy, double radius) const;
+    size_t bytes() const;
+  private:
+    const map_t* map_;
+    std::vector<int> widths_;
+    std::vector<int> heights_;
+    std::vector<std::vector<float> > distances_;//[level][y*width+x]
+};
+#endif //LIKELIHOOD_PYRAMID_H
@@ -0,0 +1,57 @@
+#ifndef MARKOV_GRID_H
+#define MARKOV_GRID_H
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "amcl/map/map.h"
+#include "amcl/pf/pf_vector.h"
+#include "mcl/FreeSpaceIndex.h"
+
+//Compact belief store of the Markov grid.
+//A sample index is free_idx*size_a + heading index, its pose is derived from the index on demand,
+//so the two sets only hold one float weight per sample.
+class MarkovGrid
+{
+  public:
+    MarkovGrid();
+    /**
+     * @brief lays out the grid over the free cells of the map.
+     * @param[in] free_space free cells of the occupancy map, the map must outlive the grid
+     * @param[in] size_a number of heading bins
+     * @param[in] ares angular resolution in degree
+     * @param[in] weight initial weight of every sample in both sets
+     */
+    void init(const FreeSpaceIndex& free_space, int size_a, int ares, float weight);
+    //number of samples, free cells times headings
+    int size() const { return size_; }
+    int freeCount() const { return cells_.size(); }
+    int sizeA() const { return size_a_; }
+    //weights of the current and the previous set
+    float* current() { return &weights_[current_set_][0]; }
+    float* previous() { return &weights_[(current_set_+1)%2][0]; }
+    const float* current() const { return &weights_[current_set_][0]; }
+    int currentSet() const { return current_set_; }
+    void flip() { current_set_ = (current_set_+1)%2; }
+    //free cell index of the map cell (x, y), -1 if it is not free or not on the map
+    int freeIndex(int x, int y) const
+    { return MAP_VALID(map_, x, y) ? map2free_[MAP_INDEX(map_, x, y)] : -1; }
+    int cellX(int free_idx) const { return cells_[free_idx] % map_->size_x; }
+    int cellY(int free_idx) const { return cells_[free_idx] / map_->size_x; }
+    int freeIdx(int idx) const { return idx / size_a_; }
+    int headingIdx(int idx) const { return idx % size_a_; }
+    double heading(int a) const { return -M_PI + ((a*ares_)/180.0)*M_PI; }
+    pf_vector_t pose(int idx) const;
+    size_t bytes() const;
+  private:
+    const map_t* map_;
+    int size_a_;
+    int ares_;
+    int size_;
+    int current_set_;
+    std::vector<int32_t> cells_;//row-major map index of each free cell
+    std::vector<int32_t> map2free_;//row-major over the whole map, -1 for cells which are not free
+    std::vector<float> weights_[2];
+};
+#endif //MARKOV_GRID_H
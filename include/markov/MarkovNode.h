@@ -2,6 +2,9 @@
 #include "stamped_std_msgs/StampedFloat64MultiArray.h"
 #include "std_msgs/Float64MultiArray.h"
 #include "std_msgs/UInt16MultiArray.h"
+#include "markov/LikelihoodPyramid.h"
+#include "markov/MarkovGrid.h"
+#include "markov/MotionKernel.h"
 #include <thread>
 #include <mutex>
 #include <functional>
@@ -23,7 +26,7 @@ class MarkovNode : public MCL<MarkovNode>
 
   friend class MCL;
   public:
-    MarkovNode();
+    MarkovNode(const std::string& ns = "");
     ~MarkovNode();
   protected:
     ros::Publisher histograms_pub_;
@@ -32,26 +35,91 @@ class MarkovNode : public MCL<MarkovNode>
     std_msgs::Float64MultiArray positions_msg_;
     ros::Publisher indices_pub_;
     std_msgs::UInt16MultiArray free_idcs_msg_;
-    std::vector<std::vector<int> > mapidx2freeidx_;
-    pf_t *grid_;
+    ros::Publisher sparse_histograms_pub_;
+    std_msgs::MultiArrayLayout sparse_hist_layout_;
+    MarkovGrid grid_;
     int cloud_size_;
     int ares_;
     int size_a_;
     double radius_;
     double epson_;
+    //pending normalization of the dense prior, applied by the next laser update
+    double prior_scale_;
+    //scheme of downsizingSampling, from resample_type
+    pf_resample_scheme_t resample_scheme_;
+    bool resample_kld_;
     bool motion_update_flag_;
     int laser_buffer_size_;
     std::vector<int> active_sample_indices_;
+    //sparse belief: only active cells and a dilation band around them are evaluated,
+    //every other cell implicitly holds inactive_weight_
+    bool sparse_belief_;
+    int sparse_dilation_;
+    double inactive_weight_;
+    std::vector<int> band_indices_;
+    std::vector<unsigned char> band_mask_;
+    std::vector<unsigned char> cell_mask_;
+    std::vector<int> band_cells_;
+    //indices holding more than the floor weight in each set of grid_
+    std::vector<int> stale_indices_[2];
+    //motion update by separable convolution
+    std::string motion_update_type_;
+    int motion_kernel_rank_;
+    //motion matrices and kernels are cached by quantized delta, the cache the motion update uses is bounded by motion_cache_size
+    double motion_delta_linear_res_;
+    double motion_delta_angular_res_;
+    MotionKernelCache<MotionMatrixStack> matrix_cache_;
+    MotionKernelCache<MotionKernelStack> kernel_cache_;
+    std::vector<float> slices_;
+    //hierarchical laser update: regions of 2^k x 2^k cells and 2^k headings are bounded from
+    //the coarsest level down and only those within hierarchical_threshold_ of the best are refined
+    struct GridRegion
+    {
+      int level;
+      int bx;
+      int by;
+      int g;
+    };
+    int hierarchical_levels_;
+    double hierarchical_threshold_;
+    LikelihoodPyramid likelihood_pyramid_;
+    std::vector<std::vector<float> > belief_pyramid_;//[level][(g*height+by)*width+bx], level 0 is unused
+    std::vector<unsigned char> evaluated_mask_;
+    static int levelSize(int size, int level) { return (size + (1 << level) - 1) >> level; }
+    size_t beliefIndex(int level, int bx, int by, int g) const
+    { return ((size_t)g*levelSize(map_->size_y, level) + by)*levelSize(map_->size_x, level) + bx; }
+    void buildBeliefPyramid();
+    double regionBound(amcl::AMCLLaser* self, amcl::AMCLLaserData* ldata, const GridRegion& region) const;
+    void regionChildren(const GridRegion& region, std::vector<GridRegion>& children) const;
+    void regionSamples(const GridRegion& region, std::vector<int>& indices) const;
+    double UpdateLaserHierarchical(amcl::AMCLLaserData* ldata);
     void initialMarkovGrid();
-    int downsizingSampling(pf_sample_set_t* set_a, pf_sample_set_t* set_b, int target_size);
+    int downsizingSampling(pf_sample_set_t* set_b, int target_size, const std::vector<int>* indices = NULL);
+    void buildActiveBand();
+    double UpdateLaserSparse(amcl::AMCLLaserData* ldata);
+    void publishSparseHistogram(const ros::Time& stamp);
 
-    void laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan);
+    //sizes the grid, the cloud and the thresholds on free_space_ and initializes the grid, nothing before the first map
+    void mapStage();
+    //stages of MCL::laserReceived, the grid replaces the particle set
+    void initialStage();
+    void motionStage(amcl::AMCLOdomData& odata);
+    void sensorStage(amcl::AMCLLaserData& ldata, const ros::Time& stamp);
+    bool fusionSupported() const { return false; }
+    bool resampleStage(const ros::Time& stamp, bool initial);
     double UpdateOdom(amcl::AMCLOdomData* ndata);
-    double UpdateLaser(amcl::AMCLLaserData* ldata);
-    double UpdateLaserParallel(amcl::AMCLLaserData* ldata);
+    double UpdateLaserParallel(amcl::AMCLLaserData* ldata, const std::vector<int>* indices);
+    void UpdateLogWeights(amcl::AMCLLaserData* ldata, const std::vector<int>* indices, pf_log_sum_t* log_total);
+    double RescaleLogWeights(const std::vector<int>* indices, double log_total);
     double motionModelS(const pf_sample_t* sample_a, const pf_sample_t* sample_b, const amcl::AMCLOdom* odom, const double delta_rot1, const double delta_trans, const double delta_rot2);
     double UpdateOdomO(amcl::AMCLOdomData* ndata);
-    static double UpdateParticle(amcl::AMCLLaser* self, amcl::AMCLLaserData* ldata, pf_sample_t* sample);
+    double UpdateOdomC(amcl::AMCLOdomData* ndata);
+    void motionDelta(amcl::AMCLOdomData* ndata, double& delta_rot1, double& delta_trans, double& delta_rot2);
+    MotionDeltaKey quantizeDelta(double& delta_rot1, double& delta_trans, double& delta_rot2);
+    void buildMotionMatrices(double delta_rot1, double delta_trans, double delta_rot2, std::vector<double>& side, MatMatrices& mat_prob_matrices);
+    boost::shared_ptr<MotionMatrixStack> motionMatrices(double delta_rot1, double delta_trans, double delta_rot2);
+    boost::shared_ptr<MotionKernelStack> buildKernelStack(double delta_rot1, double delta_trans, double delta_rot2);
+    static double ParticleLogLikelihood(amcl::AMCLLaser* self, amcl::AMCLLaserData* ldata, const pf_vector_t& robot_pose);
     static void odometry(const double oldx, const double oldy, const double olda, const double newx, const double newy, const double newa, double& delta_rot1_hat, double& delta_trans_hat, double& delta_rot2_hat);
     static double motionModelO(const amcl::AMCLOdom* odom, const double delta_rot1, const double delta_trans, const double delta_rot2, const double delta_rot1_hat, const double delta_trans_hat, const double delta_rot2_hat);
     void GLCB(){};
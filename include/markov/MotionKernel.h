@@ -0,0 +1,144 @@
+#ifndef MOTION_KERNEL_H
+#define MOTION_KERNEL_H
+#include <cstddef>
+#include <list>
+#include <map>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+//Low rank separable approximation of a square motion kernel K,
+//K(i,j) ~ sum_r u[r][i]*v[r][j] where i runs along x and j along y.
+struct SeparableKernel
+{
+  int rank;
+  std::vector<float> u;//rank*matsize, applied along x
+  std::vector<float> v;//rank*matsize, applied along y
+  SeparableKernel(): rank(0) {}
+};
+
+//separable kernels of every (current heading, previous heading) pair for one odometry delta
+struct MotionKernelStack
+{
+  int matsize;
+  int center;//index of the zero offset along each axis
+  int size_a;
+  std::vector<SeparableKernel> kernels;//size_a*size_a, indexed by a*size_a + previous a
+  const SeparableKernel& at(int a, int previous_a) const
+  { return kernels[a*size_a + previous_a]; }
+  size_t bytes() const;
+};
+
+//dense motion matrices of every (current heading, previous heading) pair for one odometry delta
+struct MotionMatrixStack
+{
+  std::vector<double> side;//offsets along each axis
+  std::vector<std::vector<std::vector<double> > > matrices;//[a][previous a][i*matsize+j]
+  size_t bytes() const;
+};
+
+//quantized (delta_rot1, delta_trans, delta_rot2) used to look kernels up
+struct MotionDeltaKey
+{
+  long rot1;
+  long trans;
+  long rot2;
+  bool operator==(const MotionDeltaKey& other) const
+  { return rot1 == other.rot1 && trans == other.trans && rot2 == other.rot2; }
+  bool operator!=(const MotionDeltaKey& other) const
+  { return !(*this == other); }
+  bool operator<(const MotionDeltaKey& other) const
+  {
+    if(rot1 != other.rot1) return rot1 < other.rot1;
+    if(trans != other.trans) return trans < other.trans;
+    return rot2 < other.rot2;
+  }
+};
+
+//least recently used cache of kernel stacks keyed by quantized motion delta,
+//bounded by the memory reported by Stack::bytes()
+template<class Stack>
+class MotionKernelCache
+{
+  public:
+    typedef boost::shared_ptr<Stack> StackPtr;
+    MotionKernelCache(size_t max_bytes = 0): max_bytes_(max_bytes), bytes_(0), hits_(0), misses_(0) {}
+    void setMaxBytes(size_t max_bytes)
+    {
+      max_bytes_ = max_bytes;
+      evict();
+    }
+    //returns NULL on a miss
+    StackPtr get(const MotionDeltaKey& key)
+    {
+      typename Index::iterator it = index_.find(key);
+      if(it == index_.end())
+      {
+        ++misses_;
+        return StackPtr();
+      }
+      ++hits_;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return it->second->stack;
+    }
+    void put(const MotionDeltaKey& key, const StackPtr& stack)
+    {
+      typename Index::iterator it = index_.find(key);
+      if(it != index_.end())
+      {
+        bytes_ -= it->second->bytes;
+        entries_.erase(it->second);
+        index_.erase(it);
+      }
+      Entry entry = {key, stack, stack->bytes()};
+      entries_.push_front(entry);
+      index_[key] = entries_.begin();
+      bytes_ += entry.bytes;
+      evict();
+    }
+    void clear()
+    {
+      entries_.clear();
+      index_.clear();
+      bytes_ = 0;
+    }
+    size_t size() const { return entries_.size(); }
+    size_t bytes() const { return bytes_; }
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+  private:
+    struct Entry
+    {
+      MotionDeltaKey key;
+      StackPtr stack;
+      size_t bytes;
+    };
+    typedef std::list<Entry> Entries;
+    typedef std::map<MotionDeltaKey, typename Entries::iterator> Index;
+    //the most recent stack is always kept, even if it alone exceeds the bound
+    void evict()
+    {
+      while(bytes_ > max_bytes_ && entries_.size() > 1)
+      {
+        bytes_ -= entries_.back().bytes;
+        index_.erase(entries_.back().key);
+        entries_.pop_back();
+      }
+    }
+    Entries entries_;
+    Index index_;
+    size_t max_bytes_;
+    size_t bytes_;
+    size_t hits_;
+    size_t misses_;
+};
+
+/**
+ * @brief approximates a row major matsize x matsize matrix by at most max_rank separable terms.
+ * @param[in] matrix the matrix, matrix[i*matsize+j]
+ * @param[in] matsize the size of each side
+ * @param[in] max_rank the maximum number of separable terms
+ * @param[in] tolerance terms whose singular value is below tolerance times the first one are dropped
+ * @param[out] kernel the resulting separable kernel, rank 0 if the matrix vanishes
+ */
+void separableApproximation(const std::vector<double>& matrix, int matsize, int max_rank, double tolerance, SeparableKernel& kernel);
+#endif //MOTION_KERNEL_H
@@ -0,0 +1,58 @@
+#ifndef MCL_BAG_REPLAY_H
+#define MCL_BAG_REPLAY_H
+#include <string>
+#include <vector>
+#include "sensor_msgs/LaserScan.h"
+#include "nav_msgs/Odometry.h"
+#include "tf2_msgs/TFMessage.h"
+
+//Messages of a bag file decoded once and kept in bag order, so that MCL<D>::replay can drive a filter
+//in-process without ROS transport, and several filters can replay the same recording.
+class BagRecording
+{
+  public:
+    enum EventType { TF, TF_STATIC, SCAN, GROUND_TRUTH };
+    typedef struct
+    {
+      EventType type;
+      int index;//into the vector of its type
+    } event_t;
+
+    /**
+     * @brief reads the tf, scan and ground truth messages of a bag.
+     * @param[in] path bag file
+     * @param[in] scan_topic laser scans
+     * @param[in] ground_truth_topic nav_msgs::Odometry of the true pose in the global frame, empty if none
+     * @return false if the bag cannot be read
+     */
+    bool load(const std::string& path, const std::string& scan_topic, const std::string& ground_truth_topic);
+
+    std::vector<event_t> events;
+    std::vector<tf2_msgs::TFMessage::ConstPtr> tfs;
+    std::vector<sensor_msgs::LaserScan::ConstPtr> scans;
+    std::vector<nav_msgs::Odometry::ConstPtr> ground_truth;
+};
+
+//accuracy against the ground truth and wall time per scan of one replay
+class ReplayStats
+{
+  public:
+    ReplayStats();
+    void addLatency(double seconds);
+    void addError(double dx, double dy, double da);
+    double meanLatency() const { return scans > 0 ? latency_sum / scans : 0.0; }
+    double meanError() const { return errors > 0 ? error_sum / errors : 0.0; }
+    double rmsError() const;
+    double meanYawError() const { return errors > 0 ? yaw_error_sum / errors : 0.0; }
+
+    int scans;//handed to the filter
+    int dropped;//never transformable into the odometric frame
+    int updates;//published a new pose
+    int errors;//updates with a ground truth pose before them
+    double latency_sum, latency_max;
+    double error_sum, error_sq_sum, error_max;
+    double yaw_error_sum;
+    double runtime;//wall time of the whole replay
+};
+
+#endif //MCL_BAG_REPLAY_H
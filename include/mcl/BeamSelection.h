@@ -0,0 +1,45 @@
+#ifndef MCL_BEAM_SELECTION_H
+#define MCL_BEAM_SELECTION_H
+#include <string>
+#include <vector>
+#include "amcl/map/map.h"
+#include "amcl/pf/pf_vector.h"
+#include "mcl/philox.h"
+
+//which laser_max_beams beams of a scan the measurement models evaluate, chosen once per scan for all samples
+typedef enum
+{
+  BEAM_SELECTION_STRIDE,//every (range_count-1)/(max_beams-1)-th beam, left to the models
+  BEAM_SELECTION_INFORMATION,//per bearing sector the beam ending where the distance field is steepest, needs occ_dist
+  BEAM_SELECTION_STRATIFIED,//one beam per range quantile
+  BEAM_SELECTION_RANDOM//beams drawn anew for every scan
+} beam_selection_t;
+
+//laser_beam_selection names stride, information, stratified and random, returns false if name is none of them
+bool beamSelectionByName(const std::string& name, beam_selection_t* selection);
+
+//Picks the beams of a scan, its buffers are kept across scans.
+class BeamSelector
+{
+  public:
+    /**
+     * @brief picks max_beams of the beams of a scan that are not NaN.
+     * @param[in] selection strategy, BEAM_SELECTION_STRIDE keeps every beam
+     * @param[in] ranges range and bearing in the base frame of each beam
+     * @param[in] count number of beams
+     * @param[in] max_beams beams to keep
+     * @param[in] map distance field of the likelihood field models, for BEAM_SELECTION_INFORMATION
+     * @param[in] pose laser pose in the map the beams are cast from, for BEAM_SELECTION_INFORMATION
+     * @param rng generator of the random strategies
+     * @return indices of the selected beams in ascending order
+     */
+    const std::vector<int>& select(beam_selection_t selection, const double (*ranges)[2], int count, int max_beams,
+                                   const map_t* map, const pf_vector_t& pose, Philox4x32& rng);
+  private:
+    //slope of the distance field at the end of beam i, 0 off the map
+    double endpointSlope(const double (*ranges)[2], int i, const map_t* map, const pf_vector_t& pose) const;
+    std::vector<int> valid_;
+    std::vector<int> beams_;
+};
+
+#endif //MCL_BEAM_SELECTION_H
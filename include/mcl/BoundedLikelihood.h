@@ -0,0 +1,42 @@
+#ifndef MCL_BOUNDED_LIKELIHOOD_H
+#define MCL_BOUNDED_LIKELIHOOD_H
+#include <vector>
+#include "amcl/map/map.h"
+#include "amcl/pf/pf.h"
+#include "amcl/sensors/amcl_laser.h"
+
+//Likelihood field model evaluated beam by beam with an upper bound on what the remaining beams can add,
+//so that a pose can be given up as soon as its log-likelihood is certain to stay below a bound.
+//It sums log(pz) over the beams of the model stride like MarkovNode::ParticleLogLikelihood.
+class BoundedLikelihoodField
+{
+  public:
+    /**
+     * @brief takes the beams of a scan the model would evaluate, in an order that spreads the first ones over the scan.
+     * @param[in] ldata scan of a likelihood field laser, must outlive the evaluations
+     */
+    void setScan(amcl::AMCLLaserData* ldata);
+    /**
+     * @brief log-likelihood of the scan at robot_pose, stopped once it is known to be below bound.
+     * @param[in] robot_pose pose of the robot in the map
+     * @param[in] bound -inf evaluates every beam
+     * @param[out] complete whether every beam was evaluated, may be NULL
+     * @return the log-likelihood, or an upper bound of it below bound if the evaluation stopped
+     */
+    double logLikelihood(const pf_vector_t& robot_pose, double bound, bool* complete = NULL) const;
+    /**
+     * @brief evaluates a sample like UpdateSensorWithSet does, weight is kept in preWeight and multiplied by the likelihood.
+     * @details a sample stopped below bound keeps the upper bound as its log-likelihood
+     * @return whether every beam was evaluated
+     */
+    bool evaluate(pf_sample_t* sample, double bound) const;
+  private:
+    amcl::AMCLLaser* laser_;
+    double z_hit_denom_;
+    double z_rand_term_;
+    double log_pz_max_;//of a beam ending on an obstacle
+    std::vector<double> ranges_;//evaluated beams in evaluation order
+    std::vector<double> bearings_;
+};
+
+#endif //MCL_BOUNDED_LIKELIHOOD_H
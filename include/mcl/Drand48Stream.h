@@ -0,0 +1,42 @@
+#ifndef MCL_DRAND48_STREAM_H
+#define MCL_DRAND48_STREAM_H
+#include <cstdlib>
+#include <boost/thread/mutex.hpp>
+
+//State of drand48 kept by one filter. amcl's odometry model, pf_init and pf_update_resample draw from
+//the process-wide drand48, so every filter of the process swaps its own state in under one mutex and
+//concurrent filters neither race on it nor perturb the draws of each other.
+class Drand48Stream
+{
+  public:
+    explicit Drand48Stream(long seed = 0) { reseed(seed); }
+    //the state srand48(seed) sets
+    void reseed(long seed)
+    {
+      x_[0] = 0x330E;
+      x_[1] = seed & 0xFFFF;
+      x_[2] = (seed >> 16) & 0xFFFF;
+    }
+    //drand48 draws from stream while a Lock is alive
+    class Lock
+    {
+      public:
+        explicit Lock(Drand48Stream& stream) : stream_(stream), lock_(mutex_) { seed48(stream_.x_); }
+        ~Lock()
+        {
+          //seed48 hands back the state it replaces
+          unsigned short* x = seed48(stream_.x_);
+          stream_.x_[0] = x[0];
+          stream_.x_[1] = x[1];
+          stream_.x_[2] = x[2];
+        }
+      private:
+        Drand48Stream& stream_;
+        boost::mutex::scoped_lock lock_;
+    };
+  private:
+    unsigned short x_[3];
+    static boost::mutex mutex_;
+};
+
+#endif //MCL_DRAND48_STREAM_H
@@ -0,0 +1,76 @@
+#ifndef MCL_FREE_SPACE_INDEX_H
+#define MCL_FREE_SPACE_INDEX_H
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "amcl/map/map.h"
+#include "amcl/pf/pf_vector.h"
+#include "mcl/philox.h"
+
+//Free cells of a map as flat int32 row-major cell ids.
+//Cells are drawn uniformly, or weighted by the distance transform through an alias table, in O(1) each.
+//The arrays are stored back to back on disk, keyed by a hash of the map, so that a cached index
+//is read (or mapped) in one go instead of scanning the map again.
+class FreeSpaceIndex
+{
+  public:
+    FreeSpaceIndex();
+    /**
+     * @brief indexes the free cells of map.
+     * @param[in] map the occupancy map, must outlive the index; occ_dist has to be up to date if dt_weight > 0
+     * @param[in] dt_weight a cell is drawn with weight 1 + dt_weight*occ_dist, 0 draws every cell alike
+     * @param[in] cache_dir directory of cached indices, empty to disable the cache
+     * @return true if the index was read from the cache
+     */
+    bool build(const map_t* map, double dt_weight, const std::string& cache_dir);
+    int size() const { return cells_.size(); }
+    bool empty() const { return cells_.empty(); }
+    bool weighted() const { return !alias_.empty(); }
+    const map_t* map() const { return map_; }
+    uint64_t hash() const { return hash_; }
+    int32_t cell(int k) const { return cells_[k]; }
+    int cellX(int k) const { return cells_[k] % map_->size_x; }
+    int cellY(int k) const { return cells_[k] / map_->size_x; }
+    //pose at the centre of free cell k
+    pf_vector_t pose(int k, double heading) const
+    {
+      pf_vector_t p;
+      p.v[0] = MAP_WXGX(map_, cellX(k));
+      p.v[1] = MAP_WYGY(map_, cellY(k));
+      p.v[2] = heading;
+      return p;
+    }
+    //free cell drawn from two uniform values in [0, 1)
+    int drawCell(double u0, double u1) const
+    {
+      int k = std::min((int)(u0*cells_.size()), (int)cells_.size() - 1);
+      if(!alias_.empty() && u1 >= prob_[k])
+        k = alias_[k];
+      return k;
+    }
+    //one pose of a free cell with a uniform heading, rng is any generator with uniform01()
+    template<class Rng>
+    pf_vector_t samplePose(Rng& rng) const
+    {
+      int k = drawCell(rng.uniform01(), alias_.empty() ? 0.0 : rng.uniform01());
+      return pose(k, rng.uniform01() * 2 * M_PI - M_PI);
+    }
+    //count poses in parallel, pose i only draws from stream i of streams
+    void samplePoses(const Philox4x32& streams, int count, pf_vector_t* poses) const;
+    size_t bytes() const;
+    //hash of the map geometry, its occupancy and the weighting
+    static uint64_t mapHash(const map_t* map, double dt_weight);
+  private:
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
+    void buildAliasTable(const std::vector<double>& weights);
+    const map_t* map_;
+    uint64_t hash_;
+    std::vector<int32_t> cells_;
+    std::vector<float> prob_;//alias table, empty when cells are drawn uniformly
+    std::vector<int32_t> alias_;
+};
+#endif //MCL_FREE_SPACE_INDEX_H
@@ -1,6 +1,7 @@
 #ifndef MCL_H
 #define MCL_H
 #include <algorithm>
+#include <deque>
 #include <vector>
 #include <map>
 #include <cmath>
@@ -13,8 +14,12 @@
 #include "amcl/sensors/amcl_odom.h"
 #include "amcl/sensors/amcl_laser.h"
 #include "amcl/pf/pf_resample.h"
-
-#include "random_numbers/random_numbers.h"
+#include "mcl/BeamSelection.h"
+#include "mcl/BoundedLikelihood.h"
+#include "mcl/Drand48Stream.h"
+#include "mcl/FreeSpaceIndex.h"
+#include "mcl/MapPreprocess.h"
+#include "mcl/philox.h"
 
 #include "ros/assert.h"
 
@@ -47,6 +52,7 @@
 #include <rosbag/bag.h>
 #include <rosbag/view.h>
 #include <boost/foreach.hpp>
+#include "mcl/BagReplay.h"
 
 #define NEW_UNIFORM_SAMPLING 1
 
@@ -91,7 +97,9 @@ template<class Derived>
 class MCL 
 {
   protected:
-    MCL();
+    //ns puts the topics, services and private parameters of the filter under a namespace of its own,
+    //so that several filters can run side by side in one process
+    MCL(const std::string& ns = "");
   public:
     ~MCL();
 
@@ -101,10 +109,29 @@ class MCL
      */
     void runFromBag(const std::string &in_bag_fn);
 
+    /**
+     * @brief Replays a bag file in-process as fast as possible: the tf messages go straight
+     * into the buffer of tf_ and every scan is handed to laserReceived as soon as it can be
+     * transformed, without any ROS transport. Accuracy against the ground truth and latency are logged.
+     * invoked in main
+     */
+    void runFromBagFast(const std::string &in_bag_fn);
+
+    /**
+     * @brief drives the filter synchronously with a decoded recording.
+     * @param[in] recording messages in bag order
+     * @param[out] stats accuracy and latency of the replay
+     */
+    void replay(const BagRecording& recording, ReplayStats& stats);
+
+    //hands a map to the filter as if it had arrived on the map topic
+    void setMap(const nav_msgs::OccupancyGrid& msg);
+
     int process();
     void savePoseToServer();
 
-    static random_numbers::RandomNumberGenerator rng_;
+    //amcl's odometry model, pf_init and pf_update_resample draw from the process-wide drand48
+    Drand48Stream drand48_;
 
   protected:
     tf::TransformBroadcaster* tfb_;
@@ -122,10 +149,17 @@ class MCL
     tf::Transform latest_tf_;
     bool latest_tf_valid_;
 
+    //streams of every sampling stage, seeded by random_seed
+    RandomStreams random_;
+
+    //arg is the FreeSpaceIndex of the node, the poses are drawn from RandomStreams::bound()
     static pf_vector_t uniformPoseGenerator(void* arg);
-#if NEW_UNIFORM_SAMPLING
-    static std::vector<std::pair<int,int> > free_space_indices;
-#endif
+    //free cells of the current map, rebuilt or read from free_space_cache_dir on every map
+    FreeSpaceIndex free_space_;
+    double free_space_dt_weight_;
+    std::string free_space_cache_dir_;
+    //pf_init_model drawing every pose from free_space_ in one parallel batch
+    void initUniformModel();
 
     static inline double getYaw(tf::Pose& t);
 
@@ -150,6 +184,14 @@ class MCL
     void handleMapMessage(const nav_msgs::OccupancyGrid& msg);
     void freeMapDependentMemory();
     map_t* convertMap( const nav_msgs::OccupancyGrid& map_msg );
+    //creates laser_ for map_, the distance map of the likelihood field models is read from map_cache_dir if cached
+    void initLaserModel();
+    //deletes the per-frame copies of laser_, they are made again from laser_ on the next scan
+    void clearLasers();
+    //fills the distance map of map_ unless it is already up to date for laser_likelihood_max_dist_
+    void prepareDistanceMap();
+    std::string map_cache_dir_;
+    double distance_map_max_dist_;//max_occ_dist the distance map of map_ was computed for, < 0 if none
     void updatePoseFromServer();
     void applyInitialPose();
 
@@ -189,6 +231,12 @@ class MCL
     std::vector< amcl::AMCLLaser* > lasers_;
     std::vector< bool > lasers_update_;
     std::map< std::string, int > frame_to_laser_;
+    //scans of several lasers within laser_fusion_window update the filter once, 0 updates it per scan
+    ros::Duration fusion_window_;
+    std::vector<sensor_msgs::LaserScanConstPtr> fusion_scans_;//of the open window, by laser index
+    int fusion_count_;
+    ros::Time fusion_start_;
+    std::vector<double> log_weight_;//of the current set, scratch of the sensor stages weighting in the log domain
 
     // Particle filter
     pf_t *pf_;
@@ -198,6 +246,8 @@ class MCL
     double d_thresh_, a_thresh_;
     int resample_interval_;
     int resample_count_;
+    double ess_;//effective sample size found by the normalization of the last sensor stage, < 0 if unknown
+    double resample_ess_fraction_;
     double laser_min_range_;
     double laser_max_range_;
     void (*resample_function_)(pf_t* );
@@ -212,6 +262,13 @@ class MCL
 
     // For slowing play-back when reading directly from a bag file
     ros::WallDuration bag_scan_period_;
+    std::string bag_scan_topic_;
+    std::string bag_ground_truth_topic_;
+    //blocks until the first map was handled, serving callbacks meanwhile
+    void waitForMap();
+    void logFinalLocation();
+    //one scan of replay, truth is the latest ground truth before the scan
+    void replayScan(const sensor_msgs::LaserScanConstPtr& scan, const nav_msgs::OdometryConstPtr& truth, ReplayStats& stats);
 
     void requestMap();
 
@@ -229,6 +286,7 @@ class MCL
     ros::Publisher pose_pub_;
     ros::Publisher particlecloud_pub_;
     ros::Publisher wpc_pub_;//weighted particle cloud;
+    ros::Publisher ess_pub_;//effective sample size, its fraction of the sample count and the resample decision
     ros::ServiceServer global_loc_srv_;
     ros::ServiceServer nomotion_update_srv_; //to let amcl update samples without requiring motion
     ros::ServiceServer set_map_srv_;
@@ -242,9 +300,17 @@ class MCL
     boost::recursive_mutex configuration_mutex_;
     dynamic_reconfigure::Server<amcl::AMCLConfig> *dsrv_;
     amcl::AMCLConfig default_config_;
+    amcl::AMCLConfig last_config_;//config of the previous reconfigure call, diffed against the next one
     ros::Timer check_laser_timer_;
 
     int max_beams_, min_particles_, max_particles_;
+    //laser_beam_selection, applied by createLaserData
+    beam_selection_t beam_selection_;
+    BeamSelector beam_selector_;
+    //laser_termination_margin, a sample is given up once its log weight is certain to fall this far below
+    //the best of a fixed subset evaluated first, the given up ones weigh exp(-margin) of the best together, < 0 evaluates every beam
+    double termination_margin_;
+    BoundedLikelihoodField bounded_likelihood_;
     double alpha1_, alpha2_, alpha3_, alpha4_, alpha5_;
     double alpha_slow_, alpha_fast_;
     double z_hit_, z_short_, z_max_, z_rand_, sigma_hit_, lambda_short_;
@@ -264,8 +330,88 @@ class MCL
     ros::Duration laser_check_interval_;
     void checkLaserReceived(const ros::TimerEvent& event);
 
+    /**
+     * @brief decides whether the current set is resampled after a sensor update.
+     * With resample_ess_fraction > 0 it is resampled when its effective sample size drops
+     * below that fraction of the sample count, otherwise every resample_interval updates.
+     * The effective sample size and the decision are published on resample_ess.
+     */
+    bool resampleRequired(const ros::Time& stamp);
+
+    /**
+     * @brief laser pipeline shared by every filter: laser setup, and with laser_fusion_window the window
+     * collecting one scan per laser, then updateFilter with the odometric pose, update gating,
+     * the stages of Derived, hypothesis extraction, TF broadcast and pose saving.
+     * Derived hides the default stages below where its algorithm differs, they are bound at compile time.
+     */
+    virtual void laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan);
+    /**
+     * @brief one run of the stages for the scan of laser_index, or for all scans of a fusion window.
+     * @param[in] laser_index laser of laser_scan
+     * @param[in] laser_scan the scan, in a window the latest one, whose stamp and odometric pose the update takes
+     * @param[in] window scans of the window by laser index, NULL for a single scan
+     */
+    void updateFilter(int laser_index, const sensor_msgs::LaserScanConstPtr& laser_scan,
+                      const std::vector<sensor_msgs::LaserScanConstPtr>* window);
+    //updates the filter with the scans of the open window and empties it
+    void flushFusionWindow();
+    //the robot moved since the last update by the laser, or by any laser of the window
+    bool updatePending(int laser_index, const std::vector<sensor_msgs::LaserScanConstPtr>* window) const;
+    //map_ and free_space_ were (re)built by handleMapMessage, before the initial pose is applied
+    void mapStage() {}
+    //mapStage reaches Derived, false while the base constructor runs the first handleMapMessage
+    bool map_stage_ready_;
+    //first scan after the filter was (re)initialized, before the sensor stage
+    void initialStage() {}
+    //the robot moved beyond update_min_d or update_min_a
+    void motionStage(amcl::AMCLOdomData& odata)
+    {
+      Drand48Stream::Lock l(drand48_);
+      odom_->UpdateAction(pf_, (amcl::AMCLSensorData*)&odata);
+    }
+    //weights and normalizes the current set
+    void sensorStage(amcl::AMCLLaserData& ldata, const ros::Time& stamp);
+    /**
+     * @brief the bounded evaluation of ldata if laser_termination_margin enables it for the laser model, NULL otherwise.
+     * @details it serves one scan at a time and stays valid until the next call
+     */
+    const BoundedLikelihoodField* boundedLikelihood(amcl::AMCLLaserData& ldata);
+    //weights the current set by exp(log_weight_) normalized through pf_normalize_log_weights and updates the recovery averages
+    void applyLogWeights();
+    //whether fusedSensorStage applies, false where Derived hides sensorStage with its own algorithm
+    bool fusionSupported() const { return true; }
+    //whether createLaserData may hand the models the selected beams only, false where Derived needs the whole scan
+    bool beamSelectionSupported() const { return true; }
+    //weights the current set by the product of the likelihoods of all scans of a window, then normalizes it
+    void fusedSensorStage(std::vector<amcl::AMCLLaserData*>& ldatas, const ros::Time& stamp);
+    //returns true if the current set was resampled, initial is true on the first scan
+    bool resampleStage(const ros::Time& stamp, bool initial);
+    //resample on the first scan until a transform was sent, whatever resampleRequired says
+    bool resampleInitialUpdate() const { return false; }
+    //scan without enough motion, returns true if the current set was resampled
+    bool staticStage(int laser_index, const sensor_msgs::LaserScanConstPtr& laser_scan) { return false; }
+
+    //index into lasers_ of the laser of the scan, set up on its first scan, -1 if its pose is unknown
+    int laserIndex(const sensor_msgs::LaserScanConstPtr& laser_scan);
+    /**
+     * @brief publishes the best hypothesis and the map to odom transform if updated, else republishes the last one.
+     * The clusters are read straight from the current set into buffers kept across scans,
+     * the best one is found in the same pass. With hypotheses_count > 0 the heaviest clusters
+     * are also published on hypotheses.
+     */
+    void publishHypotheses(const ros::Time& stamp, bool updated);
+    //the hypotheses_count heaviest hypotheses as rows of weight, x, y, yaw, cov xx, xy, yy and yaw yaw
+    void publishTopHypotheses(const ros::Time& stamp);
+    std::vector<amcl_hyp_t> hyps_;//reused across scans, grown to cluster_max_count
+    //the clusters of the current set come from pf_cluster_stats_parallel, which puts the heaviest first,
+    //false after pf_init and the augmented resampling of amcl_modified
+    bool heaviest_cluster_first_;
+    std::vector<int> hyp_order_;//indices into hyps_ by decreasing weight
+    int hypotheses_count_;
+    ros::Publisher hypotheses_pub_;
+    stamped_std_msgs::StampedFloat64MultiArray hypotheses_msg_;
+
     //pure virtual
-    virtual void laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan) = 0;
     virtual void GLCB() = 0;
     virtual void AIP() = 0;
     virtual void RCCB() = 0;
@@ -278,6 +424,7 @@ class MCL
       ROS_INFO("update_min_d: %f", d_thresh_);
       ROS_INFO("update_min_a: %f", a_thresh_);
       ROS_INFO("resample_interval_: %d", resample_interval_);
+      ROS_INFO("resample_ess_fraction_: %f", resample_ess_fraction_);
       ROS_INFO("transform_tolerance: %f secs", transform_tolerance_.toSec());
       ROS_INFO("recovery_alpha_slow: %f", alpha_slow_);
       ROS_INFO("recovery_alpha_fast: %f", alpha_fast_);
@@ -292,11 +439,6 @@ class MCL
     };
 };
 
-template<class D>
-std::vector<std::pair<int,int> > MCL<D>::free_space_indices;
-template<class D>
-random_numbers::RandomNumberGenerator MCL<D>::rng_;
-
 template<class D>
 double
 MCL<D>::getYaw(tf::Pose& t)
@@ -0,0 +1,34 @@
+#ifndef MCL_MAP_PREPROCESS_H
+#define MCL_MAP_PREPROCESS_H
+#include <cstdint>
+#include <string>
+#include "amcl/map/map.h"
+
+//Map preprocessing shared by every node: occupancy conversion and the likelihood field distance map.
+//The distance map is an exact Euclidean distance transform (Felzenszwalb and Huttenlocher),
+//linear in the number of cells and run over columns and then rows in parallel.
+//It fills occ_dist exactly as map_update_cspace would and can be cached on disk and in memory per map.
+
+//FNV-1a hash of the map geometry and occupancy, followed by count extra parameters
+uint64_t mapHash(const map_t* map, const double* params, int count);
+
+//occupancy grid values to occ_state, 0 is free, 100 occupied and anything else unknown
+void convertOccupancy(const int8_t* data, map_t* map);
+
+//distance in meters of every cell to the closest occupied cell, capped at max_occ_dist
+void distanceTransform(map_t* map, double max_occ_dist);
+
+/**
+ * @brief fills occ_dist and max_occ_dist of map.
+ * @param[in,out] map the occupancy map
+ * @param[in] max_occ_dist maximum distance in meters
+ * @param[in] cache_dir directory of cached distance maps keyed by map hash and max_occ_dist, empty to disable the cache
+ * @return true if the distance map was read from the cache
+ */
+bool updateDistanceMap(map_t* map, double max_occ_dist, const std::string& cache_dir);
+
+//keep the last entries distance maps of updateDistanceMap in memory, so that filters running side by side
+//in one process compute each of them once, 0 disables
+void setDistanceMapMemoryCache(int entries);
+
+#endif //MCL_MAP_PREPROCESS_H
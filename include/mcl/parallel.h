@@ -0,0 +1,122 @@
+#ifndef MCL_PARALLEL_H
+#define MCL_PARALLEL_H
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+//process wide cap on the worker threads of one parallel call, 0 leaves them uncapped
+inline std::atomic<int>& parallelThreadLimit()
+{
+  static std::atomic<int> limit(0);
+  return limit;
+}
+
+//number of worker threads, hardware_concurrency or 8 if it is unknown, at most parallelThreadLimit
+inline int parallelThreadCount()
+{
+  int nb_threads_hint = std::thread::hardware_concurrency();
+  int nb_threads = (nb_threads_hint == 0u ? 8u : nb_threads_hint);
+  int limit = parallelThreadLimit();
+  return (limit > 0 && limit < nb_threads ? limit : nb_threads);
+}
+
+//split [0, count) into one contiguous chunk per thread and run worker(beg, end) on each,
+//the last chunk takes the remainder and small ranges run on the calling thread
+template<class Worker>
+void parallelFor(int count, Worker worker)
+{
+  int nb_threads = parallelThreadCount();
+  if(count < nb_threads)
+  {
+    worker(0, count);
+    return;
+  }
+  std::vector<std::thread> threads(nb_threads);
+  int grainsize = count/nb_threads;
+  int beg = 0;
+  for(auto tit = std::begin(threads); tit != std::end(threads)-1 ; ++tit)
+  {
+    *tit = std::thread(worker, beg, beg+grainsize);
+    beg += grainsize;
+  }
+  threads.back() = std::thread(worker, beg, count);
+  for(auto&& thread: threads) {
+    thread.join();
+  }
+}
+
+//inclusive prefix sum out[0] = 0, out[i+1] = out[i] + value(i) for i in [0, count),
+//each chunk of parallelFor is summed, the chunk totals are scanned and every chunk is rescanned from its offset
+template<class Value>
+void parallelPrefixSum(int count, Value value, double* out)
+{
+  int nb_threads = parallelThreadCount();
+  out[0] = 0.0;
+  //spawning threads twice costs more than a short scan
+  if(count < nb_threads*4096)
+  {
+    for(int i = 0 ; i < count ; ++i)
+      out[i+1] = out[i] + value(i);
+    return;
+  }
+  int grainsize = count/nb_threads;
+  std::vector<double> chunk_total(nb_threads + 1, 0.0);
+  parallelFor(count, [&](int beg, int end)
+  {
+    double sum = 0.0;
+    for(int i = beg ; i < end ; ++i)
+      sum += value(i);
+    chunk_total[beg/grainsize + 1] = sum;
+  });
+  for(int k = 0 ; k < nb_threads ; ++k)
+    chunk_total[k+1] += chunk_total[k];
+  parallelFor(count, [&](int beg, int end)
+  {
+    double sum = chunk_total[beg/grainsize];
+    for(int i = beg ; i < end ; ++i)
+    {
+      sum += value(i);
+      out[i+1] = sum;
+    }
+  });
+}
+
+//sort data by comp, every chunk of parallelFor is sorted on its own thread,
+//then neighbouring runs are merged pairwise, halving the number of runs in every round
+template<class T, class Compare>
+void parallelSort(std::vector<T>& data, Compare comp)
+{
+  int count = data.size();
+  int nb_threads = parallelThreadCount();
+  if(count < nb_threads*1024)
+  {
+    std::sort(data.begin(), data.end(), comp);
+    return;
+  }
+  int grainsize = count/nb_threads;
+  std::vector<int> bounds(nb_threads + 1);
+  for(int k = 0 ; k < nb_threads ; ++k)
+    bounds[k] = k*grainsize;
+  bounds[nb_threads] = count;
+  parallelFor(count, [&](int beg, int end)
+  {
+    std::sort(data.begin() + beg, data.begin() + end, comp);
+  });
+  for(int width = 1 ; width < nb_threads ; width *= 2)
+  {
+    std::vector<std::thread> threads;
+    for(int k = 0 ; k + width < nb_threads ; k += 2*width)
+    {
+      int last = std::min(k + 2*width, nb_threads);
+      threads.push_back(std::thread([&data, &bounds, &comp, k, width, last]()
+      {
+        std::inplace_merge(data.begin() + bounds[k], data.begin() + bounds[k+width], data.begin() + bounds[last], comp);
+      }));
+    }
+    for(auto&& thread: threads) {
+      thread.join();
+    }
+  }
+}
+#endif //MCL_PARALLEL_H
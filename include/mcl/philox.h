@@ -0,0 +1,224 @@
+#ifndef MCL_PHILOX_H
+#define MCL_PHILOX_H
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include "mcl/parallel.h"
+
+//Philox4x32-10 counter based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+//Every (key, stream, counter) triple maps to four independent 32 bit words without any state,
+//so each sample or thread can draw from its own stream in parallel and reproducibly.
+class Philox4x32
+{
+  public:
+    struct Block
+    {
+      uint32_t v[4];
+    };
+    Philox4x32(uint64_t seed = 0, uint64_t stream = 0):
+      stream_(stream),
+      counter_(0),
+      cached_(4),
+      has_gaussian_(false),
+      gaussian_(0.0)
+    {
+      key_[0] = (uint32_t)seed;
+      key_[1] = (uint32_t)(seed >> 32);
+    }
+    uint64_t seed() const { return ((uint64_t)key_[1] << 32) | key_[0]; }
+    uint64_t stream() const { return stream_; }
+    //generator with the same key drawing from another stream
+    Philox4x32 split(uint64_t stream) const { return Philox4x32(seed(), stream); }
+    //the counter-th block of stream, independent of any sequential draws
+    Block block(uint64_t stream, uint64_t counter) const
+    {
+      Block ctr = {{(uint32_t)counter, (uint32_t)(counter >> 32), (uint32_t)stream, (uint32_t)(stream >> 32)}};
+      uint32_t k0 = key_[0], k1 = key_[1];
+      for(int round = 0 ; round < 10 ; ++round)
+      {
+        uint64_t p0 = (uint64_t)0xD2511F53u * ctr.v[0];
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * ctr.v[2];
+        Block next = {{(uint32_t)(p1 >> 32) ^ ctr.v[1] ^ k0, (uint32_t)p1,
+                       (uint32_t)(p0 >> 32) ^ ctr.v[3] ^ k1, (uint32_t)p0}};
+        ctr = next;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+      }
+      return ctr;
+    }
+    //uniform in the open interval (0, 1), never returns 0 so its log is finite
+    static double toUniform(uint32_t word) { return (word + 0.5) * (1.0/4294967296.0); }
+    //two standard normal values from two words by Box-Muller
+    static void toGaussians(uint32_t w0, uint32_t w1, double& g0, double& g1)
+    {
+      double r = sqrt(-2.0*log(toUniform(w0)));
+      double theta = 2.0*M_PI*toUniform(w1);
+      g0 = r*cos(theta);
+      g1 = r*sin(theta);
+    }
+    //sequential interface compatible with random_numbers::RandomNumberGenerator
+    uint32_t next()
+    {
+      if(cached_ == 4)
+      {
+        buffer_ = block(stream_, counter_++);
+        cached_ = 0;
+      }
+      return buffer_.v[cached_++];
+    }
+    double uniform01() { return toUniform(next()); }
+    double uniformReal(double lower_bound, double upper_bound)
+    { return lower_bound + (upper_bound - lower_bound)*uniform01(); }
+    int uniformInteger(int lower_bound, int upper_bound)
+    {
+      int value = lower_bound + (int)(uniform01()*((double)upper_bound - lower_bound + 1));
+      return value > upper_bound ? upper_bound : value;
+    }
+    double gaussian01()
+    {
+      if(has_gaussian_)
+      {
+        has_gaussian_ = false;
+        return gaussian_;
+      }
+      double g0;
+      uint32_t w0 = next();
+      toGaussians(w0, next(), g0, gaussian_);
+      has_gaussian_ = true;
+      return g0;
+    }
+    double gaussian(double mean, double stddev) { return mean + stddev*gaussian01(); }
+    //count uniforms in (0, 1) from the next blocks of the stream, the blocks are computed in parallel
+    //for large counts and the words left in the current block are skipped
+    void uniforms(int count, double* out)
+    {
+      uint64_t first = skipBlocks(count);
+      fillBlocks(count, [&](int i, const Block& b)
+      {
+        for(int k = 0 ; k < 4 && i+k < count ; ++k)
+          out[i+k] = toUniform(b.v[k]);
+      }, first);
+    }
+    //count standard normal values from the next blocks of the stream, four per block
+    void gaussians(int count, double* out)
+    {
+      uint64_t first = skipBlocks(count);
+      fillBlocks(count, [&](int i, const Block& b)
+      {
+        double g[4];
+        toGaussians(b.v[0], b.v[1], g[0], g[1]);
+        toGaussians(b.v[2], b.v[3], g[2], g[3]);
+        for(int k = 0 ; k < 4 && i+k < count ; ++k)
+          out[i+k] = g[k];
+      }, first);
+    }
+  private:
+    //reserves the blocks of count values and returns the first one
+    uint64_t skipBlocks(int count)
+    {
+      uint64_t first = counter_;
+      counter_ += (count + 3)/4;
+      cached_ = 4;
+      has_gaussian_ = false;
+      return first;
+    }
+    //calls fill(i, block) for the block of values [i, i+4)
+    template<class Fill>
+    void fillBlocks(int count, Fill fill, uint64_t first) const
+    {
+      int blocks = (count + 3)/4;
+      auto worker = [&](int beg, int end)
+      {
+        for(int j = beg ; j < end ; ++j)
+          fill(4*j, block(stream_, first + j));
+      };
+      //spawning threads costs more than a few thousand blocks
+      if(blocks < 4096)
+        worker(0, blocks);
+      else
+        parallelFor(blocks, worker);
+    }
+
+    uint32_t key_[2];
+    uint64_t stream_;
+    uint64_t counter_;
+    Block buffer_;
+    int cached_;
+    bool has_gaussian_;
+    double gaussian_;
+};
+//Random numbers of one filter, reproducible from a single seed. Every run of a sampling stage draws from
+//a stream of its own, numbered by the stage and the number of runs of that stage before it, so the numbers
+//a stage sees depend neither on the other stages nor on the threads, and parallel samplers take
+//block(i, ...) of that stream for sample i.
+class RandomStreams
+{
+  public:
+    enum Stage
+    {
+      INITIAL,//uniform initialization and global localization
+      RECOVERY,//random poses injected by amcl's init model callback
+      RESAMPLE,
+      MIXTURE,//choice between regular and dual samples
+      PROPOSAL,//DEMC jumps and their acceptance
+      SAMPLING,//poses of the sampling tool
+      DUAL,//dual MCL poses drawn from the KCGrid
+      BEAMS,//beams picked by laser_beam_selection
+      STAGE_COUNT
+    };
+    explicit RandomStreams(uint64_t seed = 0) { reseed(seed); }
+    //restarts every stage from a new seed
+    void reseed(uint64_t seed)
+    {
+      seed_ = seed;
+      for(int k = 0 ; k < STAGE_COUNT ; ++k)
+        runs_[k] = 0;
+    }
+    uint64_t seed() const { return seed_; }
+    //seed of an unseeded filter, not reproducible
+    static uint64_t randomSeed()
+    {
+      std::random_device device;
+      return ((uint64_t)device() << 32) ^ device();
+    }
+    //generator of the next run of stage, the stage is kept in the upper 16 bits of the stream
+    Philox4x32 next(Stage stage) { return Philox4x32(seed_, ((uint64_t)stage << 48) | runs_[stage]++); }
+
+    //generator bound to the calling thread, for sampling code that cannot be handed one, such as the
+    //resample functions of pf_t and the pose callback of amcl. Outside any Scope it is an unseeded one.
+    static Philox4x32& bound()
+    {
+      Philox4x32* rng = slot();
+      if(rng)
+        return *rng;
+      static thread_local Philox4x32 unseeded(randomSeed());
+      return unseeded;
+    }
+    //binds the next generator of a stage to the calling thread while it is in scope
+    class Scope
+    {
+      public:
+        Scope(RandomStreams& streams, Stage stage):
+          rng_(streams.next(stage)),
+          previous_(slot())
+        {
+          slot() = &rng_;
+        }
+        ~Scope() { slot() = previous_; }
+      private:
+        Scope(const Scope&);
+        Scope& operator=(const Scope&);
+        Philox4x32 rng_;
+        Philox4x32* previous_;
+    };
+  private:
+    static Philox4x32*& slot()
+    {
+      static thread_local Philox4x32* rng = NULL;
+      return rng;
+    }
+    uint64_t seed_;
+    uint64_t runs_[STAGE_COUNT];
+};
+#endif //MCL_PHILOX_H
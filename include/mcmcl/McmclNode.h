@@ -27,11 +27,15 @@ class McmclNode : public MCL<McmclNode>
   friend class MCL;
   public:
     typedef std::vector<boost::shared_ptr<pf_sample_t> > pf_sample_ptr_vector_t;  
-    McmclNode();
+    McmclNode(const std::string& ns = "");
     ~McmclNode();
 
   protected:
-    void laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan);
+    //stages of MCL::laserReceived
+    void sensorStage(amcl::AMCLLaserData& ldata, const ros::Time& stamp);
+    bool fusionSupported() const { return false; }
+    bool resampleInitialUpdate() const { return true; }
+    bool staticStage(int laser_index, const sensor_msgs::LaserScanConstPtr& laser_scan);
     void GLCB()
     {
       ROS_INFO("McmclNode::GLCB() is called. Build density tree..");
@@ -49,6 +53,9 @@ class McmclNode : public MCL<McmclNode>
     double ita_;
     double loch_, orih_;
     boost::shared_ptr<demc::demc_t> demc_params_;
+    int mcmc_iterations_;
+    demc::metropolis_buffer_t metropolis_buffer_;
+    double metropolisStep(amcl::AMCLLaserData& ldata, const ros::Time& stamp);
     boost::shared_ptr<nuklei::KernelCollection> kdt_;
     ros::Publisher particlecloud2_pub_;//for accepted cloud
     ros::Publisher particlecloud3_pub_;//for rejected cloud
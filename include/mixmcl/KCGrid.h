@@ -6,6 +6,7 @@
 #include "io/dataio.h"
 #include "io/paramio.h"
 #include "amcl/pf/pf_vector.h"
+#include "mcl/philox.h"
 #include "mixmcl/laser_feature.h"
 #include "boost/smart_ptr.hpp"
 #include "boost/ptr_container/ptr_map.hpp"
@@ -64,6 +65,23 @@ class KCGrid
     {
       return tree_map_.at(nnSearch(x, y, d, out));
     };
+    //key of the tree nearest to the feature, for getTree and samplePoses
+    size_t nearestCell(float x, float y, float d, ostream& out)
+    {
+      return nnSearch(x, y, d, out);
+    };
+
+    /**
+     * @brief draws poses from the planar kernels of one cell into a buffer, without going through nuklei.
+     * @details The kernels are chosen by stratified draws over their cumulative weights. Each pose is then
+     * perturbed by a gaussian with standard deviation loch in x and y and orih in heading. Pose i only draws
+     * from stream i of streams, so the poses do not depend on the number of threads.
+     * @param[in] cell key of the cell, as returned by nearestCell
+     * @param[in] streams per-pose streams
+     * @param[in] count number of poses
+     * @param[out] poses count poses
+     */
+    void samplePoses(size_t cell, const Philox4x32& streams, int count, pf_vector_t* poses) const;
 
   private:
     size_t X, Y, D;
@@ -74,6 +92,14 @@ class KCGrid
     boost::shared_ptr<float> data_matrix_;
     boost::shared_ptr<FLANNIndex> flann_index_;
     TreeMap tree_map_;
+    //the kernels of every tree as planar poses and their cumulative weights, c[0] = 0
+    typedef struct
+    {
+      std::vector<pf_vector_t> poses;
+      std::vector<double> c;
+    } kernel_cell_t;
+    std::map<size_t, kernel_cell_t> cells_;
+    double loch_, orih_;
 
     void assignLimits(float xmin, float xmax, float ymin, float ymax, float dmin, float dmax);
 
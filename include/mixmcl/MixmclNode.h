@@ -10,14 +10,20 @@ class MixmclNode : public MCL<MixmclNode>
 {
   friend class MCL;
   public:
-    MixmclNode();
+    MixmclNode(const std::string& ns = "");
     ~MixmclNode();
     static void buildDensityTree(pf_t* pf, boost::shared_ptr<nuklei::KernelCollection>& kdt, double loch, double orih);//build a KernelCollection based on previous weighted set for evaluating current dual set
     static inline void poseToSe3(const pf_vector_t& vec_p, nuklei::kernel::se3& se3_p);
     static inline void se3ToPose(const nuklei::kernel::se3& se3_p, pf_vector_t& vec_p);
   protected:
-    //inheritance
-    void laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan);
+    //stages of MCL::laserReceived
+    void initialStage();
+    void motionStage(amcl::AMCLOdomData& odata);
+    void sensorStage(amcl::AMCLLaserData& ldata, const ros::Time& stamp);
+    bool fusionSupported() const { return false; }
+    //the features of the KCGrid are computed from the whole scan
+    bool beamSelectionSupported() const { return false; }
+    bool resampleInitialUpdate() const { return true; }
     void GLCB()
     {
       //ROS_INFO("MixmclNode::GLCB() is called. Build density tree..");
@@ -42,8 +48,24 @@ class MixmclNode : public MCL<MixmclNode>
     ros::Publisher particlecloud2_pub_;
     dynamic_reconfigure::Server<mixmcl::MIXMCLConfig> *dsrv2_;
     mixmcl::MIXMCLConfig default_config2_;
+    //dual MCL samples are [0, dual_count_) of the current set, regular MCL samples the rest of it
+    int dual_count_;
+    //poses drawn from the KCGrid, kept across scans
+    std::vector<pf_vector_t> dual_poses_;
     void mixtureProposals();//determin the size of dual set and regular set
-    double dualmclNEvaluation( amcl::AMCLLaserData& ldata, amcl::AMCLOdomData& inverse_odata);
+    //the samples [first, first + count) of the current set act as the whole set while in scope,
+    //so that the models taking a pf_t update one part of the mixture where it lies
+    class SubsetScope
+    {
+      public:
+        SubsetScope(pf_t* pf, int first, int count);
+        ~SubsetScope();
+      private:
+        pf_sample_set_t* set_;
+        pf_sample_t* samples_;
+        int sample_count_;
+    };
+    double dualmclNEvaluation( amcl::AMCLLaserData& ldata);
     void createKCGrid();//read data from binary file and create a discrete KernelCollection grid
     void reconfigureCB2(mixmcl::MIXMCLConfig &config, uint32_t level);
     void printInfo()
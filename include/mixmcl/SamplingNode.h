@@ -64,6 +64,8 @@ class SamplingNode : public MCL<SamplingNode>
     ros::Publisher slms100_pub_;
     tf::StampedTransform tf_base_2_lms_;
     unsigned int space_idx_;
+    //uniform poses drawn in bulk from free_space_, consumed from the back
+    std::vector<pf_vector_t> pose_batch_;
 };
 
 const static std::string fp = "/fullpath";
@@ -1,11 +1,12 @@
 #include <cmath> 
+#include <mutex>
 #include "aismcl/AismclNode.h"
 #include "amcl/pf/pf_resample.h"
 #include "mcl/MCL.cpp"
 template class MCL<AismclNode>;
 
-AismclNode::AismclNode() :
-  MCL(),
+AismclNode::AismclNode(const std::string& ns) :
+  MCL(ns),
   first_reconfigureCB2_call_(false),
   kdt_(NULL),
   dsrv2_(NULL),
@@ -57,11 +58,7 @@ AismclNode::AismclNode() :
     resample_function_ = &pf_update_resample_kld;
     ROS_INFO("Resample type: kld because MCMCL doesn't take augmented resampling methods.");
   }
-  else if(tmp_resample_type == "kld")
-    resample_function_ = &pf_update_resample_kld;
-  else if(tmp_resample_type == "lowvariance")
-    resample_function_ = &pf_update_resample_lowvariance;
-  else
+  else if(!(resample_function_ = pf_resample_function(tmp_resample_type)))
   {
     resample_function_ = &pf_update_resample_kld;
     ROS_INFO("Resample type: kld instead of %s", tmp_resample_type.c_str());
@@ -89,7 +86,7 @@ AismclNode::AismclNode() :
   particlecloud2_pub_ = nh_.advertise<geometry_msgs::PoseArray>("particlecloud2", 2, true);
   particlecloud3_pub_ = nh_.advertise<geometry_msgs::PoseArray>("particlecloud3", 2, true);
 
-  dsrv2_ = new dynamic_reconfigure::Server<mixmcl::MCMCLConfig>(ros::NodeHandle("~/aismcl_dc"));
+  dsrv2_ = new dynamic_reconfigure::Server<mixmcl::MCMCLConfig>(ros::NodeHandle(private_nh_, "aismcl_dc"));
   dynamic_reconfigure::Server<mixmcl::MCMCLConfig>::CallbackType cb2 = boost::bind(&AismclNode::reconfigureCB2, this, _1, _2);
   dsrv2_->setCallback(cb2);
   if(!kdt_)
@@ -155,338 +152,35 @@ void AismclNode::RCCB()
                                                    this, _1));
 }
 
-void 
-AismclNode::laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan)
+void AismclNode::sensorStage(amcl::AMCLLaserData& ldata, const ros::Time& stamp)
 {
-  last_laser_received_ts_ = ros::Time::now();
-  if( map_ == NULL ) {
-    return;
-  }
-  boost::recursive_mutex::scoped_lock lr(configuration_mutex_);
-  int laser_index = -1;
-
-  // Do we have the base->base_laser Tx yet?
-  if(frame_to_laser_.find(laser_scan->header.frame_id) != frame_to_laser_.end())
-  {
-    // we have the laser pose, retrieve laser index
-    laser_index = frame_to_laser_[laser_scan->header.frame_id];
-  }
-  else
-  {
-    // we don't have the laser pose, create a new one
-    ROS_DEBUG("Setting up laser %d (frame_id=%s)", (int)frame_to_laser_.size(), laser_scan->header.frame_id.c_str());
-    lasers_.push_back(new amcl::AMCLLaser(*laser_));
-    lasers_update_.push_back(true);
-    laser_index = frame_to_laser_.size();
-
-    tf::Stamped<tf::Pose> ident (
-      tf::Transform(
-        tf::createIdentityQuaternion(),
-        tf::Vector3(0,0,0)),
-      ros::Time(),
-      laser_scan->header.frame_id);
-    tf::Stamped<tf::Pose> laser_pose;
-    try
-    {
-      this->tf_->transformPose(base_frame_id_, ident, laser_pose);
-    }
-    catch(tf::TransformException& e)
-    {
-      ROS_ERROR("Couldn't transform from %s to %s, "
-                "even though the message notifier is in use",
-                laser_scan->header.frame_id.c_str(),
-                base_frame_id_.c_str());
-      return;
-    }
-
-    pf_vector_t laser_pose_v;
-    laser_pose_v.v[0] = laser_pose.getOrigin().x();
-    laser_pose_v.v[1] = laser_pose.getOrigin().y();
-    // laser mounting angle gets computed later -> set to 0 here!
-    laser_pose_v.v[2] = 0;
-    lasers_[laser_index]->SetLaserPose(laser_pose_v);
-    ROS_DEBUG("Received laser's pose wrt robot: %.3f %.3f %.3f",
-              laser_pose_v.v[0],
-              laser_pose_v.v[1],
-              laser_pose_v.v[2]);
-
-    frame_to_laser_[laser_scan->header.frame_id] = laser_index;
-  }
-
-  // Where was the robot when this scan was taken?
-  pf_vector_t pose;
-  if(!MCL::getOdomPose(latest_odom_pose_, pose.v[0], pose.v[1], pose.v[2],
-                  laser_scan->header.stamp, base_frame_id_))
-  {
-    ROS_ERROR("Couldn't determine robot's pose associated with laser scan");
-    return;
-  }
-
-  pf_vector_t delta = pf_vector_zero();
-  pf_vector_t inverse_delta = pf_vector_zero();
-
-  if(pf_init_)
-  {
-    // Compute change in pose
-    //delta = pf_vector_coord_sub(pose, pf_odom_pose_);
-    delta.v[0] = pose.v[0] - pf_odom_pose_.v[0];
-    delta.v[1] = pose.v[1] - pf_odom_pose_.v[1];
-    delta.v[2] = angle_diff(pose.v[2], pf_odom_pose_.v[2]);
-    inverse_delta.v[0] = pf_odom_pose_.v[0] - pose.v[0];
-    inverse_delta.v[1] = pf_odom_pose_.v[1] - pose.v[1];
-    inverse_delta.v[2] = angle_diff(pf_odom_pose_.v[2], pose.v[2]);
-
-    // See if we should update the filter
-    bool update = fabs(delta.v[0]) > d_thresh_ ||
-                  fabs(delta.v[1]) > d_thresh_ ||
-                  fabs(delta.v[2]) > a_thresh_;
-    update = update || m_force_update;
-    m_force_update=false;
-
-    // Set the laser update flags
-    if(update)
-      for(unsigned int i=0; i < lasers_update_.size(); i++)
-        lasers_update_[i] = true;
-  }
-
-  const int set_a_idx = pf_->current_set;
-  const int set_b_idx = (pf_->current_set + 1) % 2;
-  amcl::AMCLOdomData odata;
-  bool force_publication = false;
-  if(!pf_init_)
-  {
-    ROS_DEBUG("initialize pf");
-    // Pose at last filter update
-    pf_odom_pose_ = pose;
-
-    // Filter is now initialized
-    pf_init_ = true;
-
-    // Should update sensor data
-    for(unsigned int i=0; i < lasers_update_.size(); i++)
-      lasers_update_[i] = true;
-
-    force_publication = true;
-
-    resample_count_ = 0;
-  }
-  // If the robot has moved, update the filter
-  else if(pf_init_ && lasers_update_[laser_index])
-  {
-    odata.pose = pose;
-    odata.delta = delta;
-    odom_->UpdateAction(pf_, (amcl::AMCLSensorData*)&odata);
-  }
-
-  amcl::AMCLLaserData ldata;
-  MCL::createLaserData(laser_index, ldata, laser_scan);
-
-  geometry_msgs::PoseArray accepted_cloud;
-  accepted_cloud.header.stamp = laser_scan->header.stamp;
-  accepted_cloud.header.frame_id = global_frame_id_;
-  geometry_msgs::PoseArray rejected_cloud;
-  rejected_cloud.header.stamp = laser_scan->header.stamp;
-  rejected_cloud.header.frame_id = global_frame_id_;
-  bool resampled = false;
-  if(lasers_update_[laser_index])
-  {
-    MixmclNode::buildDensityTree(pf_, kdt_, loch_, orih_);
-    double total = AnnealedImportanceSampling(ldata, ais_params_.get(), kdt_.get(), demc_params_.get(), mapx_, mapy_, map_rng_x_, map_rng_y_, MCL::rng_, pf_);
-    //TODO monitor w_avg
-    //TODO monitor max_element and min_element
-    //double w_avg = pf_normalize(pf_, total);
-    pf_sample_set_t* set = pf_->sets + pf_->current_set;
-    int min_idx=0, max_idx=0;
-    double mini=set->samples[0].weight, maxi=set->samples[0].weight;
-    double w_avg=0.0;
-    for (int i = 0; i < set->sample_count; i++)
-    {
-      if(mini > set->samples[i].weight)
-      {
-        mini = set->samples[i].weight;
-        min_idx = i;
-      }
-      if(maxi < set->samples[i].weight)
-      {
-        maxi = set->samples[i].weight;
-        max_idx = i;
-      }
-      set->samples[i].weight /= total;
-      w_avg += set->samples[i].weight;
-    }
-    w_avg *= 1.0/set->sample_count;
-
-    ROS_INFO("total weight before normalization: %lf", total);
-    ROS_INFO("minimum weight before normalization: %lf at %d", mini, min_idx);
-    ROS_INFO("maximum weight before normalization: %lf at %d", maxi, max_idx);
-    ROS_INFO("average weight after normalization: %lf", w_avg);
-
-    // Resample the particles
-    if(!(++resample_count_ % resample_interval_) || 
-        (force_publication ==true && sent_first_transform_ == false))
-    {
-      //pf_update_resample_low_variance(pf_);
-      //pf_update_resample_pure_KLD(pf_);
-      resample_function_(pf_);
-      resampled = true;
-    }
-
-    //analyse some statistics
-    //XXX poses.size() cannot be zero
-    //double accepted_rate =  (double)accepted_cloud.poses.size() / ((double)accepted_cloud.poses.size() + (double)rejected_cloud.poses.size());
-    //ROS_DEBUG("Accepted chains: %ld", accepted_cloud.poses.size());
-    //ROS_DEBUG("Accepted rate: %lf", accepted_rate);
-    //particlecloud2_pub_.publish(accepted_cloud);
-    //particlecloud3_pub_.publish(rejected_cloud);
-
-    ROS_DEBUG("Num samples: %d", pf_->sets[pf_->current_set].sample_count);
-
-    //update lasers_update
-    lasers_update_[laser_index] = false;
-    pf_odom_pose_ = pose;
-    //Publish the resulting cloud
-    if (!m_force_update) 
-      MCL::publishParticleCloud(particlecloud_pub_, global_frame_id_, laser_scan->header.stamp, pf_);
-  }//endif(lasers_update_[laser_index])
-  
-  if(resampled || force_publication)
+  MixmclNode::buildDensityTree(pf_, kdt_, loch_, orih_);
+  //beam skipping keeps per-sample scratch inside the laser model, which cannot be shared by threads
+  bool parallel = !(laser_model_type_ == amcl::LASER_MODEL_LIKELIHOOD_FIELD_PROB && do_beamskip_);
+  double log_total = AnnealedImportanceSampling(ldata, ais_params_.get(), kdt_.get(), demc_params_.get(), mapx_, mapy_, map_rng_x_, map_rng_y_, random_, parallel, MCL::boundedLikelihood(ldata), pf_, &ess_);
+  //TODO monitor w_avg
+  //TODO monitor max_element and min_element
+  //the set comes back normalized
+  pf_sample_set_t* set = pf_->sets + pf_->current_set;
+  int min_idx=0, max_idx=0;
+  double mini=set->samples[0].weight, maxi=set->samples[0].weight;
+  for (int i = 0; i < set->sample_count; i++)
   {
-    // Read out the current hypotheses
-    double max_weight = 0.0;
-    int max_weight_hyp = -1;
-    std::vector<amcl_hyp_t> hyps;
-    hyps.resize(pf_->sets[pf_->current_set].cluster_count);
-    for(int hyp_count = 0;
-        hyp_count < pf_->sets[pf_->current_set].cluster_count; hyp_count++)
+    if(mini > set->samples[i].weight)
     {
-      double weight;
-      pf_vector_t pose_mean;
-      pf_matrix_t pose_cov;
-      if (!pf_get_cluster_stats(pf_, hyp_count, &weight, &pose_mean, &pose_cov))
-      {
-        ROS_ERROR("Couldn't get stats on cluster %d", hyp_count);
-        break;
-      }
-
-      hyps[hyp_count].weight = weight;
-      hyps[hyp_count].pf_pose_mean = pose_mean;
-      hyps[hyp_count].pf_pose_cov = pose_cov;
-
-      if(hyps[hyp_count].weight > max_weight)
-      {
-        max_weight = hyps[hyp_count].weight;
-        max_weight_hyp = hyp_count;
-      }
-    }
-
-    if(max_weight > 0.0)
-    {
-      ROS_DEBUG("Max weight pose: %.3f %.3f %.3f",
-                hyps[max_weight_hyp].pf_pose_mean.v[0],
-                hyps[max_weight_hyp].pf_pose_mean.v[1],
-                hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-      geometry_msgs::PoseWithCovarianceStamped p;
-      // Fill in the header
-      p.header.frame_id = global_frame_id_;
-      p.header.stamp = laser_scan->header.stamp;
-      // Copy in the pose
-      p.pose.pose.position.x = hyps[max_weight_hyp].pf_pose_mean.v[0];
-      p.pose.pose.position.y = hyps[max_weight_hyp].pf_pose_mean.v[1];
-      tf::quaternionTFToMsg(tf::createQuaternionFromYaw(hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                            p.pose.pose.orientation);
-      // Copy in the covariance, converting from 3-D to 6-D
-      pf_sample_set_t* set = pf_->sets + pf_->current_set;
-      for(int i=0; i<2; i++)
-      {
-        for(int j=0; j<2; j++)
-        {
-          // Report the overall filter covariance, rather than the
-          // covariance for the highest-weight cluster
-          //p.covariance[6*i+j] = hyps[max_weight_hyp].pf_pose_cov.m[i][j];
-          p.pose.covariance[6*i+j] = set->cov.m[i][j];
-        }
-      }
-      // Report the overall filter covariance, rather than the
-      // covariance for the highest-weight cluster
-      //p.covariance[6*5+5] = hyps[max_weight_hyp].pf_pose_cov.m[2][2];
-      p.pose.covariance[6*5+5] = set->cov.m[2][2];
-      pose_pub_.publish(p);
-      last_published_pose = p;
-
-      ROS_DEBUG("New pose: %6.3f %6.3f %6.3f",
-               hyps[max_weight_hyp].pf_pose_mean.v[0],
-               hyps[max_weight_hyp].pf_pose_mean.v[1],
-               hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-      // subtracting base to odom from map to base and send map to odom instead
-      tf::Stamped<tf::Pose> odom_to_map;
-      try
-      {
-        tf::Transform tmp_tf(tf::createQuaternionFromYaw(hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                             tf::Vector3(hyps[max_weight_hyp].pf_pose_mean.v[0],
-                                         hyps[max_weight_hyp].pf_pose_mean.v[1],
-                                         0.0));
-        tf::Stamped<tf::Pose> tmp_tf_stamped (tmp_tf.inverse(),
-                                              laser_scan->header.stamp,
-                                              base_frame_id_);
-        this->tf_->transformPose(odom_frame_id_,
-                                 tmp_tf_stamped,
-                                 odom_to_map);
-      }
-      catch(tf::TransformException)
-      {
-        ROS_DEBUG("Failed to subtract base to odom transform");
-        return;
-      }
-
-      latest_tf_ = tf::Transform(tf::Quaternion(odom_to_map.getRotation()),
-                                 tf::Point(odom_to_map.getOrigin()));
-      latest_tf_valid_ = true;
-
-      if (tf_broadcast_ == true)
-      {
-        // We want to send a transform that is good up until a
-        // tolerance time so that odom can be used
-        ros::Time transform_expiration = (laser_scan->header.stamp +
-                                          transform_tolerance_);
-        tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                            transform_expiration,
-                                            global_frame_id_, odom_frame_id_);
-        this->tfb_->sendTransform(tmp_tf_stamped);
-        ROS_DEBUG("Broadcast new transform.");
-        sent_first_transform_ = true;
-      }
+      mini = set->samples[i].weight;
+      min_idx = i;
     }
-    else
+    if(maxi < set->samples[i].weight)
     {
-      ROS_ERROR("No pose!");
+      maxi = set->samples[i].weight;
+      max_idx = i;
     }
   }
-  else if(latest_tf_valid_)
-  {
-    if (tf_broadcast_ == true)
-    {
-      // Nothing changed, so we'll just republish the last transform, to keep
-      // everybody happy.
-      ros::Time transform_expiration = (laser_scan->header.stamp +
-                                        transform_tolerance_);
-      tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                          transform_expiration,
-                                          global_frame_id_, odom_frame_id_);
-      this->tfb_->sendTransform(tmp_tf_stamped);
-      ROS_DEBUG("Broadcast new transform.");
-    }
 
-    // Is it time to save our last pose to the param server
-    ros::Time now = ros::Time::now();
-    if((save_pose_period.toSec() > 0.0) &&
-       (now - save_pose_last_time) >= save_pose_period)
-    {
-      this->savePoseToServer();
-      save_pose_last_time = now;
-    }
-  }
+  ROS_INFO("log of total weight before normalization: %lf", log_total);
+  ROS_INFO("minimum weight after normalization: %lf at %d", mini, min_idx);
+  ROS_INFO("maximum weight after normalization: %lf at %d", maxi, max_idx);
 }
 
 double AismclNode::AnnealedImportanceSampling(
@@ -498,20 +192,18 @@ double AismclNode::AnnealedImportanceSampling(
   std::pair<double, double> mapy,
   double mapx_range,
   double mapy_range,
-  random_numbers::RandomNumberGenerator rng,
-  pf_t* pf
+  RandomStreams& random,
+  bool parallel,
+  const BoundedLikelihoodField* bounded,
+  pf_t* pf,
+  double* ess
   //geometry_msgs::PoseArray& accepted_cloud,
   //geometry_msgs::PoseArray& rejected_cloud)
 )
 {
   //TODO how to monitor the statistic of particle weight?
   assert(kdt!=NULL);
-  double log_uniform, log_alpha;
-  pf_sample_t* old_state;
-  pf_sample_t* new_state;
   pf_sample_t* chain;
-  pf_vector_t vec_pose;
-  nuklei::kernel::se3 se3_pose;
   //TODO ais_params->den_type == ais::density_t::logrithm
   //TODO implements two classes for density_t::logrithm and density_t::uniform which inherit a base class with a virtual function
   double inverse_iter_no_plus_one = 1.0/(1.0+ais_params->iter_num);
@@ -520,14 +212,15 @@ double AismclNode::AnnealedImportanceSampling(
   pf_sample_set_t* tmp_chains;
   new_chains->sample_count = old_chains->sample_count;
   std::vector<double> sum_log_bridging_weight(old_chains->sample_count);
-  std::vector<double> bridging_weight(old_chains->sample_count);
   std::vector<double> predictive_belief_prob(old_chains->sample_count);//\phi_{0}
   //std::vector<double> target_prob(old_chains->sample_count);//\phi_{M+1} is sample->likelihood or sample->logLikelihood
   
   //update measurement model for old_chains
   //how to keep previous weight and data likelihood? Define pf_sample_t with preWeight and likelihood
   //TODO when chain->likelihood and chain->logLikelihood should be normalized?
-  auto pair = ((amcl::AMCLLaser*)ldata.sensor)->UpdateSensorWithSet(old_chains, &ldata);
+  //chains duplicated by resampling are evaluated once
+  int unique_count = demc::updateSensorBatched(ldata, parallel, bounded, old_chains);
+  ROS_DEBUG("AIS evaluated %d distinct of %d chains", unique_count, old_chains->sample_count);
   //cannot normalize at this point
   //auto stat_tup = AismclNode::normalize_markov_chains(new_chains, pair.first, pair.second);
   for(int i = 0 ; i < old_chains->sample_count ; ++i)
@@ -539,57 +232,94 @@ double AismclNode::AnnealedImportanceSampling(
     //update sum_log_bridging_weight for each chain
     sum_log_bridging_weight[i] = ( chain->logLikelihood - std::log(predictive_belief_prob[i]) )*inverse_iter_no_plus_one;
     assert(std::isinf(sum_log_bridging_weight[i])==false);
-    bridging_weight[i] = std::pow( chain->likelihood/predictive_belief_prob[i], inverse_iter_no_plus_one);
   }
 
-  double total_likelihood = 0.0;
+  //the chains stay in structure of arrays form across iterations, and the likelihood of a chain is carried
+  //from one set to the other, so each iteration evaluates the measurement model once per chain
+  const int count = old_chains->sample_count;
+  demc::population_t parents, children;
+  parents.gather(old_chains);
+  std::mutex total_mutex;
   for(int m = 1; m <= ais_params->iter_num; ++m)
   {
     //apply MCMC moves and store Markov chains in new_chains
-    demc::proposal(old_chains, demc_params, mapx, mapy, mapx_range, mapy_range, rng, new_chains);
-    //update measurement model for new_chains
-    auto pair = ((amcl::AMCLLaser*)ldata.sensor)->UpdateSensorWithSet(new_chains, &ldata);
-    //cannot normalize at this point
-    //auto stat_tup = AismclNode::normalize_markov_chains(new_chains, pair.first, pair.second);
-    for(int i = 0; i < new_chains->sample_count; ++i)
+    //proposal uses blocks 0 and 1 of each stream, the acceptance test block 2
+    Philox4x32 streams = demc::proposalStreams(random);
+    demc::proposal(parents, demc_params, mapx, mapy, mapx_range, mapy_range, streams, children);
+    //log of the total likelihood of the chains, reduced in the log domain
+    pf_log_sum_t total_likelihood;
+    pf_log_sum_init(&total_likelihood);
+    auto worker = [&](int beg, int end)
     {
-      old_state = old_chains->samples + i;
-      new_state = new_chains->samples + i;
-
-      //update acceptance probability of old_state and new_state
-      //new_state is numerator old_state is denominator
-      log_alpha = new_state->logLikelihood - old_state->logLikelihood;
-      if(log_alpha < 0)
-        log_uniform = std::log(rng.uniform01());
-      else
-        log_uniform = 0;
-
-      //if accept new_state
-      if(log_uniform <= log_alpha)
+      for(int i = beg ; i < end ; ++i)
       {
-        //update density probability of pi for new_chains
-        MixmclNode::poseToSe3(new_state->pose, se3_pose);
-        //TODO Big problem: how to deal with zero probability
-        predictive_belief_prob[i] = kdt->evaluationAt(se3_pose);
-        assert(predictive_belief_prob[i]>0);
+        pf_sample_t* proposed = new_chains->samples + i;
+        proposed->pose.v[0] = children.x[i];
+        proposed->pose.v[1] = children.y[i];
+        proposed->pose.v[2] = children.a[i];
+        proposed->weight = 1.0;
       }
-      else 
+      //update measurement model for this range of new_chains
+      pf_sample_set_t view = *new_chains;
+      view.samples = new_chains->samples + beg;
+      view.sample_count = end - beg;
+      //a proposal below the log-likelihood of its chain plus the log of the acceptance draw is rejected early
+      if(bounded)
+        for(int i = beg ; i < end ; ++i)
+          bounded->evaluate(new_chains->samples + i,
+                            old_chains->samples[i].logLikelihood + std::log(Philox4x32::toUniform(streams.block(i, 2).v[0])));
+      else
+        ((amcl::AMCLLaser*)ldata.sensor)->UpdateSensorWithSet(&view, &ldata);
+      //cannot normalize at this point
+      nuklei::kernel::se3 se3_pose;
+      pf_log_sum_t local_likelihood;
+      pf_log_sum_init(&local_likelihood);
+      for(int i = beg ; i < end ; ++i)
       {
-        new_state->pose = old_state->pose;
-        new_state->likelihood = old_state->likelihood;
-        new_state->logLikelihood = new_state->logLikelihood;
-        //Note that because predictive_belief_prob[i] is not updated by UpdateSensorWithSet function, the value remained in predictive_belief_prob
+        pf_sample_t* old_state = old_chains->samples + i;
+        pf_sample_t* new_state = new_chains->samples + i;
+
+        //update acceptance probability of old_state and new_state
+        //new_state is numerator old_state is denominator
+        double log_alpha = new_state->logLikelihood - old_state->logLikelihood;
+        double log_uniform = log_alpha < 0 ? std::log(Philox4x32::toUniform(streams.block(i, 2).v[0])) : 0;
+
+        //if accept new_state
+        if(log_uniform <= log_alpha)
+        {
+          //update density probability of pi for new_chains
+          MixmclNode::poseToSe3(new_state->pose, se3_pose);
+          //TODO Big problem: how to deal with zero probability
+          predictive_belief_prob[i] = kdt->evaluationAt(se3_pose);
+          assert(predictive_belief_prob[i]>0);
+          parents.x[i] = children.x[i];
+          parents.y[i] = children.y[i];
+          parents.a[i] = children.a[i];
+        }
+        else 
+        {
+          new_state->pose = old_state->pose;
+          new_state->likelihood = old_state->likelihood;
+          new_state->logLikelihood = old_state->logLikelihood;
+          //Note that because predictive_belief_prob[i] is not updated by UpdateSensorWithSet function, the value remained in predictive_belief_prob
+        }
+        pf_log_sum_add(&local_likelihood, new_state->logLikelihood);
       }
-      total_likelihood += new_state->likelihood;
-    }
-      //TODO likelihood have to be normalized before updating bridging_weight and sum_log_bridging_weight
-      //Note that logLikelihood cannot be normalized because it is used for updating log_alpha
+      std::lock_guard<std::mutex> lg(total_mutex);
+      pf_log_sum_merge(&total_likelihood, &local_likelihood);
+    };
+    if(parallel)
+      parallelFor(count, worker);
+    else
+      worker(0, count);
+    //likelihood is normalized in the log domain before updating sum_log_bridging_weight
+    //Note that logLikelihood itself cannot be normalized because it is used for updating log_alpha
+    double log_total_likelihood = pf_log_sum_value(&total_likelihood);
     for(int i = 0; i < new_chains->sample_count; ++i)
     {
       //update bridging weight
-      double state_likelihood = new_state->likelihood/total_likelihood;
-      bridging_weight[i] *= std::pow(state_likelihood/predictive_belief_prob[i],inverse_iter_no_plus_one);
-      sum_log_bridging_weight[i] += (std::log(state_likelihood) - std::log(predictive_belief_prob[i]))*inverse_iter_no_plus_one;
+      double log_state_likelihood = new_chains->samples[i].logLikelihood - log_total_likelihood;
+      sum_log_bridging_weight[i] += (log_state_likelihood - std::log(predictive_belief_prob[i]))*inverse_iter_no_plus_one;
       assert(std::isinf(sum_log_bridging_weight[i])==false);
     }
     //deprecate old_chains
@@ -599,37 +329,10 @@ double AismclNode::AnnealedImportanceSampling(
     new_chains = pf->sets + (pf->current_set + 1 )%2;
   }
 
-  double total = 0.0;
-  int min_idx = 0,max_idx = 0;
-  double mini = old_chains->samples[0].weight;
-  double maxi = old_chains->samples[0].weight;
+  //the bridging weights only exist in the log domain, normalize them there
   for(int i = 0 ; i < old_chains->sample_count ; ++i)
-  {
-    //old_chains->samples[i].weight = bridging_weight[i];
-    old_chains->samples[i].weight = exp(sum_log_bridging_weight[i]);
-    assert(old_chains->samples[i].weight>=0);
-    assert(std::isinf(old_chains->samples[i].weight)==false);
     old_chains->samples[i].logWeight = sum_log_bridging_weight[i];
-    //if(old_chains->samples[i].weight <0)
-    //TODO assert |bridging_weight[i] - exp(sum_log_bridging_weight[i])| <= acceptable_error
-    total += old_chains->samples[i].weight;
-
-    //for debugging
-    if(maxi < old_chains->samples[i].weight)
-    {
-      maxi = old_chains->samples[i].weight;
-      max_idx = i;
-    }
-    if(mini > old_chains->samples[i].weight)
-    {
-      mini = old_chains->samples[i].weight;
-      min_idx = i;
-    }
-    //END for debugging
-
-  }
-
-  return total;
+  return pf_normalize_log_weights(old_chains, ess);
 }
 
 std::tuple<double,double,std::pair<double,double>,std::pair<double,double> > AismclNode::normalize_markov_chains(pf_sample_set_t* set, double total_weight, double total_likelihood)
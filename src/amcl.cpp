@@ -40,6 +40,11 @@ main(int argc, char** argv)
     ROS_INFO("runFromBag in main");
     mixmcl_node_ptr->runFromBag(argv[2]);
   }
+  else if ((argc >= 3) && (std::string(argv[1]) == "--run-from-bag-fast"))
+  {
+    ROS_INFO("runFromBagFast in main");
+    mixmcl_node_ptr->runFromBagFast(argv[2]);
+  }
   else
   {
     ROS_INFO("something wrong in main");
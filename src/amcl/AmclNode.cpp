@@ -2,8 +2,8 @@
 #include "mcl/MCL.cpp"
 template class MCL<AmclNode>;
 
-AmclNode::AmclNode():
-  MCL()
+AmclNode::AmclNode(const std::string& ns):
+  MCL(ns)
 {
 
   //std::string tmp_resample_type;
@@ -12,13 +12,8 @@ AmclNode::AmclNode():
   std::string tmp_resample_type;
   private_nh_.param("resample_type", tmp_resample_type, std::string("augmented"));
   ROS_INFO("Resample type is %s", tmp_resample_type.c_str());
-  if(tmp_resample_type == "augmented")
-    resample_function_ = &pf_update_resample;
-  else if(tmp_resample_type == "kld")
-    resample_function_ = &pf_update_resample_kld;
-  else if(tmp_resample_type == "lowvariance")
-    resample_function_ = &pf_update_resample_lowvariance;
-  else
+  resample_function_ = pf_resample_function(tmp_resample_type);
+  if(!resample_function_)
   {
     resample_function_ = &pf_update_resample;
     ROS_INFO("There is no resample type named %s. Using default type: augmented", tmp_resample_type.c_str());
@@ -59,320 +54,3 @@ AmclNode::~AmclNode()
   ROS_DEBUG("AmclNode::~AmclNode() is deleting laser_scan_filter_.");
   delete laser_scan_filter_;
 }
-
-void
-AmclNode::laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan)
-{
-  ROS_DEBUG("AmclNode::laserReceived received laser scan.");
-  last_laser_received_ts_ = ros::Time::now();
-  if( map_ == NULL ) {
-    return;
-  }
-  boost::recursive_mutex::scoped_lock lr(configuration_mutex_);
-  int laser_index = -1;
-
-  // Do we have the base->base_laser Tx yet?
-  if(frame_to_laser_.find(laser_scan->header.frame_id) == frame_to_laser_.end())
-  {
-    ROS_DEBUG("Setting up laser %d (frame_id=%s)\n", (int)frame_to_laser_.size(), laser_scan->header.frame_id.c_str());
-    lasers_.push_back(new amcl::AMCLLaser(*laser_));
-    lasers_update_.push_back(true);
-    laser_index = frame_to_laser_.size();
-
-    tf::Stamped<tf::Pose> ident (tf::Transform(tf::createIdentityQuaternion(),
-                                             tf::Vector3(0,0,0)),
-                                 ros::Time(), laser_scan->header.frame_id);
-    tf::Stamped<tf::Pose> laser_pose;
-    try
-    {
-      this->tf_->transformPose(base_frame_id_, ident, laser_pose);
-    }
-    catch(tf::TransformException& e)
-    {
-      ROS_ERROR("Couldn't transform from %s to %s, "
-                "even though the message notifier is in use",
-                laser_scan->header.frame_id.c_str(),
-                base_frame_id_.c_str());
-      return;
-    }
-
-    pf_vector_t laser_pose_v;
-    laser_pose_v.v[0] = laser_pose.getOrigin().x();
-    laser_pose_v.v[1] = laser_pose.getOrigin().y();
-    // laser mounting angle gets computed later -> set to 0 here!
-    laser_pose_v.v[2] = 0;
-    lasers_[laser_index]->SetLaserPose(laser_pose_v);
-    ROS_DEBUG("Received laser's pose wrt robot: %.3f %.3f %.3f",
-              laser_pose_v.v[0],
-              laser_pose_v.v[1],
-              laser_pose_v.v[2]);
-
-    frame_to_laser_[laser_scan->header.frame_id] = laser_index;
-  } else {
-    // we have the laser pose, retrieve laser index
-    laser_index = frame_to_laser_[laser_scan->header.frame_id];
-    //ROS_DEBUG("Received laser's pose wrt robot: %.3f %.3f %.3f",
-    //          lasers_[laser_index]->laser_pose.v[0],
-    //          lasers_[laser_index]->laser_pose.v[1],
-    //          lasers_[laser_index]->laser_pose.v[2]);
-  }
-
-  // Where was the robot when this scan was taken?
-  pf_vector_t pose;
-  if(!MCL::getOdomPose(latest_odom_pose_, pose.v[0], pose.v[1], pose.v[2],
-                  laser_scan->header.stamp, base_frame_id_))
-  {
-    ROS_ERROR("Couldn't determine robot's pose associated with laser scan");
-    return;
-  }
-
-
-  pf_vector_t delta = pf_vector_zero();
-
-  if(pf_init_)
-  {
-    // Compute change in pose
-    //delta = pf_vector_coord_sub(pose, pf_odom_pose_);
-    delta.v[0] = pose.v[0] - pf_odom_pose_.v[0];
-    delta.v[1] = pose.v[1] - pf_odom_pose_.v[1];
-    delta.v[2] = angle_diff(pose.v[2], pf_odom_pose_.v[2]);
-
-    // See if we should update the filter
-    bool update = fabs(delta.v[0]) > d_thresh_ ||
-                  fabs(delta.v[1]) > d_thresh_ ||
-                  fabs(delta.v[2]) > a_thresh_;
-    update = update || m_force_update;
-    m_force_update=false;
-
-    // Set the laser update flags
-    if(update)
-      for(unsigned int i=0; i < lasers_update_.size(); i++)
-        lasers_update_[i] = true;
-  }
-
-  bool force_publication = false;
-  if(!pf_init_)
-  {
-    // Pose at last filter update
-    pf_odom_pose_ = pose;
-
-    // Filter is now initialized
-    pf_init_ = true;
-
-    // Should update sensor data
-    for(unsigned int i=0; i < lasers_update_.size(); i++)
-      lasers_update_[i] = true;
-
-    force_publication = true;
-
-    resample_count_ = 0;
-  }
-  // If the robot has moved, update the filter
-  else if(pf_init_ && lasers_update_[laser_index])
-  {
-    //printf("pose\n");
-    //pf_vector_fprintf(pose, stdout, "%.3f");
-
-    amcl::AMCLOdomData odata;
-    odata.pose = pose;
-    // HACK
-    // Modify the delta in the action data so the filter gets
-    // updated correctly
-    odata.delta = delta;
-
-    // Use the action data to update the filter
-    odom_->UpdateAction(pf_, (amcl::AMCLSensorData*)&odata);
-
-    // Pose at last filter update
-    //this->pf_odom_pose = pose;
-  }
-
-  bool resampled = false;
-  // If the robot has moved, update the filter
-  if(lasers_update_[laser_index])
-  {
-    amcl::AMCLLaserData ldata;
-    MCL::createLaserData(laser_index, ldata, laser_scan);
-
-    double total = lasers_[laser_index]->UpdateSensor(pf_, (amcl::AMCLSensorData*)&ldata);
-    double w_avg = pf_normalize(pf_, total);
-    pf_update_augmented_weight(pf_, w_avg);
-    //TODO publish weighted particles to wpc_pub_
-    //MCL::publishWeightedParticleCloud(wpc_pub_, global_frame_id_, laser_scan->header.stamp, pf_);
-
-    lasers_update_[laser_index] = false;
-
-    pf_odom_pose_ = pose;
-
-    // Resample the particles
-    if(!(++resample_count_ % resample_interval_))
-    {
-      resample_function_(pf_);
-      resampled = true;
-    }
-
-    pf_sample_set_t* set = pf_->sets + pf_->current_set;
-    ROS_DEBUG("Num samples: %d\n", set->sample_count);
-
-    // Publish the resulting cloud
-    // TODO: set maximum rate for publishing
-    if (!m_force_update) {
-      MCL::publishParticleCloud(particlecloud_pub_, global_frame_id_, laser_scan->header.stamp, pf_);
-    }
-  }
-
-  if(resampled || force_publication)
-  {
-    // Read out the current hypotheses
-    double max_weight = 0.0;
-    int max_weight_hyp = -1;
-    std::vector<amcl_hyp_t> hyps;
-    hyps.resize(pf_->sets[pf_->current_set].cluster_count);
-    for(int hyp_count = 0;
-        hyp_count < pf_->sets[pf_->current_set].cluster_count; hyp_count++)
-    {
-      double weight;
-      pf_vector_t pose_mean;
-      pf_matrix_t pose_cov;
-      if (!pf_get_cluster_stats(pf_, hyp_count, &weight, &pose_mean, &pose_cov))
-      {
-        ROS_ERROR("Couldn't get stats on cluster %d", hyp_count);
-        break;
-      }
-
-      hyps[hyp_count].weight = weight;
-      hyps[hyp_count].pf_pose_mean = pose_mean;
-      hyps[hyp_count].pf_pose_cov = pose_cov;
-
-      if(hyps[hyp_count].weight > max_weight)
-      {
-        max_weight = hyps[hyp_count].weight;
-        max_weight_hyp = hyp_count;
-      }
-    }
-
-    if(max_weight > 0.0)
-    {
-      ROS_DEBUG("Max weight pose: %.3f %.3f %.3f",
-                hyps[max_weight_hyp].pf_pose_mean.v[0],
-                hyps[max_weight_hyp].pf_pose_mean.v[1],
-                hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-      /*
-         puts("");
-         pf_matrix_fprintf(hyps[max_weight_hyp].pf_pose_cov, stdout, "%6.3f");
-         puts("");
-       */
-
-      geometry_msgs::PoseWithCovarianceStamped p;
-      // Fill in the header
-      p.header.frame_id = global_frame_id_;
-      p.header.stamp = laser_scan->header.stamp;
-      // Copy in the pose
-      p.pose.pose.position.x = hyps[max_weight_hyp].pf_pose_mean.v[0];
-      p.pose.pose.position.y = hyps[max_weight_hyp].pf_pose_mean.v[1];
-      tf::quaternionTFToMsg(tf::createQuaternionFromYaw(hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                            p.pose.pose.orientation);
-      // Copy in the covariance, converting from 3-D to 6-D
-      pf_sample_set_t* set = pf_->sets + pf_->current_set;
-      for(int i=0; i<2; i++)
-      {
-        for(int j=0; j<2; j++)
-        {
-          // Report the overall filter covariance, rather than the
-          // covariance for the highest-weight cluster
-          //p.covariance[6*i+j] = hyps[max_weight_hyp].pf_pose_cov.m[i][j];
-          p.pose.covariance[6*i+j] = set->cov.m[i][j];
-        }
-      }
-      // Report the overall filter covariance, rather than the
-      // covariance for the highest-weight cluster
-      //p.covariance[6*5+5] = hyps[max_weight_hyp].pf_pose_cov.m[2][2];
-      p.pose.covariance[6*5+5] = set->cov.m[2][2];
-
-      /*
-         printf("cov:\n");
-         for(int i=0; i<6; i++)
-         {
-         for(int j=0; j<6; j++)
-         printf("%6.3f ", p.covariance[6*i+j]);
-         puts("");
-         }
-       */
-
-      pose_pub_.publish(p);
-      last_published_pose = p;
-
-      ROS_DEBUG("New pose: %6.3f %6.3f %6.3f",
-               hyps[max_weight_hyp].pf_pose_mean.v[0],
-               hyps[max_weight_hyp].pf_pose_mean.v[1],
-               hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-      // subtracting base to odom from map to base and send map to odom instead
-      tf::Stamped<tf::Pose> odom_to_map;
-      try
-      {
-        tf::Transform tmp_tf(tf::createQuaternionFromYaw(hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                             tf::Vector3(hyps[max_weight_hyp].pf_pose_mean.v[0],
-                                         hyps[max_weight_hyp].pf_pose_mean.v[1],
-                                         0.0));
-        tf::Stamped<tf::Pose> tmp_tf_stamped (tmp_tf.inverse(),
-                                              laser_scan->header.stamp,
-                                              base_frame_id_);
-        this->tf_->transformPose(odom_frame_id_,
-                                 tmp_tf_stamped,
-                                 odom_to_map);
-      }
-      catch(tf::TransformException)
-      {
-        ROS_DEBUG("Failed to subtract base to odom transform");
-        return;
-      }
-
-      latest_tf_ = tf::Transform(tf::Quaternion(odom_to_map.getRotation()),
-                                 tf::Point(odom_to_map.getOrigin()));
-      latest_tf_valid_ = true;
-
-      if (tf_broadcast_ == true)
-      {
-        // We want to send a transform that is good up until a
-        // tolerance time so that odom can be used
-        ros::Time transform_expiration = (laser_scan->header.stamp +
-                                          transform_tolerance_);
-        tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                            transform_expiration,
-                                            global_frame_id_, odom_frame_id_);
-        this->tfb_->sendTransform(tmp_tf_stamped);
-        sent_first_transform_ = true;
-      }
-    }
-    else
-    {
-      ROS_ERROR("No pose!");
-    }
-  }
-  else if(latest_tf_valid_)
-  {
-    if (tf_broadcast_ == true)
-    {
-      // Nothing changed, so we'll just republish the last transform, to keep
-      // everybody happy.
-      ros::Time transform_expiration = (laser_scan->header.stamp +
-                                        transform_tolerance_);
-      tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                          transform_expiration,
-                                          global_frame_id_, odom_frame_id_);
-      this->tfb_->sendTransform(tmp_tf_stamped);
-    }
-
-    // Is it time to save our last pose to the param server
-    ros::Time now = ros::Time::now();
-    if((save_pose_period.toSec() > 0.0) &&
-       (now - save_pose_last_time) >= save_pose_period)
-    {
-      this->savePoseToServer();
-      save_pose_last_time = now;
-    }
-  }
-
-}
@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "amcl/pf/pf_cluster.h"
+#include "mcl/parallel.h"
+
+extern void pf_kdtree_clear(pf_kdtree_t *self);
+extern void pf_kdtree_insert(pf_kdtree_t *self, pf_vector_t pose, double value);
+
+//21 bits per key, biased so that the packed keys sort like the key triples
+static const int pf_key_bits = 21;
+static const int64_t pf_key_bias = (int64_t)1 << (pf_key_bits - 1);
+static const uint64_t pf_key_mask = ((uint64_t)1 << pf_key_bits) - 1;
+
+//the forward half of the 26 neighbours, every pair of neighbouring bins is checked once
+static const int pf_forward_count = 13;
+
+typedef struct
+{
+  int count;
+  double weight;
+  double m[4];
+  double c[2][2];
+} pf_bin_moments_t;
+
+static uint64_t pf_pack_key(const int64_t key[3])
+{
+  uint64_t packed = 0;
+  for(int j = 0 ; j < 3 ; ++j)
+    packed = (packed << pf_key_bits) | ((uint64_t)(key[j] + pf_key_bias) & pf_key_mask);
+  return packed;
+}
+
+static void pf_unpack_key(uint64_t packed, int64_t key[3])
+{
+  for(int j = 2 ; j >= 0 ; --j)
+  {
+    key[j] = (int64_t)(packed & pf_key_mask) - pf_key_bias;
+    packed >>= pf_key_bits;
+  }
+}
+
+static int pf_find_root(std::vector<int>& root, int b)
+{
+  while(root[b] != b)
+  {
+    root[b] = root[root[b]];
+    b = root[b];
+  }
+  return b;
+}
+
+int pf_cluster_stats_parallel(pf_sample_set_t* set)
+{
+  const double* size = set->kdtree->size;
+  int n = set->sample_count;
+  pf_kdtree_clear(set->kdtree);
+  set->cluster_count = 0;
+  if(n == 0)
+    return 0;
+
+  //histogram: (key, sample) pairs sorted by key, the runs of equal keys are the bins
+  std::vector<std::pair<uint64_t,int> > keyed(n);
+  parallelFor(n, [&](int beg, int end)
+  {
+    int64_t key[3];
+    for(int i = beg ; i < end ; ++i)
+    {
+      for(int j = 0 ; j < 3 ; ++j)
+        key[j] = (int64_t)floor(set->samples[i].pose.v[j] / size[j]);
+      keyed[i] = std::make_pair(pf_pack_key(key), i);
+    }
+  });
+  parallelSort(keyed, [](const std::pair<uint64_t,int>& a, const std::pair<uint64_t,int>& b)
+  {
+    return a.first < b.first;
+  });
+  std::vector<int> bin_begin;
+  std::vector<uint64_t> bin_keys;
+  for(int i = 0 ; i < n ; ++i)
+  {
+    if(i == 0 || keyed[i].first != keyed[i-1].first)
+    {
+      bin_begin.push_back(i);
+      bin_keys.push_back(keyed[i].first);
+    }
+  }
+  bin_begin.push_back(n);
+  int bin_count = bin_keys.size();
+
+  //moments of every bin, and its forward neighbours by binary search over the bin keys
+  std::vector<pf_bin_moments_t> moments(bin_count);
+  std::vector<int> neighbours(bin_count*pf_forward_count, -1);
+  parallelFor(bin_count, [&](int beg, int end)
+  {
+    int64_t key[3], nkey[3];
+    for(int b = beg ; b < end ; ++b)
+    {
+      pf_bin_moments_t& bin = moments[b];
+      bin.count = 0;
+      bin.weight = 0.0;
+      for(int j = 0 ; j < 4 ; ++j)
+        bin.m[j] = 0.0;
+      for(int j = 0 ; j < 2 ; ++j)
+        for(int k = 0 ; k < 2 ; ++k)
+          bin.c[j][k] = 0.0;
+      for(int i = bin_begin[b] ; i < bin_begin[b+1] ; ++i)
+      {
+        const pf_sample_t* sample = set->samples + keyed[i].second;
+        bin.count += 1;
+        bin.weight += sample->weight;
+        bin.m[0] += sample->weight * sample->pose.v[0];
+        bin.m[1] += sample->weight * sample->pose.v[1];
+        bin.m[2] += sample->weight * cos(sample->pose.v[2]);
+        bin.m[3] += sample->weight * sin(sample->pose.v[2]);
+        for(int j = 0 ; j < 2 ; ++j)
+          for(int k = 0 ; k < 2 ; ++k)
+            bin.c[j][k] += sample->weight * sample->pose.v[j] * sample->pose.v[k];
+      }
+      pf_unpack_key(bin_keys[b], key);
+      int slot = 0;
+      for(int dx = 0 ; dx <= 1 ; ++dx)
+        for(int dy = (dx ? -1 : 0) ; dy <= 1 ; ++dy)
+          for(int dz = (dx || dy ? -1 : 1) ; dz <= 1 ; ++dz)
+          {
+            nkey[0] = key[0] + dx;
+            nkey[1] = key[1] + dy;
+            nkey[2] = key[2] + dz;
+            uint64_t packed = pf_pack_key(nkey);
+            auto it = std::lower_bound(bin_keys.begin(), bin_keys.end(), packed);
+            if(it != bin_keys.end() && *it == packed)
+              neighbours[b*pf_forward_count + slot] = it - bin_keys.begin();
+            ++slot;
+          }
+    }
+  });
+
+  //the tree gets one leaf per bin holding its weight, as if every sample had been inserted,
+  //so that leaf_count and pf_kdtree_get_prob see the histogram of the set
+  pf_vector_t center;
+  int64_t center_key[3];
+  for(int b = 0 ; b < bin_count ; ++b)
+  {
+    pf_unpack_key(bin_keys[b], center_key);
+    for(int j = 0 ; j < 3 ; ++j)
+      center.v[j] = (center_key[j] + 0.5) * size[j];
+    pf_kdtree_insert(set->kdtree, center, moments[b].weight);
+  }
+
+  //connected bins form a cluster, as the flood fill of pf_kdtree_cluster
+  std::vector<int> root(bin_count);
+  for(int b = 0 ; b < bin_count ; ++b)
+    root[b] = b;
+  for(int b = 0 ; b < bin_count ; ++b)
+  {
+    for(int slot = 0 ; slot < pf_forward_count ; ++slot)
+    {
+      int nb = neighbours[b*pf_forward_count + slot];
+      if(nb < 0)
+        continue;
+      int ra = pf_find_root(root, b), rb = pf_find_root(root, nb);
+      if(ra != rb)
+        root[std::max(ra, rb)] = std::min(ra, rb);
+    }
+  }
+  std::vector<int> label(bin_count, -1);
+  int label_count = 0;
+  for(int b = 0 ; b < bin_count ; ++b)
+  {
+    int r = pf_find_root(root, b);
+    if(label[r] < 0)
+      label[r] = label_count++;
+    label[b] = label[r];
+  }
+
+  //cluster and overall statistics, the same sums as pf_cluster_stats taken over the bins
+  int used = std::min(label_count, set->cluster_max_count);
+  for(int i = 0 ; i < used ; ++i)
+  {
+    pf_cluster_t* cluster = set->clusters + i;
+    cluster->count = 0;
+    cluster->weight = 0;
+    for(int j = 0 ; j < 4 ; ++j)
+      cluster->m[j] = 0.0;
+    for(int j = 0 ; j < 2 ; ++j)
+      for(int k = 0 ; k < 2 ; ++k)
+        cluster->c[j][k] = 0.0;
+  }
+  double weight = 0.0;
+  double m[4] = {0.0, 0.0, 0.0, 0.0};
+  double c[2][2] = {{0.0, 0.0}, {0.0, 0.0}};
+  for(int b = 0 ; b < bin_count ; ++b)
+  {
+    if(label[b] >= set->cluster_max_count)
+      continue;
+    if(label[b] + 1 > set->cluster_count)
+      set->cluster_count = label[b] + 1;
+    pf_cluster_t* cluster = set->clusters + label[b];
+    const pf_bin_moments_t& bin = moments[b];
+    cluster->count += bin.count;
+    cluster->weight += bin.weight;
+    weight += bin.weight;
+    for(int j = 0 ; j < 4 ; ++j)
+    {
+      cluster->m[j] += bin.m[j];
+      m[j] += bin.m[j];
+    }
+    for(int j = 0 ; j < 2 ; ++j)
+      for(int k = 0 ; k < 2 ; ++k)
+      {
+        cluster->c[j][k] += bin.c[j][k];
+        c[j][k] += bin.c[j][k];
+      }
+  }
+  //the heaviest cluster goes first, the hypothesis extraction takes it without another scan
+  int heaviest = 0;
+  for(int i = 1 ; i < set->cluster_count ; ++i)
+    if(set->clusters[i].weight > set->clusters[heaviest].weight)
+      heaviest = i;
+  if(heaviest > 0)
+    std::swap(set->clusters[0], set->clusters[heaviest]);
+  for(int i = 0 ; i < set->cluster_count ; ++i)
+  {
+    pf_cluster_t* cluster = set->clusters + i;
+    cluster->mean.v[0] = cluster->m[0] / cluster->weight;
+    cluster->mean.v[1] = cluster->m[1] / cluster->weight;
+    cluster->mean.v[2] = atan2(cluster->m[3], cluster->m[2]);
+    cluster->cov = pf_matrix_zero();
+    for(int j = 0 ; j < 2 ; ++j)
+      for(int k = 0 ; k < 2 ; ++k)
+        cluster->cov.m[j][k] = cluster->c[j][k] / cluster->weight - cluster->mean.v[j] * cluster->mean.v[k];
+    cluster->cov.m[2][2] = -2 * log(sqrt(cluster->m[2] * cluster->m[2] + cluster->m[3] * cluster->m[3]));
+  }
+  set->mean = pf_vector_zero();
+  set->cov = pf_matrix_zero();
+  set->mean.v[0] = m[0] / weight;
+  set->mean.v[1] = m[1] / weight;
+  set->mean.v[2] = atan2(m[3], m[2]);
+  for(int j = 0 ; j < 2 ; ++j)
+    for(int k = 0 ; k < 2 ; ++k)
+      set->cov.m[j][k] = c[j][k] / weight - set->mean.v[j] * set->mean.v[k];
+  set->cov.m[2][2] = -2 * log(sqrt(m[2] * m[2] + m[3] * m[3]));
+  return bin_count;
+}
@@ -1,7 +1,92 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <unordered_set>
+#include <vector>
+#include "amcl/pf/pf_cluster.h"
 #include "amcl/pf/pf_resample.h"
+#include "mcl/parallel.h"
 
-extern void pf_kdtree_clear(pf_kdtree_t *self);
-extern void pf_kdtree_insert(pf_kdtree_t *self, pf_vector_t pose, double value);
+//the same bins as pf_kdtree_insert, 21 bits per key are plenty for a map
+static uint64_t pf_resample_bin_key(const pf_vector_t& pose, const double* size)
+{
+  uint64_t key = 0;
+  for(int j = 0 ; j < 3 ; ++j)
+    key = (key << 21) | ((uint64_t)(int64_t)floor(pose.v[j] / size[j]) & 0x1FFFFF);
+  return key;
+}
+
+double pf_normalize_ess(pf_t* pf, double total, double* ess)
+{
+  pf_sample_set_t* set = pf->sets + pf->current_set;
+  const int count = set->sample_count;
+  if(count == 0)
+  {
+    *ess = 0.0;
+    return 0.0;
+  }
+  if(total <= 0.0)
+  {
+    //nothing to prefer, as pf_normalize does
+    for(int i = 0 ; i < count ; ++i)
+      set->samples[i].weight = 1.0/count;
+    *ess = count;
+    return 0.0;
+  }
+  double sum_sq = 0.0;
+  for(int i = 0 ; i < count ; ++i)
+  {
+    double w = set->samples[i].weight / total;
+    set->samples[i].weight = w;
+    sum_sq += w*w;
+  }
+  *ess = sum_sq > 0.0 ? 1.0/sum_sq : 0.0;
+  return total/count;
+}
+
+double pf_normalize_log_weights(pf_sample_set_t* set, double* ess)
+{
+  pf_log_sum_t acc;
+  pf_log_sum_init(&acc);
+  for(int i = 0 ; i < set->sample_count ; ++i)
+    pf_log_sum_add(&acc, set->samples[i].logWeight);
+  double lse = pf_log_sum_value(&acc);
+  if(lse == -std::numeric_limits<double>::infinity())
+  {
+    //every sample is impossible, there is nothing to prefer
+    for(int i = 0 ; i < set->sample_count ; ++i)
+    {
+      set->samples[i].weight = 1.0/set->sample_count;
+      set->samples[i].logWeight = -log((double)set->sample_count);
+    }
+    if(ess)
+      *ess = set->sample_count;
+    return lse;
+  }
+  double sum_sq = 0.0;
+  for(int i = 0 ; i < set->sample_count ; ++i)
+  {
+    pf_sample_t* sample = set->samples + i;
+    sample->logWeight -= lse;
+    sample->weight = exp(sample->logWeight);
+    sum_sq += sample->weight*sample->weight;
+  }
+  if(ess)
+    *ess = sum_sq > 0.0 ? 1.0/sum_sq : 0.0;
+  return lse;
+}
+
+double pf_effective_sample_size(const pf_sample_set_t* set)
+{
+  double sum = 0.0, sum_sq = 0.0;
+  for(int i = 0 ; i < set->sample_count ; ++i)
+  {
+    double w = set->samples[i].weight;
+    sum += w;
+    sum_sq += w*w;
+  }
+  return sum_sq > 0.0 ? sum*sum/sum_sq : 0.0;
+}
 
 void pf_update_without_resample(pf_t* pf)
 {
@@ -9,67 +94,162 @@ void pf_update_without_resample(pf_t* pf)
   pf_sample_t *sample_a, *sample_b;
   set_a = pf->sets + pf->current_set;
   set_b = pf->sets + (pf->current_set + 1) % 2;
-  // Create the kd tree for adaptive sampling
-  pf_kdtree_clear(set_a->kdtree);
-  for(int i = 0 ; i < set_a->sample_count ; ++i)
-    pf_kdtree_insert(set_a->kdtree, set_a->samples[i].pose, set_a->samples[i].weight);
-  // Re-compute cluster statistics
-  pf_cluster_stats(pf, set_a);
+  // Re-compute histogram and cluster statistics
+  pf_cluster_stats_parallel(set_a);
   pf_update_converged(pf);
 }
 
-void pf_update_resample_lowvariance(pf_t* pf)
+//draw parents from the ascending positions pos(m) in [0, c[n]) by one merge walk over c
+template<class Position>
+static void pf_resample_walk(const double* c, int n, int count, Position pos, int* parents)
 {
-  pf_sample_set_t *set_a, *set_b;
-  pf_sample_t *sample_a, *sample_b;
-  double r,c,U;
-  int m, i;
-  double count_inv, total;
+  int i = 0;
+  for(int m = 0 ; m < count ; ++m)
+  {
+    double u = pos(m);
+    while(i < n-1 && c[i+1] <= u)
+      ++i;
+    parents[m] = i;
+  }
+}
 
-  set_a = pf->sets + pf->current_set;
-  set_b = pf->sets + (pf->current_set + 1) % 2;
-  // Create the kd tree for adaptive sampling
-  pf_kdtree_clear(set_b->kdtree);
-  count_inv = 1.0/set_a->sample_count;
-  total = 0;
-  r = MCL<void>::rng_.uniform01() * count_inv;
-  c = set_a->samples[0].weight;
-  i = 0;
-  set_b->sample_count = 0;
-  m = 0;
-  while(set_b->sample_count < pf->max_samples)
+void pf_resample_draw(const double* c, int n, int count, pf_resample_scheme_t scheme, int* parents)
+{
+  if(count <= 0)
+    return;
+  double total = c[n];
+  if(!(total > 0.0))
   {
-    sample_b = set_b->samples + set_b->sample_count++;
-    U = r + m * count_inv;
-    while(U>c)
+    //no weight at all, spread the draws evenly
+    for(int m = 0 ; m < count ; ++m)
+      parents[m] = (int)(((long long)m*n)/count);
+    return;
+  }
+  double step = total/count;
+  Philox4x32& rng = RandomStreams::bound();
+  switch(scheme)
+  {
+    case PF_RESAMPLE_SYSTEMATIC:
+    {
+      double u = rng.uniform01();
+      pf_resample_walk(c, n, count, [&](int m) { return (m + u)*step; }, parents);
+      break;
+    }
+    case PF_RESAMPLE_STRATIFIED:
     {
-      i++;
-      if(i >= set_a->sample_count)
+      std::vector<double> u(count);
+      rng.uniforms(count, u.data());
+      pf_resample_walk(c, n, count, [&](int m) { return (m + u[m])*step; }, parents);
+      break;
+    }
+    case PF_RESAMPLE_RESIDUAL:
+    {
+      //floor(count*w) copies of each sample, the rest is drawn systematically from the fractional parts
+      std::vector<int> copies(n);
+      std::vector<double> residual(n+1);
+      int remaining = count;
+      residual[0] = 0.0;
+      for(int i = 0 ; i < n ; ++i)
       {
-        c = set_a->samples[0].weight;
-        i = 0;
-        m = 0;
-        U = r + m * count_inv;
-        continue;
+        double expected = (c[i+1] - c[i])/step;
+        copies[i] = std::min((int)expected, remaining);
+        remaining -= copies[i];
+        residual[i+1] = residual[i] + (expected - copies[i]);
       }
-      c += set_a->samples[i].weight;
+      if(remaining > 0)
+      {
+        std::vector<int> extra(remaining);
+        pf_resample_draw(residual.data(), n, remaining, PF_RESAMPLE_SYSTEMATIC, extra.data());
+        for(auto i : extra)
+          ++copies[i];
+      }
+      int m = 0;
+      for(int i = 0 ; i < n ; ++i)
+        for(int k = 0 ; k < copies[i] ; ++k)
+          parents[m++] = i;
+      break;
+    }
+    case PF_RESAMPLE_MULTINOMIAL:
+    default:
+    {
+      //sorted uniforms from normalized exponential spacings, so multinomial draws need no search either
+      std::vector<double> spacing(count + 1);
+      rng.uniforms(count + 1, spacing.data());
+      double sum = 0.0;
+      for(int m = 0 ; m <= count ; ++m)
+      {
+        sum += -log(spacing[m]);
+        spacing[m] = sum;
+      }
+      double scale = total/sum;
+      pf_resample_walk(c, n, count, [&](int m) { return spacing[m]*scale; }, parents);
+      break;
     }
-    m++;
-    sample_b->pose = set_a->samples[i].pose;
-    sample_b->weight = 1.0;
-    total += sample_b->weight;
-    // Add sample to histogram
-    pf_kdtree_insert(set_b->kdtree, sample_b->pose, sample_b->weight);
   }
-  set_a->sample_count = 0;
-  // Normalize weights
-  for (i = 0; i < set_b->sample_count; i++)
+}
+
+int pf_resample_kld_select(pf_t* pf, const pf_kdtree_t* tree, const pf_vector_t* poses, int* parents, int count)
+{
+  int bits = 0;
+  while((1 << bits) < count)
+    ++bits;
+  std::unordered_set<uint64_t> bins;
+  std::vector<int> taken;
+  taken.reserve(count);
+  int limit = pf_resample_limit(pf, 0);
+  //bit reversed order, every prefix of the visit is spread over the whole ordered draw like a draw of its own
+  for(int k = 0 ; k < (1 << bits) ; ++k)
   {
-    sample_b = set_b->samples + i;
-    sample_b->weight /= total;
+    int m = 0;
+    for(int b = 0 ; b < bits ; ++b)
+      if(k & (1 << b))
+        m |= 1 << (bits - 1 - b);
+    if(m >= count)
+      continue;
+    taken.push_back(m);
+    if(bins.insert(pf_resample_bin_key(poses[m], tree->size)).second)
+      limit = pf_resample_limit(pf, bins.size());
+    //as pf_update_resample_kld, stop at the first draw beyond the limit of the bins occupied so far
+    if((int)taken.size() > limit)
+      break;
   }
-  // Re-compute cluster statistics
-  pf_cluster_stats(pf, set_b);
+  //taken[i] >= i once sorted, so the parents move to the front in place
+  std::sort(taken.begin(), taken.end());
+  for(size_t i = 0 ; i < taken.size() ; ++i)
+    parents[i] = parents[taken[i]];
+  return taken.size();
+}
+
+//resample set a into set b with one of the ordered schemes
+static void pf_update_resample_scheme(pf_t* pf, pf_resample_scheme_t scheme, bool kld)
+{
+  pf_sample_set_t *set_a, *set_b;
+  pf_sample_t *sample_b;
+  set_a = pf->sets + pf->current_set;
+  set_b = pf->sets + (pf->current_set + 1) % 2;
+  int n = set_a->sample_count;
+  std::vector<double> c(n+1);
+  parallelPrefixSum(n, [set_a](int i) { return set_a->samples[i].weight; }, c.data());
+  int count = pf->max_samples;
+  std::vector<int> parents(count);
+  pf_resample_draw(c.data(), n, count, scheme, parents.data());
+  if(kld)
+  {
+    std::vector<pf_vector_t> poses(count);
+    for(int m = 0 ; m < count ; ++m)
+      poses[m] = set_a->samples[parents[m]].pose;
+    count = pf_resample_kld_select(pf, set_b->kdtree, poses.data(), parents.data(), count);
+  }
+  set_b->sample_count = count;
+  for(int m = 0 ; m < count ; ++m)
+  {
+    sample_b = set_b->samples + m;
+    sample_b->pose = set_a->samples[parents[m]].pose;
+    sample_b->weight = 1.0/count;
+  }
+  //set_a is kept, it is required for building density tree
+  // Re-compute histogram and cluster statistics
+  pf_cluster_stats_parallel(set_b);
 
   // Use the newly created sample set
   pf->current_set = (pf->current_set + 1) % 2; 
@@ -77,6 +257,136 @@ void pf_update_resample_lowvariance(pf_t* pf)
   pf_update_converged(pf);
 }
 
+void pf_update_resample_lowvariance(pf_t* pf)
+{
+  pf_update_resample_scheme(pf, PF_RESAMPLE_SYSTEMATIC, false);
+}
+
+void pf_update_resample_systematic(pf_t* pf)
+{
+  pf_update_resample_scheme(pf, PF_RESAMPLE_SYSTEMATIC, false);
+}
+
+void pf_update_resample_stratified(pf_t* pf)
+{
+  pf_update_resample_scheme(pf, PF_RESAMPLE_STRATIFIED, false);
+}
+
+void pf_update_resample_residual(pf_t* pf)
+{
+  pf_update_resample_scheme(pf, PF_RESAMPLE_RESIDUAL, false);
+}
+
+void pf_update_resample_systematic_kld(pf_t* pf)
+{
+  pf_update_resample_scheme(pf, PF_RESAMPLE_SYSTEMATIC, true);
+}
+
+void pf_update_resample_stratified_kld(pf_t* pf)
+{
+  pf_update_resample_scheme(pf, PF_RESAMPLE_STRATIFIED, true);
+}
+
+void pf_update_resample_residual_kld(pf_t* pf)
+{
+  pf_update_resample_scheme(pf, PF_RESAMPLE_RESIDUAL, true);
+}
+
+void pf_resize(pf_t* pf, int min_samples, int max_samples)
+{
+  pf->min_samples = min_samples;
+  if(max_samples == pf->max_samples)
+    return;
+  pf_sample_set_t *set_a, *set_b;
+  set_a = pf->sets + pf->current_set;
+  set_b = pf->sets + (pf->current_set + 1) % 2;
+  //an ordered set would lose whole regions by truncation, so shrink it by resampling into the other set
+  if(set_a->sample_count > max_samples)
+  {
+    int n = set_a->sample_count;
+    std::vector<double> c(n+1);
+    parallelPrefixSum(n, [set_a](int i) { return set_a->samples[i].weight; }, c.data());
+    std::vector<int> parents(max_samples);
+    pf_resample_draw(c.data(), n, max_samples, PF_RESAMPLE_SYSTEMATIC, parents.data());
+    for(int m = 0 ; m < max_samples ; ++m)
+    {
+      set_b->samples[m] = set_a->samples[parents[m]];
+      set_b->samples[m].weight = 1.0/max_samples;
+      set_b->samples[m].logWeight = -log((double)max_samples);
+    }
+    set_b->sample_count = max_samples;
+    pf->current_set = (pf->current_set + 1) % 2;
+  }
+  for(int i = 0 ; i < 2 ; ++i)
+  {
+    pf_sample_set_t* set = pf->sets + i;
+    set->samples = (pf_sample_t*)realloc(set->samples, max_samples * sizeof(pf_sample_t));
+    set->clusters = (pf_cluster_t*)realloc(set->clusters, max_samples * sizeof(pf_cluster_t));
+    set->sample_count = std::min(set->sample_count, max_samples);
+    set->cluster_max_count = max_samples;
+    set->cluster_count = std::min(set->cluster_count, max_samples);
+    //the tree is rebuilt from the samples anyway, only its bin size carries over
+    pf_kdtree_t* kdtree = pf_kdtree_alloc(3 * max_samples);
+    for(int j = 0 ; j < 3 ; ++j)
+      kdtree->size[j] = set->kdtree->size[j];
+    pf_kdtree_free(set->kdtree);
+    set->kdtree = kdtree;
+  }
+  pf->max_samples = max_samples;
+  pf_cluster_stats_parallel(pf->sets + pf->current_set);
+  pf_update_converged(pf);
+}
+
+bool pf_resample_scheme_by_name(const std::string& name, pf_resample_scheme_t* scheme, bool* kld)
+{
+  std::string base = name;
+  *kld = false;
+  if(name == "kld")
+  {
+    *scheme = PF_RESAMPLE_MULTINOMIAL;
+    *kld = true;
+    return true;
+  }
+  if(base.size() > 4 && base.compare(base.size() - 4, 4, "_kld") == 0)
+  {
+    base.resize(base.size() - 4);
+    *kld = true;
+  }
+  if(base == "systematic" || base == "lowvariance")
+    *scheme = PF_RESAMPLE_SYSTEMATIC;
+  else if(base == "stratified")
+    *scheme = PF_RESAMPLE_STRATIFIED;
+  else if(base == "residual")
+    *scheme = PF_RESAMPLE_RESIDUAL;
+  else
+    return false;
+  return true;
+}
+
+pf_resample_fn_t pf_resample_function(const std::string& name)
+{
+  pf_resample_scheme_t scheme;
+  bool kld;
+  if(name == "augmented")
+    return &pf_update_resample;
+  if(name == "kld")
+    return &pf_update_resample_kld;
+  if(name == "lowvariance")
+    return &pf_update_resample_lowvariance;
+  if(!pf_resample_scheme_by_name(name, &scheme, &kld))
+    return NULL;
+  switch(scheme)
+  {
+    case PF_RESAMPLE_STRATIFIED:
+      return kld ? &pf_update_resample_stratified_kld : &pf_update_resample_stratified;
+    case PF_RESAMPLE_RESIDUAL:
+      return kld ? &pf_update_resample_residual_kld : &pf_update_resample_residual;
+    case PF_RESAMPLE_SYSTEMATIC:
+    default:
+      return kld ? &pf_update_resample_systematic_kld : &pf_update_resample_systematic;
+  }
+}
+
 void pf_update_resample_kld(pf_t* pf)
 {
   int i;
@@ -93,15 +403,13 @@ void pf_update_resample_kld(pf_t* pf)
   set_b = pf->sets + (pf->current_set + 1) % 2;
 
   // Build up cumulative probability table for resampling.
-  // TODO: Replace this with a more efficient procedure
-  // (e.g., http://www.network-theory.co.uk/docs/gslref/GeneralDiscreteDistributions.html)
   c = (double*)malloc(sizeof(double)*(set_a->sample_count+1));
-  c[0] = 0.0;
-  for(i=0;i<set_a->sample_count;i++)
-    c[i+1] = c[i]+set_a->samples[i].weight;
+  parallelPrefixSum(set_a->sample_count, [set_a](int i) { return set_a->samples[i].weight; }, c);
 
-  // Create the kd tree for adaptive sampling
-  pf_kdtree_clear(set_b->kdtree);
+  //occupied bins for adaptive sampling, the kd-tree is rebuilt from the new set by pf_cluster_stats_parallel
+  std::unordered_set<uint64_t> bins;
+  const double* size = set_b->kdtree->size;
+  Philox4x32& rng = RandomStreams::bound();
   
   // Draw samples from set a to create set b.
   total = 0;
@@ -110,15 +418,10 @@ void pf_update_resample_kld(pf_t* pf)
   {
     sample_b = set_b->samples + set_b->sample_count++;
 
-    // Naive discrete event sampler
-    double r = MCL<void>::rng_.uniform01();
-    //r = drand48();
-    for(i=0;i<set_a->sample_count;i++)
-    {
-      if((c[i] <= r) && (r < c[i+1]))
-        break;
-    }
-    assert(i<set_a->sample_count);
+    // Discrete event sampler by binary search
+    double r = rng.uniform01() * c[set_a->sample_count];
+    i = std::upper_bound(c, c + set_a->sample_count + 1, r) - c - 1;
+    i = std::min(std::max(i, 0), set_a->sample_count - 1);
 
     sample_a = set_a->samples + i;
 
@@ -129,10 +432,10 @@ void pf_update_resample_kld(pf_t* pf)
     total += sample_b->weight;
 
     // Add sample to histogram
-    pf_kdtree_insert(set_b->kdtree, sample_b->pose, sample_b->weight);
+    bins.insert(pf_resample_bin_key(sample_b->pose, size));
 
     // See if we have enough samples yet
-    if (set_b->sample_count > pf_resample_limit(pf, set_b->kdtree->leaf_count))
+    if (set_b->sample_count > pf_resample_limit(pf, bins.size()))
       break;
   }
   //set_a->sample_count = 0;//removed due to these information is required fro building density tree
@@ -145,7 +448,7 @@ void pf_update_resample_kld(pf_t* pf)
   }
   
   // Re-compute cluster statistics
-  pf_cluster_stats(pf, set_b);
+  pf_cluster_stats_parallel(set_b);
 
   // Use the newly created sample set
   pf->current_set = (pf->current_set + 1) % 2; 
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <cmath>
+#include "markov/LikelihoodPyramid.h"
+
+LikelihoodPyramid::LikelihoodPyramid():
+  map_(NULL)
+{
+}
+
+void LikelihoodPyramid::init(const map_t* map)
+{
+  map_ = map;
+  widths_.clear();
+  heights_.clear();
+  distances_.clear();
+  widths_.push_back(map_->size_x);
+  heights_.push_back(map_->size_y);
+  distances_.push_back(std::vector<float>((size_t)map_->size_x*map_->size_y));
+  std::vector<float>& base = distances_.back();
+  for(size_t i = 0 ; i < base.size() ; ++i)
+    base[i] = map_->cells[i].occ_dist;
+  //halve until a single cell covers the map
+  while(widths_.back() > 1 || heights_.back() > 1)
+  {
+    int fine_width = widths_.back();
+    int fine_height = heights_.back();
+    int width = (fine_width+1)/2;
+    int height = (fine_height+1)/2;
+    std::vector<float> coarse((size_t)width*height);
+    const std::vector<float>& fine = distances_.back();
+    for(int y = 0 ; y < height ; ++y)
+    {
+      for(int x = 0 ; x < width ; ++x)
+      {
+        float d = map_->max_occ_dist;
+        for(int fy = 2*y ; fy < std::min(2*y+2, fine_height) ; ++fy)
+          for(int fx = 2*x ; fx < std::min(2*x+2, fine_width) ; ++fx)
+            d = std::min(d, fine[(size_t)fy*fine_width+fx]);
+        coarse[(size_t)y*width+x] = d;
+      }
+    }
+    widths_.push_back(width);
+    heights_.push_back(height);
+    distances_.push_back(coarse);
+  }
+}
+
+double LikelihoodPyramid::minDistance(double wx, double wy, double radius) const
+{
+  int mx = MAP_GXWX(map_, wx);
+  int my = MAP_GYWY(map_, wy);
+  //a point within radius falls at most reach cells away from (mx, my)
+  int reach = (int)floor(radius/map_->scale) + 1;
+  //the coarsest level whose cells are still no wider than reach,
+  //then the block of (mx, my) and its direct neighbors cover every such cell
+  int level = 0;
+  while(level+1 < levels() && (1 << level) < reach)
+    ++level;
+  int side = 1 << level;
+  int n = (reach + side - 1)/side;
+  //floor division keeps off-map cells on the correct side
+  int cx = mx >= 0 ? mx/side : -((-mx + side - 1)/side);
+  int cy = my >= 0 ? my/side : -((-my + side - 1)/side);
+  int width = widths_[level];
+  int height = heights_[level];
+  const std::vector<float>& distances = distances_[level];
+  double d = map_->max_occ_dist;
+  for(int y = std::max(0, cy-n) ; y <= std::min(height-1, cy+n) ; ++y)
+    for(int x = std::max(0, cx-n) ; x <= std::min(width-1, cx+n) ; ++x)
+      d = std::min(d, (double)distances[(size_t)y*width+x]);
+  return d;
+}
+
+size_t LikelihoodPyramid::bytes() const
+{
+  size_t total = 0;
+  for(auto&& level : distances_)
+    total += level.capacity()*sizeof(float);
+  return total;
+}
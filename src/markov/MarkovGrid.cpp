@@ -0,0 +1,45 @@
+#include "markov/MarkovGrid.h"
+
+MarkovGrid::MarkovGrid():
+  map_(NULL),
+  size_a_(0),
+  ares_(0),
+  size_(0),
+  current_set_(0)
+{
+}
+
+void MarkovGrid::init(const FreeSpaceIndex& free_space, int size_a, int ares, float weight)
+{
+  map_ = free_space.map();
+  size_a_ = size_a;
+  ares_ = ares;
+  current_set_ = 0;
+  cells_.resize(free_space.size());
+  map2free_.assign((size_t)map_->size_x*map_->size_y, -1);
+  for(int free_idx = 0 ; free_idx < free_space.size() ; ++free_idx)
+  {
+    int map_idx = free_space.cell(free_idx);
+    cells_[free_idx] = map_idx;
+    map2free_[map_idx] = free_idx;
+  }
+  size_ = cells_.size()*size_a_;
+  weights_[0].assign(size_, weight);
+  weights_[1].assign(size_, weight);
+}
+
+pf_vector_t MarkovGrid::pose(int idx) const
+{
+  pf_vector_t pose;
+  int free_idx = freeIdx(idx);
+  pose.v[0] = MAP_WXGX(map_, cellX(free_idx));
+  pose.v[1] = MAP_WYGY(map_, cellY(free_idx));
+  pose.v[2] = heading(headingIdx(idx));
+  return pose;
+}
+
+size_t MarkovGrid::bytes() const
+{
+  return (cells_.capacity() + map2free_.capacity())*sizeof(int32_t) +
+         (weights_[0].capacity() + weights_[1].capacity())*sizeof(float);
+}
@@ -1,21 +1,26 @@
 #include <cstdint>
+#include <algorithm>
+#include <limits>
 #include "markov/MarkovNode.h"
+#include "amcl/pf/pf_cluster.h"
+#include "mcl/parallel.h"
 #include "mcl/MCL.cpp"
 template class MCL<MarkovNode>;
 using namespace std;
 
-double MarkovNode::UpdateParticle(amcl::AMCLLaser* self, amcl::AMCLLaserData* ldata, pf_sample_t* sample)
+//log-likelihood of the likelihood field model for a single robot pose
+double MarkovNode::ParticleLogLikelihood(amcl::AMCLLaser* self, amcl::AMCLLaserData* ldata, const pf_vector_t& robot_pose)
 {
-  int i, j, step;
+  int i, step;
   double z, pz;
   double obs_range, obs_bearing;
+  double log_weight;
   pf_vector_t pose;
   pf_vector_t hit;
 
-  pose = sample->pose;
   // Take account of the laser pose relative to the robot
   //TODO check pf_vector_coord_add
-  pose = pf_vector_coord_add(self->laser_pose, pose);
+  pose = pf_vector_coord_add(self->laser_pose, robot_pose);
 
   // Pre-compute a couple of things
   double z_hit_denom = 2 * self->sigma_hit * self->sigma_hit;
@@ -26,7 +31,7 @@ double MarkovNode::UpdateParticle(amcl::AMCLLaser* self, amcl::AMCLLaserData* ld
   // Step size must be at least 1
   if(step < 1)
     step = 1;
-  sample->logWeight = 0.0;
+  log_weight = 0.0;
   for (i = 0; i < ldata->range_count; i += step)
   {
     obs_range = ldata->ranges[i][0];
@@ -68,180 +73,372 @@ double MarkovNode::UpdateParticle(amcl::AMCLLaser* self, amcl::AMCLLaserData* ld
     assert(pz <= 1.0);
     // here we have an ad-hoc weighting scheme for combining beam probs
     // works well, though...
-    sample->logWeight += log(pz);
+    log_weight += log(pz);
   }
 
-  sample->weight *= exp(sample->logWeight);
+  return log_weight;
+}
 
-  return sample->weight;
+//evaluate the listed samples of the current set, or every sample if indices is NULL
+//the posterior is formed in the log domain and normalized by its log-sum-exp,
+//so that the float weights neither underflow nor flatten unlikely cells
+double MarkovNode::UpdateLaserParallel(amcl::AMCLLaserData* ldata, const std::vector<int>* indices)
+{
+  pf_log_sum_t log_total;
+  pf_log_sum_init(&log_total);
+  UpdateLogWeights(ldata, indices, &log_total);
+  double total_weight = RescaleLogWeights(indices, pf_log_sum_value(&log_total));
+  ROS_DEBUG("total weight of %ld evaluated samples: %f", indices ? indices->size() : (size_t)grid_.size(), total_weight);
+  return total_weight;
 }
 
-double MarkovNode::UpdateLaserParallel(amcl::AMCLLaserData* ldata)
+//replace the listed weights by their log posterior and add them to log_total,
+//the prior is scaled by prior_scale_ on the way, a zero prior gives -inf and drops out of the log-sum
+void MarkovNode::UpdateLogWeights(amcl::AMCLLaserData* ldata, const std::vector<int>* indices, pf_log_sum_t* log_total)
 {
-  amcl::AMCLLaser *self;
-  pf_sample_set_t *set;
-  double total_weight;
-  int sample_counter, percent_count;
+  amcl::AMCLLaser* self = (amcl::AMCLLaser*) ldata->sensor;
+  float* weights = grid_.current();
+  int count = indices ? indices->size() : grid_.size();
   std::mutex worker_mutex;
+  auto worker = [&, this](int beg, int end)
+  {
+    pf_log_sum_t local_total;
+    pf_log_sum_init(&local_total);
+    for(int k = beg ; k < end ; ++k)
+    {
+      int idx = indices ? (*indices)[k] : k;
+      double prior = weights[idx]*prior_scale_;
+      double log_weight = prior > 0.0 ? log(prior) + ParticleLogLikelihood(self, ldata, grid_.pose(idx))
+                                      : -std::numeric_limits<double>::infinity();
+      weights[idx] = log_weight;
+      pf_log_sum_add(&local_total, log_weight);
+    }
+    std::lock_guard<std::mutex> lg(worker_mutex);
+    pf_log_sum_merge(log_total, &local_total);
+  };
+  parallelFor(count, worker);
+}
 
-  self = (amcl::AMCLLaser*) ldata->sensor;
-  set = grid_->sets + grid_->current_set;
-  total_weight = 0.0;
-  sample_counter = 0;
-  percent_count = (int) set->sample_count/100.0;
-  if(percent_count <=0)
-    percent_count = 1;
-  auto worker = [set, self, ldata, &total_weight, &sample_counter, percent_count, &worker_mutex](int beg_sidx, int end_sidx)
+//turn the listed log weights into weights normalized by log_total and return their sum
+double MarkovNode::RescaleLogWeights(const std::vector<int>* indices, double log_total)
+{
+  float* weights = grid_.current();
+  int count = indices ? indices->size() : grid_.size();
+  double total_weight = 0.0;
+  std::mutex worker_mutex;
+  auto worker = [&](int beg, int end)
   {
-    for(int sidx = beg_sidx ; sidx < end_sidx ; ++sidx)
+    double local_weight = 0.0;
+    for(int k = beg ; k < end ; ++k)
     {
-      double particle_weight = UpdateParticle(self, ldata, set->samples + sidx);
-      std::lock_guard<std::mutex> lg(worker_mutex);
-      total_weight += particle_weight;
-      ++sample_counter;
-      if(sample_counter%percent_count == 0)
-      {
-        ROS_DEBUG("progress: %f, %d/%d with current total_weight: %f", ((double)1.0*sample_counter/(set->sample_count)*100), sample_counter, set->sample_count, total_weight);
-      }
+      int idx = indices ? (*indices)[k] : k;
+      //every listed posterior may be zero, then log_total is -inf as well
+      weights[idx] = log_total > -std::numeric_limits<double>::infinity() ? exp(weights[idx] - log_total) : 0.0;
+      local_weight += weights[idx];
     }
+    std::lock_guard<std::mutex> lg(worker_mutex);
+    total_weight += local_weight;
   };
+  parallelFor(count, worker);
+  return total_weight;
+}
 
-  int nb_threads_hint = std::thread::hardware_concurrency();
-  int nb_threads = (nb_threads_hint == 0u ? 8u : nb_threads_hint);
-  vector<std::thread> threads(nb_threads);
-  int grainsize = (int)(1.0*set->sample_count/nb_threads);
-  int sidx = 0;
-  ROS_INFO("percent_count of total_sample: %d of %d", percent_count, set->sample_count);
-  for(auto tit = std::begin(threads); tit != std::end(threads)-1 ; ++tit)
+//maximum prior weight of every region of levels 1 to hierarchical_levels_, as seen by UpdateLogWeights,
+//a region of level k is a 2^k x 2^k block of map cells times a group of 2^k headings
+void MarkovNode::buildBeliefPyramid()
+{
+  const float* weights = grid_.current();
+  std::vector<float>& first = belief_pyramid_[1];
+  std::fill(first.begin(), first.end(), 0.0f);
+  for(int free_idx = 0 ; free_idx < grid_.freeCount() ; ++free_idx)
   {
-    *tit = std::thread(worker, sidx, sidx+grainsize);
-    sidx+=grainsize;
+    int bx = grid_.cellX(free_idx) >> 1;
+    int by = grid_.cellY(free_idx) >> 1;
+    for(int a = 0 ; a < size_a_ ; ++a)
+    {
+      float& prior = first[beliefIndex(1, bx, by, a >> 1)];
+      prior = std::max(prior, (float)(weights[free_idx*size_a_ + a]*prior_scale_));
+    }
   }
-  threads.back() = std::thread(worker, sidx, set->sample_count);
-  //wait threads finished
-  for(auto&& thread: threads) {
-    thread.join();
+  for(int level = 2 ; level <= hierarchical_levels_ ; ++level)
+  {
+    std::vector<float>& coarse = belief_pyramid_[level];
+    const std::vector<float>& fine = belief_pyramid_[level-1];
+    std::fill(coarse.begin(), coarse.end(), 0.0f);
+    int width = levelSize(map_->size_x, level-1);
+    int height = levelSize(map_->size_y, level-1);
+    int groups = levelSize(size_a_, level-1);
+    for(int g = 0 ; g < groups ; ++g)
+      for(int by = 0 ; by < height ; ++by)
+        for(int bx = 0 ; bx < width ; ++bx)
+        {
+          float& prior = coarse[beliefIndex(level, bx >> 1, by >> 1, g >> 1)];
+          prior = std::max(prior, fine[beliefIndex(level-1, bx, by, g)]);
+        }
   }
-
-  ROS_INFO("total weight: %f", total_weight);
-
-  return total_weight;
-
 }
 
-double MarkovNode::UpdateLaser(amcl::AMCLLaserData* ldata)
+//upper bound of the log posterior over every sample of the region,
+//the beams are cast from the region center and each endpoint is widened by how far
+//the position and heading spread of the region can move it
+double MarkovNode::regionBound(amcl::AMCLLaser* self, amcl::AMCLLaserData* ldata, const GridRegion& region) const
 {
-  amcl::AMCLLaser *self;
-  int i, j, step;
-  double z, pz;
-  //double p;
-  double obs_range, obs_bearing;
-  double total_weight;
-  pf_sample_set_t *set;
-  pf_sample_t *sample;
-  pf_vector_t pose;
-  pf_vector_t hit;
+  int side = 1 << region.level;
+  int a0 = region.g*side;
+  int count = std::min(side, size_a_ - a0);
+  double half_angle = (count-1)/2.0*ares_*M_PI/180.0;
+  double position_radius = (side-1)/2.0*map_->scale*M_SQRT2;
+  double laser_offset = hypot(self->laser_pose.v[0], self->laser_pose.v[1]);
+  pf_vector_t center;
+  center.v[0] = MAP_WXGX(map_, region.bx*side + (side-1)/2.0);
+  center.v[1] = MAP_WYGY(map_, region.by*side + (side-1)/2.0);
+  center.v[2] = grid_.heading(a0) + half_angle;
+  pf_vector_t pose = pf_vector_coord_add(self->laser_pose, center);
 
-  self = (amcl::AMCLLaser*) ldata->sensor;
-  set = grid_->sets + grid_->current_set;
-  total_weight = 0.0;
-  // Compute the sample weights
-  for (j = 0; j < set->sample_count; j++)
+  double z_hit_denom = 2 * self->sigma_hit * self->sigma_hit;
+  double z_rand_mult = 1.0/ldata->range_max;
+  int step = (ldata->range_count - 1) / (self->max_beams - 1);
+  if(step < 1)
+    step = 1;
+  double log_bound = log(belief_pyramid_[region.level][beliefIndex(region.level, region.bx, region.by, region.g)]);
+  for(int i = 0; i < ldata->range_count; i += step)
   {
-    sample = set->samples + j;
-    pose = sample->pose;
-
-    // Take account of the laser pose relative to the robot
-    //TODO check pf_vector_coord_add
-    pose = pf_vector_coord_add(self->laser_pose, pose);
-
-    //p = 1.0;
-
-    // Pre-compute a couple of things
-    double z_hit_denom = 2 * self->sigma_hit * self->sigma_hit;
-    double z_rand_mult = 1.0/ldata->range_max;
+    double obs_range = ldata->ranges[i][0];
+    double obs_bearing = ldata->ranges[i][1];
+    if(obs_range >= ldata->range_max || obs_range != obs_range)
+      continue;
+    double hx = pose.v[0] + obs_range * cos(pose.v[2] + obs_bearing);
+    double hy = pose.v[1] + obs_range * sin(pose.v[2] + obs_bearing);
+    //rotating the beam by at most half_angle moves its endpoint by at most the arc length
+    double radius = position_radius + (obs_range + laser_offset)*half_angle;
+    double z = likelihood_pyramid_.minDistance(hx, hy, radius);
+    log_bound += log(self->z_hit * exp(-(z * z) / z_hit_denom) + self->z_rand * z_rand_mult);
+  }
+  return log_bound;
+}
 
-    step = (ldata->range_count - 1) / (self->max_beams - 1);
+//regions of the next finer level inside region which hold free cells
+void MarkovNode::regionChildren(const GridRegion& region, std::vector<GridRegion>& children) const
+{
+  int level = region.level-1;
+  int width = levelSize(map_->size_x, level);
+  int height = levelSize(map_->size_y, level);
+  int groups = levelSize(size_a_, level);
+  const std::vector<float>& prior = belief_pyramid_[level];
+  for(int g = 2*region.g ; g < std::min(2*region.g+2, groups) ; ++g)
+    for(int by = 2*region.by ; by < std::min(2*region.by+2, height) ; ++by)
+      for(int bx = 2*region.bx ; bx < std::min(2*region.bx+2, width) ; ++bx)
+        if(prior[beliefIndex(level, bx, by, g)] > 0.0f)
+        {
+          GridRegion child = {level, bx, by, g};
+          children.push_back(child);
+        }
+}
 
-    // Step size must be at least 1
-    if(step < 1)
-      step = 1;
-    sample->logWeight = 0.0;
-    for (i = 0; i < ldata->range_count; i += step)
+//grid samples inside region
+void MarkovNode::regionSamples(const GridRegion& region, std::vector<int>& indices) const
+{
+  int side = 1 << region.level;
+  for(int y = region.by*side ; y < std::min((region.by+1)*side, map_->size_y) ; ++y)
+    for(int x = region.bx*side ; x < std::min((region.bx+1)*side, map_->size_x) ; ++x)
     {
-      obs_range = ldata->ranges[i][0];
-      obs_bearing = ldata->ranges[i][1];
-
-      // This model ignores max range readings
-      if(obs_range >= ldata->range_max)
+      int free_idx = grid_.freeIndex(x, y);
+      if(free_idx < 0)
         continue;
+      for(int a = region.g*side ; a < std::min((region.g+1)*side, size_a_) ; ++a)
+        indices.push_back(free_idx*size_a_ + a);
+    }
+}
 
-      // Check for NaN
-      if(obs_range != obs_range)
-        continue;
-
-      pz = 0.0;
-
-      // Compute the endpoint of the beam
-      hit.v[0] = pose.v[0] + obs_range * cos(pose.v[2] + obs_bearing);
-      hit.v[1] = pose.v[1] + obs_range * sin(pose.v[2] + obs_bearing);
-
-      // Convert to map grid coords.
-      int mi, mj;
-      mi = MAP_GXWX(self->map, hit.v[0]);
-      mj = MAP_GYWY(self->map, hit.v[1]);
-      
-      // Part 1: Get distance from the hit to closest obstacle.
-      // Off-map penalized as max distance
-      if(!MAP_VALID(self->map, mi, mj))
-        z = self->map->max_occ_dist;
+//coarse to fine laser update
+//regions are bounded from the coarsest level down, those more than hierarchical_threshold_
+//below the best bound are not refined and only the samples of the remaining level 1 regions are
+//evaluated exactly; pruned regions whose bound still reaches the best exact posterior minus the
+//threshold are evaluated afterwards, so every skipped sample is below exp(-threshold) of the maximum
+double MarkovNode::UpdateLaserHierarchical(amcl::AMCLLaserData* ldata)
+{
+  amcl::AMCLLaser* self = (amcl::AMCLLaser*) ldata->sensor;
+  buildBeliefPyramid();
+  std::vector<GridRegion> frontier, children, pruned;
+  std::vector<double> bounds, pruned_bounds;
+  int top = hierarchical_levels_;
+  for(int g = 0 ; g < levelSize(size_a_, top) ; ++g)
+    for(int by = 0 ; by < levelSize(map_->size_y, top) ; ++by)
+      for(int bx = 0 ; bx < levelSize(map_->size_x, top) ; ++bx)
+        if(belief_pyramid_[top][beliefIndex(top, bx, by, g)] > 0.0f)
+        {
+          GridRegion region = {top, bx, by, g};
+          frontier.push_back(region);
+        }
+  std::vector<int> indices;
+  for(int level = top ; level >= 1 ; --level)
+  {
+    bounds.resize(frontier.size());
+    auto worker = [&, this](int beg, int end)
+    {
+      for(int k = beg ; k < end ; ++k)
+        bounds[k] = regionBound(self, ldata, frontier[k]);
+    };
+    parallelFor(frontier.size(), worker);
+    double best_bound = -std::numeric_limits<double>::infinity();
+    for(auto bound : bounds)
+      best_bound = std::max(best_bound, bound);
+    double cutoff = best_bound - hierarchical_threshold_;
+    children.clear();
+    for(int k = 0 ; k < frontier.size() ; ++k)
+    {
+      if(bounds[k] < cutoff)
+      {
+        pruned.push_back(frontier[k]);
+        pruned_bounds.push_back(bounds[k]);
+      }
+      else if(level > 1)
+        regionChildren(frontier[k], children);
       else
-        z = self->map->cells[MAP_INDEX(self->map,mi,mj)].occ_dist;
-      // Gaussian model
-      // NOTE: this should have a normalization of 1/(sqrt(2pi)*sigma)
-      pz += self->z_hit * exp(-(z * z) / z_hit_denom);
-      // Part 2: random measurements
-      pz += self->z_rand * z_rand_mult;
-
-      // TODO: outlier rejection for short readings
-
-      assert(pz <= 1.0);
-      assert(pz >= 0.0);
-      // here we have an ad-hoc weighting scheme for combining beam probs
-      // works well, though...
-      //p += pz*pz*pz;
-      //p *= pz;
-      sample->logWeight += log(pz);
+        regionSamples(frontier[k], indices);
     }
+    ROS_DEBUG("hierarchical level %d: %ld regions bounded, %ld pruned so far", level, frontier.size(), pruned.size());
+    frontier.swap(children);
+  }
+  pf_log_sum_t log_total;
+  pf_log_sum_init(&log_total);
+  UpdateLogWeights(ldata, &indices, &log_total);
+  //the coarse cutoffs were taken against bounds, check the pruned regions against the best exact
+  //log posterior, the largest term of the log-sum, not the log-sum which exceeds it by up to log(N)
+  std::vector<int> missed;
+  double cutoff = log_total.max - hierarchical_threshold_;
+  for(int k = 0 ; k < pruned.size() ; ++k)
+    if(pruned_bounds[k] >= cutoff)
+      regionSamples(pruned[k], missed);
+  if(!missed.empty())
+  {
+    UpdateLogWeights(ldata, &missed, &log_total);
+    indices.insert(indices.end(), missed.begin(), missed.end());
+  }
+  //samples which were not evaluated drop to zero and are floored by the caller
+  evaluated_mask_.assign(grid_.size(), 0);
+  for(auto idx : indices)
+    evaluated_mask_[idx] = 1;
+  float* weights = grid_.current();
+  for(int idx = 0 ; idx < grid_.size() ; ++idx)
+    if(!evaluated_mask_[idx])
+      weights[idx] = 0.0f;
+  double total_weight = RescaleLogWeights(&indices, pf_log_sum_value(&log_total));
+  ROS_DEBUG("hierarchical laser update evaluated %ld of %d samples, %ld after the exact check", indices.size(), grid_.size(), missed.size());
+  return total_weight;
+}
 
-    //sample->weight *= p;
-    sample->weight *= exp(sample->logWeight);
-    total_weight += sample->weight;
+//collect the cells of active samples and the cells within sparse_dilation_ of them,
+//all headings of those cells form the band evaluated by the sensor model
+void MarkovNode::buildActiveBand()
+{
+  //clear the marks left by the previous band
+  for(auto idx : band_indices_)
+    band_mask_[idx] = 0;
+  band_indices_.clear();
+  if(active_sample_indices_.empty())
+  {
+    //nothing is known yet, the whole grid is the band
+    band_indices_.resize(grid_.size());
+    for(int idx = 0 ; idx < grid_.size() ; ++idx)
+    {
+      band_indices_[idx] = idx;
+      band_mask_[idx] = 1;
+    }
+    return;
+  }
+  //1 marks a seed cell, 2 a cell already in the band
+  band_cells_.clear();
+  std::vector<int> seeds;
+  for(auto idx : active_sample_indices_)
+  {
+    int free_idx = grid_.freeIdx(idx);
+    if(cell_mask_[free_idx] == 0)
+    {
+      cell_mask_[free_idx] = 1;
+      seeds.push_back(free_idx);
+    }
+  }
+  for(auto free_idx : seeds)
+  {
+    int mx = grid_.cellX(free_idx);
+    int my = grid_.cellY(free_idx);
+    for(int dx = -sparse_dilation_ ; dx <= sparse_dilation_ ; ++dx)
+    {
+      for(int dy = -sparse_dilation_ ; dy <= sparse_dilation_ ; ++dy)
+      {
+        int ngb = grid_.freeIndex(mx+dx, my+dy);
+        if(ngb < 0 || cell_mask_[ngb] == 2)
+          continue;
+        cell_mask_[ngb] = 2;
+        band_cells_.push_back(ngb);
+      }
+    }
+  }
+  for(auto free_idx : band_cells_)
+  {
+    cell_mask_[free_idx] = 0;
+    for(int a = 0 ; a < size_a_ ; ++a)
+    {
+      int idx = free_idx * size_a_ + a;
+      band_indices_.push_back(idx);
+      band_mask_[idx] = 1;
+    }
   }
+}
 
-  return(total_weight);
+double MarkovNode::UpdateLaserSparse(amcl::AMCLLaserData* ldata)
+{
+  float* weights = grid_.current();
+  std::vector<int>& stale = stale_indices_[grid_.currentSet()];
+  buildActiveBand();
+  //mass left in this set by an older scan falls back to the floor outside the band
+  for(auto idx : stale)
+  {
+    if(!band_mask_[idx])
+      weights[idx] = inactive_weight_;
+  }
+  //the band comes out normalized, cells outside it keep inactive_weight_ and are not touched
+  double total = UpdateLaserParallel(ldata, &band_indices_);
+  active_sample_indices_.clear();
+  for(auto idx : band_indices_)
+  {
+    if(weights[idx] > inactive_weight_)
+      active_sample_indices_.push_back(idx);
+    else
+      weights[idx] = inactive_weight_;
+  }
+  stale = active_sample_indices_;
+  ROS_DEBUG("sparse laser update evaluated %ld of %d samples", band_indices_.size(), grid_.size());
+  return total;
 }
 
-//matrix vertion using original motion model
-double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
+//the histogram only lists active samples as (index, weight) pairs,
+//the leading pair (-1, inactive_weight_) gives the weight of every unlisted sample
+void MarkovNode::publishSparseHistogram(const ros::Time& stamp)
 {
-  //transform those matrices wrt each origin_pose in previous_set with previous weight
-  //multipy and increment all the weights and assign to the origin_pose particle in current_set grid
-  //sum up those resulting matrices
-  //assign the summation to origin_pose in current_set
+  const float* weights = grid_.current();
+  stamped_std_msgs::StampedFloat64MultiArray hist_msg;
+  hist_msg.header.frame_id = global_frame_id_;
+  hist_msg.header.stamp = stamp;
+  hist_msg.array.layout = sparse_hist_layout_;
+  hist_msg.array.layout.dim[0].size = active_sample_indices_.size();
+  hist_msg.array.layout.dim[0].stride = active_sample_indices_.size()*2;
+  hist_msg.array.data.resize(2 + active_sample_indices_.size()*2);
+  hist_msg.array.data[0] = -1;
+  hist_msg.array.data[1] = inactive_weight_;
+  for(int k = 0 ; k < active_sample_indices_.size() ; ++k)
+  {
+    int idx = active_sample_indices_[k];
+    hist_msg.array.data[2+2*k] = idx;
+    hist_msg.array.data[3+2*k] = weights[idx];
+  }
+  sparse_histograms_pub_.publish(hist_msg);
+}
 
-  vector<double> ang_arr;
-  for(int aidx = 0; aidx < size_a_;++aidx)
-    ang_arr.push_back(IDX2ANG(aidx,ares_));
-  int nb_threads_hint = std::thread::hardware_concurrency();
-  int nb_threads = (nb_threads_hint == 0u ? 8u : nb_threads_hint);
-  //local variables
-  double delta_rot1, delta_trans, delta_rot2;
-  double radius;
-  int matsize;
-  boost::shared_ptr<Matrix> X, Y;
-  
-  //update translation and rotations
+//translation and rotations of the odometry motion model
+void MarkovNode::motionDelta(amcl::AMCLOdomData* ndata, double& delta_rot1, double& delta_trans, double& delta_rot2)
+{
   if(sqrt(ndata->delta.v[1]*ndata->delta.v[1] + 
           ndata->delta.v[0]*ndata->delta.v[0]) < 0.01)
     delta_rot1 = 0.0;
@@ -253,6 +450,32 @@ double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
   delta_trans = sqrt(ndata->delta.v[0]*ndata->delta.v[0] +
                      ndata->delta.v[1]*ndata->delta.v[1]);
   delta_rot2 = angle_diff(ndata->delta.v[2], delta_rot1);
+}
+
+//snap the motion delta onto the quantization grid and return its key
+MotionDeltaKey MarkovNode::quantizeDelta(double& delta_rot1, double& delta_trans, double& delta_rot2)
+{
+  MotionDeltaKey key;
+  key.rot1 = lround(delta_rot1/motion_delta_angular_res_);
+  key.trans = lround(delta_trans/motion_delta_linear_res_);
+  key.rot2 = lround(delta_rot2/motion_delta_angular_res_);
+  delta_rot1 = key.rot1*motion_delta_angular_res_;
+  delta_trans = key.trans*motion_delta_linear_res_;
+  delta_rot2 = key.rot2*motion_delta_angular_res_;
+  return key;
+}
+
+//build size_a_*size_a_ matrices of motionModelO over the offsets in side x side
+void MarkovNode::buildMotionMatrices(double delta_rot1, double delta_trans, double delta_rot2, std::vector<double>& side, MatMatrices& mat_prob_matrices)
+{
+  vector<double> ang_arr;
+  for(int aidx = 0; aidx < size_a_;++aidx)
+    ang_arr.push_back(IDX2ANG(aidx,ares_));
+  //local variables
+  double radius;
+  int matsize;
+  boost::shared_ptr<Matrix> X, Y;
+  
   //Definition:
   //Matrix is a matrix with size of matsize by matsize 
   //VecMatrix is size_a_ matrices 
@@ -264,7 +487,7 @@ double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
   //decide maximum and minimum of position X and Y
   //the difference from base position to each extremum is trans*(1+alpha3)
   radius = delta_trans*(1+odom_->alpha3*4);
-  vector<double> side;
+  side.clear();
   for(double p = -map_->scale; p >= -radius ; p-=map_->scale)
     side.push_back(p);
   std::reverse(std::begin(side),std::end(side));
@@ -283,17 +506,17 @@ double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
       Y->push_back(side[j]);
     }
   }
-  MatMatrices mat_prob_matrices(size_a_, VecMatrices(size_a_, Matrix()));//for storing size_a_*size_a_ matrices
-  auto worker = [&ang_arr,X,Y,&delta_rot1,&delta_trans,&delta_rot2]//these are local variables within this function
-  (aIter beg_oa, aIter end_oa, mIter beg_m, mIter end_m, amcl::AMCLOdom* odom)//these are parameters for worker and private members of this class
+  mat_prob_matrices.assign(size_a_, VecMatrices(size_a_, Matrix()));//for storing size_a_*size_a_ matrices
+  //one particle heading per row of mat_prob_matrices, split over the threads of parallelFor
+  auto worker = [&](int beg, int end)
   {
-    mIter mit = beg_m;
-    for(aIter particle_orientation_it = beg_oa ; particle_orientation_it != end_oa ; ++particle_orientation_it, ++mit)
+    for(int oaidx = beg ; oaidx < end ; ++oaidx)
     {
+      double particle_orientation = ang_arr[oaidx];
       //making the index of the matrix's angle
       for(int maidx = 0 ; maidx < ang_arr.size() ; ++maidx)
       {
-        Matrix& matrix = (*mit)[maidx];
+        Matrix& matrix = mat_prob_matrices[oaidx][maidx];
         matrix.reserve(X->size());
         double matrix_sum = 0.0;
         for(int i = 0; i < X->size();++i)
@@ -301,10 +524,10 @@ double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
           //calculate Tr, R1, R2
           double tran_hat, rot1_hat, rot2_hat;
           //TODO check odometry
-          //odometry(0.0,0.0,(*particle_orientation_it),(*X)[i],(*Y)[i],ang_arr[maidx],rot1_hat,tran_hat,rot2_hat);
-          odometry((*X)[i],(*Y)[i],ang_arr[maidx],0.0,0.0,(*particle_orientation_it),rot1_hat,tran_hat,rot2_hat);
+          //odometry(0.0,0.0,particle_orientation,(*X)[i],(*Y)[i],ang_arr[maidx],rot1_hat,tran_hat,rot2_hat);
+          odometry((*X)[i],(*Y)[i],ang_arr[maidx],0.0,0.0,particle_orientation,rot1_hat,tran_hat,rot2_hat);
           //calculate P
-          double p = motionModelO(odom, delta_rot1, delta_trans, delta_rot1, rot1_hat, tran_hat, rot2_hat);
+          double p = motionModelO(odom_, delta_rot1, delta_trans, delta_rot2, rot1_hat, tran_hat, rot2_hat);
           matrix.push_back(p);
           matrix_sum += p;
           assert(true);
@@ -313,81 +536,120 @@ double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
       }
     }
   };
-  //create threads
-  vector<std::thread> threads(nb_threads);
-  int grainsize = (int)((double)ang_arr.size()/(double)nb_threads);
-  mIter mit = std::begin(mat_prob_matrices);
-  aIter oait = std::begin(ang_arr);
-  for(auto tit = std::begin(threads); tit != std::end(threads)-1 ; ++tit)
+  parallelFor(size_a_, worker);
+}
+
+//motion matrices of the quantized delta, built only when the cache misses
+boost::shared_ptr<MotionMatrixStack> MarkovNode::motionMatrices(double delta_rot1, double delta_trans, double delta_rot2)
+{
+  MotionDeltaKey key = quantizeDelta(delta_rot1, delta_trans, delta_rot2);
+  boost::shared_ptr<MotionMatrixStack> matrices = matrix_cache_.get(key);
+  if(!matrices)
   {
-    *tit = std::thread(worker, oait, oait+grainsize, mit, mit+grainsize, odom_);
-    oait+=grainsize;
-    mit+=grainsize;
+    matrices.reset(new MotionMatrixStack());
+    buildMotionMatrices(delta_rot1, delta_trans, delta_rot2, matrices->side, matrices->matrices);
+    matrix_cache_.put(key, matrices);
   }
-  threads.back() = std::thread(worker,oait, std::end(ang_arr), mit, std::end(mat_prob_matrices), odom_);
-  //wait threads finished
-  for(auto&& thread: threads) {
-    thread.join();
+  ROS_DEBUG("motion matrix cache: %lu stacks, %lu bytes, %lu hits, %lu misses",
+            matrix_cache_.size(), matrix_cache_.bytes(), matrix_cache_.hits(), matrix_cache_.misses());
+  return matrices;
+}
+
+//matrix vertion using original motion model
+double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
+{
+  //transform those matrices wrt each origin_pose in previous_set with previous weight
+  //multipy and increment all the weights and assign to the origin_pose particle in current_set grid
+  //sum up those resulting matrices
+  //assign the summation to origin_pose in current_set
+
+  vector<double> ang_arr;
+  for(int aidx = 0; aidx < size_a_;++aidx)
+    ang_arr.push_back(IDX2ANG(aidx,ares_));
+  //local variables
+  double delta_rot1, delta_trans, delta_rot2;
+  int matsize;
+  boost::shared_ptr<Matrix> X, Y;
+  
+  //update translation and rotations
+  motionDelta(ndata, delta_rot1, delta_trans, delta_rot2);
+  boost::shared_ptr<MotionMatrixStack> matrices = motionMatrices(delta_rot1, delta_trans, delta_rot2);
+  const vector<double>& side = matrices->side;
+  MatMatrices& mat_prob_matrices = matrices->matrices;
+  matsize = side.size();
+  X.reset(new Matrix());
+  Y.reset(new Matrix());
+  X->reserve(matsize*matsize);
+  Y->reserve(matsize*matsize);
+  for(int i = 0; i < matsize;++i)
+  {
+    for(int j = 0 ; j < matsize ; ++j)
+    {
+      X->push_back(side[i]);
+      Y->push_back(side[j]);
+    }
   }
 
   //update bel(xt-1,xt,action)
   //local variables
-  pf_sample_set_t* current_set = grid_->sets + grid_->current_set;
-  pf_sample_set_t* previous_set = grid_->sets + (grid_->current_set+1)%2;
+  float* current = grid_.current();
+  const float* previous = grid_.previous();
   double total_weight = 0;
   int sample_counter = 0;
   int matrix_size = X->size();
   std::mutex worker2_mutex;
+  int total_sample = active_sample_indices_.size();
+  int percent_count = total_sample * 0.01;
+  if(percent_count <=0)
+    percent_count = 1;
   /*common non-mutable input:
-  current_set
-  previous_set
+  previous
   matrix_size
   X
   Y
   ang_arr
   mat_prob_matrices
   size_a_
-  ares_
   map_
-  mapidx2freeidx_
+  grid_
   */
 
   /*common mutable input:
+  current at the active indices
   total_weight
   sample_counter
   std::mutex worker2_mutex;
   */
-  /*parameters: iterators of active_sample_indices_
-  vector<int>::iterator beg
-  vector<int>::iterator end
+  /*parameters: range of active_sample_indices_
   */
-  int percent_count;
-  auto worker2 = [&worker2_mutex, current_set, previous_set, matrix_size, X, Y, &mat_prob_matrices, &ang_arr, &percent_count]
-  (double& total_weight, int& sample_counter, int const total_sample, vector<int>::iterator active_sample_beg, vector<int>::iterator active_sample_end, int const size_a_, map_t const * map_, vector<vector<int> >& mapidx2freeidx_, int const ares_)
+  auto worker2 = [&, this](int beg, int end)
   {
+    vector<int> free_ngb_indices, local_ngb_indices;
+    //create neighbor index lists, one for free_space, one for local
+    free_ngb_indices.reserve(matrix_size);
+    local_ngb_indices.reserve(matrix_size);
     //for each active particle
-    for(auto iter = active_sample_beg; iter != active_sample_end; ++iter)
+    for(int k = beg; k < end; ++k)
     {
-      vector<int> free_ngb_indices, local_ngb_indices;
-      //create neighbor index lists, one for free_space, one for local
-      free_ngb_indices.reserve(matrix_size);
-      local_ngb_indices.reserve(matrix_size);
-      pf_sample_t* current_origin_particle = current_set->samples + (*iter);
+      int origin_idx = active_sample_indices_[k];
+      pf_vector_t origin_pose = grid_.pose(origin_idx);
+      free_ngb_indices.clear();
+      local_ngb_indices.clear();
       //find valid neighbors of origin_particle
       for(int nidx = 0; nidx < matrix_size; ++nidx)
       {
         //get translated positions based on each pair in X and Y
-        int ngb_map_idx_x = MAP_GXWX(map_,current_origin_particle->pose.v[0]+(*X)[nidx]);
-        int ngb_map_idx_y = MAP_GYWY(map_,current_origin_particle->pose.v[1]+(*Y)[nidx]);
-        //check if ngb_map_idx is valid
-        if(MAP_VALID(map_,ngb_map_idx_x,ngb_map_idx_y)==false || (map_->cells[MAP_INDEX(map_,ngb_map_idx_x,ngb_map_idx_y)].occ_state != -1))
+        int ngb_map_idx_x = MAP_GXWX(map_,origin_pose.v[0]+(*X)[nidx]);
+        int ngb_map_idx_y = MAP_GYWY(map_,origin_pose.v[1]+(*Y)[nidx]);
+        //only free cells on the map are part of the grid
+        int ngb_free_idx = grid_.freeIndex(ngb_map_idx_x, ngb_map_idx_y);
+        if(ngb_free_idx < 0)
           continue;
         //save indices of valid neighbors
-        free_ngb_indices.push_back(mapidx2freeidx_[ngb_map_idx_x][ngb_map_idx_y]);
+        free_ngb_indices.push_back(ngb_free_idx);
         local_ngb_indices.push_back(nidx);
-        assert(true);
       }
-      VecMatrices& vec_prob_matrices = mat_prob_matrices[ANG2IDX(current_origin_particle->pose.v[2], ares_)];
+      VecMatrices& vec_prob_matrices = mat_prob_matrices[grid_.headingIdx(origin_idx)];
       assert(free_ngb_indices.size()>0);
       double accumulative_weight = 0.0;
       for(int maidx = 0; maidx < ang_arr.size(); ++maidx)
@@ -396,15 +658,12 @@ double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
         for(int idx = 0 ; idx < free_ngb_indices.size(); ++idx)
         {
           int sample_ngb_idx = free_ngb_indices[idx]*size_a_ + maidx;
-          pf_sample_t* previous_particle = previous_set->samples + sample_ngb_idx;
-          int local_ngb_idx = local_ngb_indices[idx];
-          assert(previous_particle->weight != 0.0);
-          accumulative_weight += previous_particle->weight * motion_prob_mat[local_ngb_idx];
-          assert(true);
+          assert(previous[sample_ngb_idx] != 0.0);
+          accumulative_weight += previous[sample_ngb_idx] * motion_prob_mat[local_ngb_indices[idx]];
         }
       }
       assert(accumulative_weight != 0.0);
-      current_origin_particle->weight = accumulative_weight;
+      current[origin_idx] = accumulative_weight;
       std::lock_guard<std::mutex> lg(worker2_mutex);
       total_weight += accumulative_weight;
       ++sample_counter;
@@ -415,124 +674,232 @@ double MarkovNode::UpdateOdomO(amcl::AMCLOdomData* ndata)
     }
   };
 
-  //create threads
-  //join threads
-  vector<std::thread> threads2(nb_threads);
-  vector<int>::iterator sit = std::begin(active_sample_indices_);
-  grainsize = (int)((double)active_sample_indices_.size()/(double)nb_threads);
-  int total_sample = active_sample_indices_.size();
-  percent_count = total_sample * 0.01;
-  if(percent_count <=0)
-    percent_count = 1;
   ROS_INFO("percent_count of total_sample: %d of %d", percent_count, total_sample);
-  for(auto tit = std::begin(threads2); tit != std::end(threads2)-1 ; ++tit)
-  {
-    *tit = std::thread(worker2, std::ref(total_weight), std::ref(sample_counter), total_sample, sit, sit+grainsize, size_a_, map_, std::ref(mapidx2freeidx_), ares_);
-    sit+=grainsize;
-  }
-  threads2.back() = std::thread(worker2, std::ref(total_weight), std::ref(sample_counter), total_sample, sit, std::end(active_sample_indices_), size_a_, map_, std::ref(mapidx2freeidx_), ares_);
-  //wait threads finished
-  for(auto&& thread: threads2) {
-    thread.join();
-  }
+  parallelFor(total_sample, worker2);
 
   ROS_INFO("total weight: %f", total_weight);
-  //delete X;
-  //delete Y;
   return total_weight;
 }
 
-int MarkovNode::downsizingSampling(pf_sample_set_t* set_a, pf_sample_set_t* set_b, int target_size)
+//separable approximation of every heading pair of the motion matrices
+boost::shared_ptr<MotionKernelStack> MarkovNode::buildKernelStack(double delta_rot1, double delta_trans, double delta_rot2)
 {
-  pf_sample_t *sample_a, *sample_b;
-  double r,c,U;
-  int m, i;
-  double count_inv, total;
-  
-  count_inv = 1.0/target_size;
-  total = 0;
-  r = MCL<void>::rng_.uniform01() * count_inv;
-  c = set_a->samples[0].weight;
-  i = 0;
-  m = 0;
-  set_b->sample_count = 0;
-  while(set_b->sample_count < target_size)
+  vector<double> side;
+  MatMatrices mat_prob_matrices;
+  buildMotionMatrices(delta_rot1, delta_trans, delta_rot2, side, mat_prob_matrices);
+  boost::shared_ptr<MotionKernelStack> stack(new MotionKernelStack());
+  stack->matsize = side.size();
+  stack->size_a = size_a_;
+  stack->center = 0;
+  for(int i = 0 ; i < side.size() ; ++i)
+    if(fabs(side[i]) < fabs(side[stack->center]))
+      stack->center = i;
+  stack->kernels.resize(size_a_*size_a_);
+  //heading pairs far apart carry no mass at all, they are skipped by rank 0
+  double max_p = 0.0;
+  for(auto&& vec_matrices : mat_prob_matrices)
+    for(auto&& matrix : vec_matrices)
+      for(auto p : matrix)
+        max_p = std::max(max_p, p);
+  auto worker = [this, &mat_prob_matrices, &stack, max_p](int beg_a, int end_a)
   {
-    sample_b = set_b->samples + set_b->sample_count++;
-    U = r + m * count_inv;
-    while(U>c)
+    for(int a = beg_a ; a < end_a ; ++a)
     {
-      i++;
-      if(i >= set_a->sample_count)
+      for(int previous_a = 0 ; previous_a < size_a_ ; ++previous_a)
       {
-        c = set_a->samples[0].weight;
-        i = 0;
-        m = 0;
-        U = r + m * count_inv;
-        continue;
+        const Matrix& matrix = mat_prob_matrices[a][previous_a];
+        SeparableKernel& kernel = stack->kernels[a*size_a_ + previous_a];
+        if(*std::max_element(matrix.begin(), matrix.end()) <= max_p*1e-9)
+          continue;
+        separableApproximation(matrix, stack->matsize, motion_kernel_rank_, 1e-4, kernel);
       }
-      c += set_a->samples[i].weight;
     }
-    m++;
-    sample_b->pose = set_a->samples[i].pose;
-    sample_b->weight = 1.0;
-    total += sample_b->weight;
-    // Add sample to histogram
-    pf_kdtree_insert(set_b->kdtree, sample_b->pose, sample_b->weight);
+  };
+  parallelFor(size_a_, worker);
+  ROS_DEBUG("built motion kernels of size %d for delta (%f, %f, %f), %lu bytes", stack->matsize, delta_rot1, delta_trans, delta_rot2, stack->bytes());
+  return stack;
+}
+
+//convolution version of UpdateOdomO
+//the previous belief is laid out as a dense x-y slice per heading over the bounding box of active cells,
+//then each separable kernel is applied as a pass along y followed by a pass along x at the active cells
+double MarkovNode::UpdateOdomC(amcl::AMCLOdomData* ndata)
+{
+  double delta_rot1, delta_trans, delta_rot2;
+  motionDelta(ndata, delta_rot1, delta_trans, delta_rot2);
+  MotionDeltaKey key = quantizeDelta(delta_rot1, delta_trans, delta_rot2);
+  boost::shared_ptr<MotionKernelStack> kernel_stack = kernel_cache_.get(key);
+  if(!kernel_stack)
+  {
+    kernel_stack = buildKernelStack(delta_rot1, delta_trans, delta_rot2);
+    kernel_cache_.put(key, kernel_stack);
   }
-  // Normalize weights
-  for (i = 0; i < set_b->sample_count; i++)
+  ROS_DEBUG("motion kernel cache: %lu stacks, %lu bytes, %lu hits, %lu misses",
+            kernel_cache_.size(), kernel_cache_.bytes(), kernel_cache_.hits(), kernel_cache_.misses());
+  const MotionKernelStack& stack = *kernel_stack;
+  const int matsize = stack.matsize;
+  const int center = stack.center;
+  float* current = grid_.current();
+  const float* previous = grid_.previous();
+
+  //bounding box of active cells grown by the kernel support
+  int min_x = map_->size_x, min_y = map_->size_y, max_x = -1, max_y = -1;
+  vector<vector<int> > heading_samples(size_a_);
+  for(auto idx : active_sample_indices_)
   {
-    sample_b = set_b->samples + i;
-    sample_b->weight /= total;
+    int free_idx = grid_.freeIdx(idx);
+    min_x = std::min(min_x, grid_.cellX(free_idx));
+    max_x = std::max(max_x, grid_.cellX(free_idx));
+    min_y = std::min(min_y, grid_.cellY(free_idx));
+    max_y = std::max(max_y, grid_.cellY(free_idx));
+    heading_samples[grid_.headingIdx(idx)].push_back(idx);
+  }
+  if(max_x < 0)
+    return 0.0;
+  min_x = std::max(0, min_x - center);
+  min_y = std::max(0, min_y - center);
+  max_x = std::min(map_->size_x-1, max_x + matsize-1-center);
+  max_y = std::min(map_->size_y-1, max_y + matsize-1-center);
+  const int width = max_x - min_x + 1;
+  const int height = max_y - min_y + 1;
+
+  //occupied and unknown cells stay zero as they are skipped in UpdateOdomO
+  slices_.assign((size_t)size_a_*width*height, 0.0f);
+  for(int y = min_y ; y <= max_y ; ++y)
+  {
+    for(int x = min_x ; x <= max_x ; ++x)
+    {
+      int free_idx = grid_.freeIndex(x, y);
+      if(free_idx < 0)
+        continue;
+      for(int previous_a = 0 ; previous_a < size_a_ ; ++previous_a)
+        slices_[((size_t)previous_a*height + (y-min_y))*width + (x-min_x)] = previous[free_idx*size_a_ + previous_a];
+    }
   }
-  // Re-compute cluster statistics
-  pf_cluster_stats(NULL, set_b);
+
+  double total_weight = 0.0;
+  std::mutex worker_mutex;
+  auto worker = [&, this](int beg_a, int end_a)
+  {
+    vector<int> row_slot(height, -1);
+    vector<int> rows;
+    vector<float> tmp;
+    vector<double> acc;
+    double local_weight = 0.0;
+    for(int a = beg_a ; a < end_a ; ++a)
+    {
+      const vector<int>& samples = heading_samples[a];
+      if(samples.empty())
+        continue;
+      //only the rows holding active cells of this heading are needed after the pass along y
+      rows.clear();
+      for(auto idx : samples)
+      {
+        int y = grid_.cellY(grid_.freeIdx(idx)) - min_y;
+        if(row_slot[y] < 0)
+        {
+          row_slot[y] = rows.size();
+          rows.push_back(y);
+        }
+      }
+      tmp.resize(rows.size()*width);
+      acc.assign(samples.size(), 0.0);
+      for(int previous_a = 0 ; previous_a < size_a_ ; ++previous_a)
+      {
+        const SeparableKernel& kernel = stack.at(a, previous_a);
+        const float* slice = &slices_[(size_t)previous_a*height*width];
+        for(int r = 0 ; r < kernel.rank ; ++r)
+        {
+          const float* u = &kernel.u[r*matsize];
+          const float* v = &kernel.v[r*matsize];
+          std::fill(tmp.begin(), tmp.end(), 0.0f);
+          for(int slot = 0 ; slot < rows.size() ; ++slot)
+          {
+            float* trow = &tmp[slot*width];
+            for(int j = 0 ; j < matsize ; ++j)
+            {
+              int y = rows[slot] + j - center;
+              if(y < 0 || y >= height)
+                continue;
+              const float* srow = slice + (size_t)y*width;
+              const float vj = v[j];
+              for(int x = 0 ; x < width ; ++x)
+                trow[x] += vj*srow[x];
+            }
+          }
+          for(int k = 0 ; k < samples.size() ; ++k)
+          {
+            int free_idx = grid_.freeIdx(samples[k]);
+            const float* trow = &tmp[row_slot[grid_.cellY(free_idx) - min_y]*width];
+            int x0 = grid_.cellX(free_idx) - min_x - center;
+            double sum = 0.0;
+            for(int i = std::max(0, -x0) ; i < matsize && x0 + i < width ; ++i)
+              sum += u[i]*trow[x0 + i];
+            acc[k] += sum;
+          }
+        }
+      }
+      for(auto y : rows)
+        row_slot[y] = -1;
+      for(int k = 0 ; k < samples.size() ; ++k)
+      {
+        //the low rank approximation may undershoot where the true kernel vanishes
+        double weight = acc[k] > epson_ ? acc[k] : epson_;
+        current[samples[k]] = weight;
+        local_weight += weight;
+      }
+    }
+    std::lock_guard<std::mutex> lg(worker_mutex);
+    total_weight += local_weight;
+  };
+  parallelFor(size_a_, worker);
+  ROS_DEBUG("total weight: %f", total_weight);
+  return total_weight;
 }
 
-void MarkovNode::initialMarkovGrid()
+int MarkovNode::downsizingSampling(pf_sample_set_t* set_b, int target_size, const std::vector<int>* indices)
 {
-  //make a matrix for converting positions to indices of free_space_indices
-  int map_x,map_y;
-  for(int i = 0 ; i < free_space_indices.size(); ++i)
+  pf_sample_t *sample_b;
+  //either every sample of the current grid set or only the listed ones are drawn from,
+  //the listed samples do not necessarily sum up to one
+  if(indices && indices->empty())
+    indices = NULL;
+  const float* weights = grid_.current();
+  int count = indices ? indices->size() : grid_.size();
+  auto at = [indices](int k) -> int { return indices ? (*indices)[k] : k; };
+  std::vector<double> c(count+1);
+  parallelPrefixSum(count, [&](int k) { return (double)weights[at(k)]; }, c.data());
+  std::vector<int> parents(target_size);
+  RandomStreams::Scope scope(random_, RandomStreams::RESAMPLE);
+  pf_resample_draw(c.data(), count, target_size, resample_scheme_, parents.data());
+  if(resample_kld_)
   {
-    map_x = free_space_indices[i].first;
-    map_y = free_space_indices[i].second;
-    assert(map_x >=0);
-    assert(map_y >=0);
-    mapidx2freeidx_[map_x][map_y] = i;
+    std::vector<pf_vector_t> poses(target_size);
+    for(int m = 0 ; m < target_size ; ++m)
+      poses[m] = grid_.pose(at(parents[m]));
+    target_size = pf_resample_kld_select(pf_, set_b->kdtree, poses.data(), parents.data(), target_size);
   }
-  //initialize particle grid
-  
-  grid_ = new pf_t;
-  grid_->max_samples = max_particles_;
-  grid_->min_samples = 0;
-  grid_->pop_err = 0.0;
-  grid_->pop_z = 0;
-  grid_->dist_threshold = 0.0; 
-  grid_->w_slow = 0.0;
-  grid_->w_fast = 0.0;
-  grid_->alpha_slow = 0.0;
-  grid_->alpha_fast = 0.0;
-  grid_->converged = 0; 
-  
-  grid_->current_set = 0;
-  pf_sample_set_t *set;
-  for(int s = 0 ; s < 2 ; ++s)
+  set_b->sample_count = target_size;
+  for(int m = 0 ; m < target_size ; ++m)
   {
-    set = grid_->sets + s;
-    set->sample_count = max_particles_;
-    set->samples = new pf_sample_t[max_particles_];
-    set->kdtree = NULL;
-    set->cluster_count = 0;
-    set->cluster_max_count = max_particles_;
-    set->clusters = NULL;
-    set->mean = pf_vector_zero();
-    set->cov = pf_matrix_zero();
-    set->converged = 0; 
+    sample_b = set_b->samples + m;
+    sample_b->pose = grid_.pose(at(parents[m]));
+    sample_b->weight = 1.0/target_size;
   }
+  // Re-compute histogram and cluster statistics
+  pf_cluster_stats_parallel(set_b);
+  return set_b->sample_count;
+}
+
+void MarkovNode::initialMarkovGrid()
+{
+  //initialize particle grid
+  //a uniform floor keeps every cell inactive until the first scan arrives
+  grid_.init(free_space_, size_a_, ares_,
+             sparse_belief_ ? inactive_weight_ : 1.0 / max_particles_);
+  ROS_INFO("Markov grid of %d samples takes %lu bytes", grid_.size(), grid_.bytes());
   //setting message metadata
-  int free_space_no = free_space_indices.size();
+  int free_space_no = grid_.freeCount();
   free_idcs_msg_.layout.dim.resize(2);
   free_idcs_msg_.layout.dim[0].label = "positional";
   free_idcs_msg_.layout.dim[0].size = free_space_no;
@@ -556,49 +923,46 @@ void MarkovNode::initialMarkovGrid()
   hist_layout_.dim[1].label = "angular";
   hist_layout_.dim[1].size = size_a_;
   hist_layout_.dim[1].stride = size_a_;
-  
-  int sidx = 0;
-  pf_sample_t *sample;
-  for(int free_idx = 0; free_idx < free_space_indices.size(); ++free_idx)
+  sparse_hist_layout_.dim.resize(2);
+  sparse_hist_layout_.dim[0].label = "active";
+  sparse_hist_layout_.dim[1].label = "indexweight";
+  sparse_hist_layout_.dim[1].size = 2;
+  sparse_hist_layout_.dim[1].stride = 2;
+  sparse_hist_layout_.data_offset = 2;
+  if(hierarchical_levels_ > 0)
   {
-    double position_x = MAP_WXGX(map_, free_space_indices[free_idx].first);
-    double position_y = MAP_WYGY(map_, free_space_indices[free_idx].second);
-    int map_idx_x = MAP_GXWX(map_,position_x);
-    int map_idx_y = MAP_GYWY(map_,position_y);
-    free_idcs_msg_.data[free_idx * 2] = free_space_indices[free_idx].first;
-    free_idcs_msg_.data[free_idx*2+1] = free_space_indices[free_idx].second;
-    positions_msg_.data[free_idx * 2] = position_x;
-    positions_msg_.data[free_idx*2+1] = position_y;
-
-    int free_space_idx = mapidx2freeidx_[map_idx_x][map_idx_y];
-    assert(free_space_idx == free_idx);
-    for(int a = 0 ; a < size_a_;++a)
+    likelihood_pyramid_.init(map_);
+    belief_pyramid_.resize(hierarchical_levels_+1);
+    size_t belief_bytes = 0;
+    for(int level = 1 ; level <= hierarchical_levels_ ; ++level)
     {
-      double ang = IDX2ANG(a, ares_);;
-      assert((free_space_idx * size_a_ + ANG2IDX(ang, ares_)) == sidx);
-      for(int s = 0 ; s < 2 ; ++s)
-      {
-        sample = grid_->sets[s].samples + sidx;
-        sample->pose.v[0] = position_x;
-        sample->pose.v[1] = position_y;
-        sample->pose.v[2] = ang;
-        sample->weight = 1.0 / max_particles_;
-      }
-      ++sidx;
+      belief_pyramid_[level].assign((size_t)levelSize(map_->size_x, level)*levelSize(map_->size_y, level)*levelSize(size_a_, level), 0.0f);
+      belief_bytes += belief_pyramid_[level].capacity()*sizeof(float);
     }
+    ROS_INFO("hierarchical update over %d levels, likelihood pyramid takes %lu bytes, belief pyramid %lu bytes",
+             hierarchical_levels_, likelihood_pyramid_.bytes(), belief_bytes);
+  }
+  if(sparse_belief_)
+  {
+    band_mask_.assign(max_particles_, 0);
+    cell_mask_.assign(free_space_no, 0);
+    band_indices_.reserve(max_particles_);
+  }
+  
+  for(int free_idx = 0; free_idx < free_space_no; ++free_idx)
+  {
+    free_idcs_msg_.data[free_idx * 2] = grid_.cellX(free_idx);
+    free_idcs_msg_.data[free_idx*2+1] = grid_.cellY(free_idx);
+    positions_msg_.data[free_idx * 2] = MAP_WXGX(map_, grid_.cellX(free_idx));
+    positions_msg_.data[free_idx*2+1] = MAP_WYGY(map_, grid_.cellY(free_idx));
   }
 }
 
 MarkovNode::~MarkovNode(){
   ROS_DEBUG("MarkovNode::~MarkovNode()");
   delete laser_scan_filter_;
-  delete[] grid_->sets[0].samples;
-  delete[] grid_->sets[1].samples;
-  delete grid_;
 }
-MarkovNode::MarkovNode(): MCL(),
-  grid_(NULL),
-  mapidx2freeidx_(map_->size_x,std::vector<int>(map_->size_y, -1))
+MarkovNode::MarkovNode(const std::string& ns): MCL(ns)
 {
   boost::recursive_mutex::scoped_lock lr(configuration_mutex_);
   ROS_DEBUG("MarkovNode::MarkovNode() is allocating laser_scan_filter_.");
@@ -608,15 +972,43 @@ MarkovNode::MarkovNode(): MCL(),
   private_nh_.param("angular_resolution", ares_, 5);//the unit is degree
   private_nh_.param("cloud_size", cloud_size_, 10000);
   private_nh_.param("odom_update_radius", radius_, 3.0);
+  private_nh_.param("sparse_belief", sparse_belief_, false);
+  private_nh_.param("sparse_dilation", sparse_dilation_, 2);//the unit is map cell
+  private_nh_.param("motion_update_type", motion_update_type_, std::string("direct"));
+  private_nh_.param("hierarchical_levels", hierarchical_levels_, 0);//0 evaluates the whole grid
+  private_nh_.param("hierarchical_threshold", hierarchical_threshold_, 10.0);//the unit is log likelihood
+  private_nh_.param("motion_kernel_rank", motion_kernel_rank_, 3);
+  private_nh_.param("motion_delta_linear_res", motion_delta_linear_res_, 0.01);
+  private_nh_.param("motion_delta_angular_res", motion_delta_angular_res_, 0.5);//the unit is degree
+  motion_delta_angular_res_ *= M_PI/180.0;
+  int motion_cache_size;
+  private_nh_.param("motion_cache_size", motion_cache_size, 512);//the unit is MB
+  if(hierarchical_levels_ < 0)
+    hierarchical_levels_ = 0;
+  if(hierarchical_levels_ > 0 && sparse_belief_)
+  {
+    ROS_WARN("hierarchical_levels is ignored when sparse_belief is enabled");
+    hierarchical_levels_ = 0;
+  }
+  if(motion_update_type_ != "direct" && motion_update_type_ != "separable")
+  {
+    ROS_WARN("Unknown motion_update_type \"%s\"; defaulting to direct", motion_update_type_.c_str());
+    motion_update_type_ = "direct";
+  }
+  //one budget, held by the cache of the configured motion update, the other one is never filled
+  size_t motion_cache_bytes = (size_t)std::max(0, motion_cache_size) << 20;
+  matrix_cache_.setMaxBytes(motion_update_type_ == "direct" ? motion_cache_bytes : 0);
+  kernel_cache_.setMaxBytes(motion_update_type_ == "separable" ? motion_cache_bytes : 0);
   size_a_ = (int)(360.0/ares_);
-  max_particles_ = free_space_indices.size() * size_a_;
-  epson_ = 1.0/max_particles_/1024;
-  active_sample_indices_.reserve(max_particles_);
-  pf_free( pf_ );
-  pf_ = pf_alloc(min_particles_, cloud_size_,//for sampling from grid_
-                 alpha_slow_, alpha_fast_,
-                 (pf_init_model_fn_t)MCL::uniformPoseGenerator,
-                 (void *)map_);
+  //the grid is downsized into the cloud by one of the ordered schemes, MCL only knows functions of pf_t
+  std::string tmp_resample_type;
+  private_nh_.param("resample_type", tmp_resample_type, std::string("lowvariance"));
+  if(!pf_resample_scheme_by_name(tmp_resample_type, &resample_scheme_, &resample_kld_))
+  {
+    resample_scheme_ = PF_RESAMPLE_SYSTEMATIC;
+    resample_kld_ = false;
+    ROS_INFO("Resample type: lowvariance instead of %s", tmp_resample_type.c_str());
+  }
   this->laser_scan_filter_ = 
     new tf::MessageFilter<sensor_msgs::LaserScan>(
               *laser_scan_sub_, 
@@ -629,9 +1021,12 @@ MarkovNode::MarkovNode(): MCL(),
               this, _1));
 
   //setting up publishers
-  histograms_pub_ = private_nh_.advertise<stamped_std_msgs::StampedFloat64MultiArray>("/histograms",1);
-  positions_pub_ = private_nh_.advertise<std_msgs::Float64MultiArray>("/positions",1);
-  indices_pub_ = private_nh_.advertise<std_msgs::UInt16MultiArray>("/indices",1);
+  //relative to the namespace of the filter like particlecloud, a sweep run keeps its own
+  histograms_pub_ = nh_.advertise<stamped_std_msgs::StampedFloat64MultiArray>("histograms",1);
+  positions_pub_ = nh_.advertise<std_msgs::Float64MultiArray>("positions",1);
+  indices_pub_ = nh_.advertise<std_msgs::UInt16MultiArray>("indices",1);
+  if(sparse_belief_)
+    sparse_histograms_pub_ = nh_.advertise<stamped_std_msgs::StampedFloat64MultiArray>("sparse_histograms",1);
 
   ROS_DEBUG("MarkovNode::MarkovNode() has successfully reset laser_scan_filter_.");
   //disable global localization
@@ -640,367 +1035,126 @@ MarkovNode::MarkovNode(): MCL(),
   //disable laser received check
   check_laser_timer_.stop();
   ROS_INFO("Successfully shut down global localization service and laser timer");
+  //the map may have been handled by MCL::MCL already, otherwise the grid waits for it
+  mapStage();
+  map_stage_ready_ = true;
+}
+
+void MarkovNode::mapStage()
+{
+  if(map_ == NULL)
+    return;
+  max_particles_ = free_space_.size() * size_a_;
+  //rounded to float so that floored grid weights compare equal to it
+  epson_ = (float)(1.0/max_particles_/1024);
+  inactive_weight_ = epson_;
+  prior_scale_ = 1.0;
+  //cached motion kernels index the free cells of the previous map
+  matrix_cache_.clear();
+  kernel_cache_.clear();
+  active_sample_indices_.clear();
+  active_sample_indices_.reserve(max_particles_);
+  pf_free( pf_ );
+  pf_ = pf_alloc(min_particles_, cloud_size_,//for sampling from grid_
+                 alpha_slow_, alpha_fast_,
+                 (pf_init_model_fn_t)MCL::uniformPoseGenerator,
+                 (void *)&free_space_);
+  pf_->pop_err = pf_err_;
+  pf_->pop_z = pf_z_;
   //initial particle grid
   initialMarkovGrid();
 }
 
-void
-MarkovNode::laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan)
+void MarkovNode::initialStage()
 {
-  if( map_ == NULL ) {
-    return;
-  }
-  boost::recursive_mutex::scoped_lock lr(configuration_mutex_);
-  int laser_index = -1;
+  grid_.flip();
+}
 
-  // Do we have the base->base_laser Tx yet?
-  if(frame_to_laser_.find(laser_scan->header.frame_id) == frame_to_laser_.end())
+void MarkovNode::motionStage(amcl::AMCLOdomData& odata)
+{
+  //requires grid_ current set and previous set
+  ros::Time beg_odom = ros::Time::now();
+  ROS_DEBUG("begin original odometry update. current_set:%d\n",grid_.currentSet());
+  double totalweight = 1.0;
+  if(motion_update_flag_)
   {
-    ROS_DEBUG("Setting up laser %d (frame_id=%s)\n", (int)frame_to_laser_.size(), laser_scan->header.frame_id.c_str());
-    lasers_.push_back(new amcl::AMCLLaser(*laser_));
-    lasers_update_.push_back(true);
-    laser_index = frame_to_laser_.size();
-
-    tf::Stamped<tf::Pose> ident (tf::Transform(tf::createIdentityQuaternion(),
-                                             tf::Vector3(0,0,0)),
-                                 ros::Time(), laser_scan->header.frame_id);
-    tf::Stamped<tf::Pose> laser_pose;
-    try
-    {
-      this->tf_->transformPose(base_frame_id_, ident, laser_pose);
-    }
-    catch(tf::TransformException& e)
-    {
-      ROS_ERROR("Couldn't transform from %s to %s, "
-                "even though the message notifier is in use",
-                laser_scan->header.frame_id.c_str(),
-                base_frame_id_.c_str());
-      return;
-    }
-
-    pf_vector_t laser_pose_v;
-    laser_pose_v.v[0] = laser_pose.getOrigin().x();
-    laser_pose_v.v[1] = laser_pose.getOrigin().y();
-    // laser mounting angle gets computed later -> set to 0 here!
-    laser_pose_v.v[2] = 0;
-    lasers_[laser_index]->SetLaserPose(laser_pose_v);
-    ROS_DEBUG("Received laser's pose wrt robot: %.3f %.3f %.3f",
-              laser_pose_v.v[0],
-              laser_pose_v.v[1],
-              laser_pose_v.v[2]);
-
-    frame_to_laser_[laser_scan->header.frame_id] = laser_index;
-  } else {
-    // we have the laser pose, retrieve laser index
-    laser_index = frame_to_laser_[laser_scan->header.frame_id];
-    //ROS_DEBUG("Received laser's pose wrt robot: %.3f %.3f %.3f",
-    //          lasers_[laser_index]->laser_pose.v[0],
-    //          lasers_[laser_index]->laser_pose.v[1],
-    //          lasers_[laser_index]->laser_pose.v[2]);
+    if(motion_update_type_ == "separable")
+      totalweight = UpdateOdomC(&odata);
+    else
+      totalweight = UpdateOdomO(&odata);
   }
-
-  // Where was the robot when this scan was taken?
-  pf_vector_t pose;
-  if(!MCL::getOdomPose(latest_odom_pose_, pose.v[0], pose.v[1], pose.v[2],
-                  laser_scan->header.stamp, base_frame_id_))
+  ROS_DEBUG("finished original odometry update. It takes %f\n", (ros::Time::now() - beg_odom).toSec());
+  //normalization of weight
+  if(sparse_belief_)
   {
-    ROS_ERROR("Couldn't determine robot's pose associated with laser scan");
-    return;
+    //only active samples were moved, the rest stays at the floor
+    float* current = grid_.current();
+    if(motion_update_flag_)
+      for(auto idx : active_sample_indices_)
+        current[idx] /= totalweight;
   }
-
-  pf_vector_t delta = pf_vector_zero();
-
-  if(pf_init_)
+  else
   {
-    // Compute change in pose
-    //delta = pf_vector_coord_sub(pose, pf_odom_pose_);
-    delta.v[0] = pose.v[0] - pf_odom_pose_.v[0];
-    delta.v[1] = pose.v[1] - pf_odom_pose_.v[1];
-    delta.v[2] = angle_diff(pose.v[2], pf_odom_pose_.v[2]);
-
-    // See if we should update the filter
-    bool update = fabs(delta.v[0]) > d_thresh_ ||
-                  fabs(delta.v[1]) > d_thresh_ ||
-                  fabs(delta.v[2]) > a_thresh_;
-    update = update || m_force_update;
-    m_force_update=false;
-
-    // Set the laser update flags
-    if(update)
-      for(unsigned int i=0; i < lasers_update_.size(); i++)
-        lasers_update_[i] = true;
+    //the laser update below always follows and folds the normalization into its log prior
+    prior_scale_ = 1.0/totalweight;
   }
+}
 
-  bool force_publication = false;
-  if(!pf_init_)
-  {
-    // Pose at last filter update
-    pf_odom_pose_ = pose;
-
-    // Filter is initialized
-    pf_init_ = true;
-
-    // Should update sensor data
-    for(unsigned int i=0; i < lasers_update_.size(); i++)
-      lasers_update_[i] = true;
-
-    force_publication = true;
-
-    resample_count_ = 0;
-
-    grid_->current_set = (grid_->current_set + 1)%2;
-  }
-  // If the robot has moved, update the filter
-  else if(pf_init_ && lasers_update_[laser_index])
+void MarkovNode::sensorStage(amcl::AMCLLaserData& ldata, const ros::Time& stamp)
+{
+  //requires grid_ current set
+  ROS_DEBUG("begin laser update. current_set:%d\n",grid_.currentSet());
+  ros::Time beg_laser = ros::Time::now();
+  if(sparse_belief_)
   {
-    //printf("pose\n");
-    //pf_vector_fprintf(pose, stdout, "%.3f");
-
-    amcl::AMCLOdomData odata;
-    odata.pose = pose;
-    // HACK
-    // Modify the delta in the action data so the filter gets
-    // updated correctly
-    odata.delta = delta;
-    // Use the action data to update the filter
-    //odom_->UpdateAction(pf_, (amcl::AMCLSensorData*)&odata);
-    //requires grid_ current set and previous set
-    ros::Time beg_odom = ros::Time::now();
-    //implement UpdataSensor in MarkovNode
-    //double totalweight = odom_->UpdateSensor(grid_, (amcl::AMCLSensorData*)&odata);
-    ROS_DEBUG("begin original odometry update. current_set:%d\n",grid_->current_set);
-    double totalweight = 1.0;
-    if(motion_update_flag_)
-    {
-      totalweight = UpdateOdomO(&odata);
-    }
-    ROS_DEBUG("finished original odometry update. It takes %f\n", (ros::Time::now() - beg_odom).toSec());
-    //normalization of weight
-    pf_sample_set_t* current_set = grid_->sets+grid_->current_set;
-    double w_avg = pf_normalize_set(current_set, totalweight);
-    // Pose at last filter update
-    //this->pf_odom_pose = pose;
+    UpdateLaserSparse(&ldata);
+    ROS_DEBUG("finished sparse laser update. It takes %f\n", (ros::Time::now() - beg_laser).toSec());
+    publishSparseHistogram(stamp);
   }
-
-  bool resampled = false;
-  // If the robot has moved, update the filter
-  if(lasers_update_[laser_index])
+  else
   {
-    pf_sample_set_t* set;
-    amcl::AMCLLaserData ldata;
-    MCL::createLaserData(laser_index, ldata, laser_scan);
-    //requires grid_ current set
-    ROS_DEBUG("begin laser update. current_set:%d\n",grid_->current_set);
-    ros::Time beg_laser = ros::Time::now();
-    //TODO change this part
-    //double total = lasers_[laser_index]->UpdateSensor(grid_, (amcl::AMCLSensorData*)&ldata);
-    //double total = UpdateLaser(&ldata);
-    //update particle minimum weight before UpdateLaser
-    set = grid_->sets + grid_->current_set;
-    for(int idx=0; idx < set->sample_count;++idx)
-    {
-      if(set->samples[idx].weight < epson_ )
-        set->samples[idx].weight = epson_;
-    }
-    double total = UpdateLaserParallel(&ldata);
+    float* weights = grid_.current();
+    //the log domain update takes the prior as it is and leaves the posterior normalized
+    hierarchical_levels_ > 0 ? UpdateLaserHierarchical(&ldata) : UpdateLaserParallel(&ldata, NULL);
+    prior_scale_ = 1.0;
     ROS_DEBUG("finished laser update. It takes %f\n", (ros::Time::now() - beg_laser).toSec());
-    double w_avg = pf_normalize_set(set, total);
-    //int sample_count = set->sample_count;
     //update active_sample_indices_ and hist_msg
     active_sample_indices_.clear();
     stamped_std_msgs::StampedFloat64MultiArray hist_msg;
     hist_msg.header.frame_id = global_frame_id_;
-    hist_msg.header.stamp = laser_scan->header.stamp;
+    hist_msg.header.stamp = stamp;
     hist_msg.array.layout = hist_layout_;
-    hist_msg.array.data.resize(set->sample_count);
-    for(int idx=0; idx < set->sample_count;++idx)
+    hist_msg.array.data.resize(grid_.size());
+    for(int idx=0; idx < grid_.size();++idx)
     {
-      hist_msg.array.data[idx] = set->samples[idx].weight;
-      if(set->samples[idx].weight > epson_ )
+      hist_msg.array.data[idx] = weights[idx];
+      if(weights[idx] > epson_ )
         active_sample_indices_.push_back(idx);
       else
-        set->samples[idx].weight = epson_;
+        weights[idx] = epson_;
     }
     histograms_pub_.publish(hist_msg);
-    if(resample_count_<1)
-    {
-      positions_pub_.publish(positions_msg_);
-      indices_pub_.publish(free_idcs_msg_);
-    }
-    ROS_DEBUG("Num samples whose weight larger than %e: %ld/%d\n", epson_, active_sample_indices_.size(), max_particles_);
-    //pf_update_augmented_weight(pf_, w_avg);
-
-    lasers_update_[laser_index] = false;
-
-    pf_odom_pose_ = pose;
-
-    // Resample the particles
-    if(!(++resample_count_ % resample_interval_))
-    {
-      downsizingSampling(grid_->sets+grid_->current_set, pf_->sets+pf_->current_set, cloud_size_);
-      //resample_function_(pf_);
-      resampled = true;
-    }
-    //make current set as previous set
-    grid_->current_set = (grid_->current_set + 1)%2;
-    set = pf_->sets + pf_->current_set;
-    ROS_DEBUG("Num samples: %d\n", set->sample_count);
-
-    // Publish the resulting cloud
-    if (!m_force_update) {
-      MCL::publishParticleCloud(particlecloud_pub_, global_frame_id_, laser_scan->header.stamp, pf_);
-    }
   }
-
-  if(resampled || force_publication)
+  if(resample_count_<1)
   {
-    // Read out the current hypotheses
-    double max_weight = 0.0;
-    int max_weight_hyp = -1;
-    std::vector<amcl_hyp_t> hyps;
-    hyps.resize(pf_->sets[pf_->current_set].cluster_count);
-    for(int hyp_count = 0;
-        hyp_count < pf_->sets[pf_->current_set].cluster_count; hyp_count++)
-    {
-      double weight;
-      pf_vector_t pose_mean;
-      pf_matrix_t pose_cov;
-      if (!pf_get_cluster_stats(pf_, hyp_count, &weight, &pose_mean, &pose_cov))
-      {
-        ROS_ERROR("Couldn't get stats on cluster %d", hyp_count);
-        break;
-      }
-
-      hyps[hyp_count].weight = weight;
-      hyps[hyp_count].pf_pose_mean = pose_mean;
-      hyps[hyp_count].pf_pose_cov = pose_cov;
-
-      if(hyps[hyp_count].weight > max_weight)
-      {
-        max_weight = hyps[hyp_count].weight;
-        max_weight_hyp = hyp_count;
-      }
-    }
-
-    if(max_weight > 0.0)
-    {
-      ROS_DEBUG("Max weight pose: %.3f %.3f %.3f",
-                hyps[max_weight_hyp].pf_pose_mean.v[0],
-                hyps[max_weight_hyp].pf_pose_mean.v[1],
-                hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-      geometry_msgs::PoseWithCovarianceStamped p;
-      // Fill in the header
-      p.header.frame_id = global_frame_id_;
-      p.header.stamp = laser_scan->header.stamp;
-      // Copy in the pose
-      p.pose.pose.position.x = hyps[max_weight_hyp].pf_pose_mean.v[0];
-      p.pose.pose.position.y = hyps[max_weight_hyp].pf_pose_mean.v[1];
-      tf::quaternionTFToMsg(tf::createQuaternionFromYaw(hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                            p.pose.pose.orientation);
-      // Copy in the covariance, converting from 3-D to 6-D
-      pf_sample_set_t* set = pf_->sets + pf_->current_set;
-      for(int i=0; i<2; i++)
-      {
-        for(int j=0; j<2; j++)
-        {
-          // Report the overall filter covariance, rather than the
-          // covariance for the highest-weight cluster
-          //p.covariance[6*i+j] = hyps[max_weight_hyp].pf_pose_cov.m[i][j];
-          p.pose.covariance[6*i+j] = set->cov.m[i][j];
-        }
-      }
-      // Report the overall filter covariance, rather than the
-      // covariance for the highest-weight cluster
-      //p.covariance[6*5+5] = hyps[max_weight_hyp].pf_pose_cov.m[2][2];
-      p.pose.covariance[6*5+5] = set->cov.m[2][2];
-
-      /*
-         printf("cov:\n");
-         for(int i=0; i<6; i++)
-         {
-         for(int j=0; j<6; j++)
-         printf("%6.3f ", p.covariance[6*i+j]);
-         puts("");
-         }
-       */
-
-      pose_pub_.publish(p);
-      last_published_pose = p;
-
-      ROS_DEBUG("New pose: %6.3f %6.3f %6.3f",
-               hyps[max_weight_hyp].pf_pose_mean.v[0],
-               hyps[max_weight_hyp].pf_pose_mean.v[1],
-               hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-      // subtracting base to odom from map to base and send map to odom instead
-      tf::Stamped<tf::Pose> odom_to_map;
-      try
-      {
-        tf::Transform tmp_tf(tf::createQuaternionFromYaw(hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                             tf::Vector3(hyps[max_weight_hyp].pf_pose_mean.v[0],
-                                         hyps[max_weight_hyp].pf_pose_mean.v[1],
-                                         0.0));
-        tf::Stamped<tf::Pose> tmp_tf_stamped (tmp_tf.inverse(),
-                                              laser_scan->header.stamp,
-                                              base_frame_id_);
-        this->tf_->transformPose(odom_frame_id_,
-                                 tmp_tf_stamped,
-                                 odom_to_map);
-      }
-      catch(tf::TransformException)
-      {
-        ROS_DEBUG("Failed to subtract base to odom transform");
-        return;
-      }
-
-      latest_tf_ = tf::Transform(tf::Quaternion(odom_to_map.getRotation()),
-                                 tf::Point(odom_to_map.getOrigin()));
-      latest_tf_valid_ = true;
-
-      if (tf_broadcast_ == true)
-      {
-        // We want to send a transform that is good up until a
-        // tolerance time so that odom can be used
-        ros::Time transform_expiration = (laser_scan->header.stamp +
-                                          transform_tolerance_);
-        tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                            transform_expiration,
-                                            global_frame_id_, odom_frame_id_);
-        this->tfb_->sendTransform(tmp_tf_stamped);
-        sent_first_transform_ = true;
-      }
-    }
-    else
-    {
-      ROS_ERROR("No pose!");
-    }
+    positions_pub_.publish(positions_msg_);
+    indices_pub_.publish(free_idcs_msg_);
   }
-  else if(latest_tf_valid_)
-  {
-    if (tf_broadcast_ == true)
-    {
-      // Nothing changed, so we'll just republish the last transform, to keep
-      // everybody happy.
-      ros::Time transform_expiration = (laser_scan->header.stamp +
-                                        transform_tolerance_);
-      tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                          transform_expiration,
-                                          global_frame_id_, odom_frame_id_);
-      this->tfb_->sendTransform(tmp_tf_stamped);
-    }
+  ROS_DEBUG("Num samples whose weight larger than %e: %ld/%d\n", epson_, active_sample_indices_.size(), max_particles_);
+}
 
-    //disable save pose part
-    // Is it time to save our last pose to the param server
-    //ros::Time now = ros::Time::now();
-    //if((save_pose_period.toSec() > 0.0) &&
-    //   (now - save_pose_last_time) >= save_pose_period)
-    //{
-    //  this->savePoseToServer();
-    //  save_pose_last_time = now;
-    //}
+bool MarkovNode::resampleStage(const ros::Time& stamp, bool initial)
+{
+  bool resampled = false;
+  if(!(++resample_count_ % resample_interval_))
+  {
+    downsizingSampling(pf_->sets+pf_->current_set, cloud_size_,
+                       sparse_belief_ ? &active_sample_indices_ : NULL);
+    resampled = true;
   }
-
+  //make current set as previous set
+  grid_.flip();
+  return resampled;
 }
 
 //the version with squared translation and rotations
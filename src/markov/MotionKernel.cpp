@@ -0,0 +1,102 @@
+#include <cmath>
+#include "markov/MotionKernel.h"
+
+size_t MotionKernelStack::bytes() const
+{
+  size_t total = sizeof(MotionKernelStack) + kernels.capacity()*sizeof(SeparableKernel);
+  for(auto&& kernel : kernels)
+    total += (kernel.u.capacity() + kernel.v.capacity())*sizeof(float);
+  return total;
+}
+
+size_t MotionMatrixStack::bytes() const
+{
+  size_t total = sizeof(MotionMatrixStack) + side.capacity()*sizeof(double);
+  for(auto&& vec_matrices : matrices)
+  {
+    total += vec_matrices.capacity()*sizeof(std::vector<double>);
+    for(auto&& matrix : vec_matrices)
+      total += matrix.capacity()*sizeof(double);
+  }
+  return total;
+}
+
+//rank-by-rank power iteration with deflation,
+//motion kernels are smooth so a few iterations per term are enough
+void separableApproximation(const std::vector<double>& matrix, int matsize, int max_rank, double tolerance, SeparableKernel& kernel)
+{
+  const int iterations = 12;
+  std::vector<double> residual(matrix);
+  std::vector<double> u(matsize), v(matsize);
+  kernel.rank = 0;
+  kernel.u.clear();
+  kernel.v.clear();
+  double first_sigma = 0.0;
+  for(int r = 0 ; r < max_rank ; ++r)
+  {
+    //start from the column sums, which are close to the dominant right singular vector
+    for(int j = 0 ; j < matsize ; ++j)
+      v[j] = 0.0;
+    for(int i = 0 ; i < matsize ; ++i)
+      for(int j = 0 ; j < matsize ; ++j)
+        v[j] += residual[i*matsize+j];
+    double norm = 0.0;
+    for(int j = 0 ; j < matsize ; ++j)
+      norm += v[j]*v[j];
+    if(norm == 0.0)
+    {
+      for(int j = 0 ; j < matsize ; ++j)
+        v[j] = 1.0;
+      norm = matsize;
+    }
+    norm = sqrt(norm);
+    for(int j = 0 ; j < matsize ; ++j)
+      v[j] /= norm;
+    double sigma = 0.0;
+    for(int it = 0 ; it < iterations ; ++it)
+    {
+      //u = K v
+      norm = 0.0;
+      for(int i = 0 ; i < matsize ; ++i)
+      {
+        double s = 0.0;
+        for(int j = 0 ; j < matsize ; ++j)
+          s += residual[i*matsize+j]*v[j];
+        u[i] = s;
+        norm += s*s;
+      }
+      if(norm == 0.0)
+        break;
+      norm = sqrt(norm);
+      for(int i = 0 ; i < matsize ; ++i)
+        u[i] /= norm;
+      //v = K^T u
+      for(int j = 0 ; j < matsize ; ++j)
+        v[j] = 0.0;
+      for(int i = 0 ; i < matsize ; ++i)
+        for(int j = 0 ; j < matsize ; ++j)
+          v[j] += residual[i*matsize+j]*u[i];
+      sigma = 0.0;
+      for(int j = 0 ; j < matsize ; ++j)
+        sigma += v[j]*v[j];
+      sigma = sqrt(sigma);
+      if(sigma == 0.0)
+        break;
+      for(int j = 0 ; j < matsize ; ++j)
+        v[j] /= sigma;
+    }
+    if(r == 0)
+      first_sigma = sigma;
+    if(sigma == 0.0 || sigma < tolerance*first_sigma)
+      break;
+    //keep sigma*u along x and v along y, then deflate
+    for(int i = 0 ; i < matsize ; ++i)
+      kernel.u.push_back(sigma*u[i]);
+    for(int j = 0 ; j < matsize ; ++j)
+      kernel.v.push_back(v[j]);
+    ++kernel.rank;
+    for(int i = 0 ; i < matsize ; ++i)
+      for(int j = 0 ; j < matsize ; ++j)
+        residual[i*matsize+j] -= sigma*u[i]*v[j];
+  }
+}
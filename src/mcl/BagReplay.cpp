@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <cmath>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <boost/foreach.hpp>
+#include "ros/console.h"
+#include "mcl/BagReplay.h"
+
+bool BagRecording::load(const std::string& path, const std::string& scan_topic, const std::string& ground_truth_topic)
+{
+  events.clear();
+  tfs.clear();
+  scans.clear();
+  ground_truth.clear();
+  rosbag::Bag bag;
+  try
+  {
+    bag.open(path, rosbag::bagmode::Read);
+  }
+  catch(rosbag::BagException& e)
+  {
+    ROS_ERROR("Couldn't open bag %s: %s", path.c_str(), e.what());
+    return false;
+  }
+  std::vector<std::string> topics;
+  topics.push_back(std::string("/tf"));
+  topics.push_back(std::string("/tf_static"));
+  topics.push_back(scan_topic);
+  if(!ground_truth_topic.empty())
+    topics.push_back(ground_truth_topic);
+  rosbag::View view(bag, rosbag::TopicQuery(topics));
+  BOOST_FOREACH(rosbag::MessageInstance msg, view)
+  {
+    event_t event;
+    tf2_msgs::TFMessage::ConstPtr tf_msg = msg.instantiate<tf2_msgs::TFMessage>();
+    if(tf_msg != NULL)
+    {
+      event.type = msg.getTopic() == "/tf_static" ? TF_STATIC : TF;
+      event.index = tfs.size();
+      tfs.push_back(tf_msg);
+      events.push_back(event);
+      continue;
+    }
+    sensor_msgs::LaserScan::ConstPtr scan = msg.instantiate<sensor_msgs::LaserScan>();
+    if(scan != NULL)
+    {
+      event.type = SCAN;
+      event.index = scans.size();
+      scans.push_back(scan);
+      events.push_back(event);
+      continue;
+    }
+    nav_msgs::Odometry::ConstPtr odom = msg.instantiate<nav_msgs::Odometry>();
+    if(odom != NULL)
+    {
+      event.type = GROUND_TRUTH;
+      event.index = ground_truth.size();
+      ground_truth.push_back(odom);
+      events.push_back(event);
+      continue;
+    }
+    ROS_WARN("Unsupported message type %s", msg.getTopic().c_str());
+  }
+  bag.close();
+  ROS_INFO("Read %lu tf, %lu scan and %lu ground truth messages from %s",
+           tfs.size(), scans.size(), ground_truth.size(), path.c_str());
+  return true;
+}
+
+ReplayStats::ReplayStats():
+  scans(0), dropped(0), updates(0), errors(0),
+  latency_sum(0.0), latency_max(0.0),
+  error_sum(0.0), error_sq_sum(0.0), error_max(0.0),
+  yaw_error_sum(0.0),
+  runtime(0.0)
+{
+}
+
+void ReplayStats::addLatency(double seconds)
+{
+  ++scans;
+  latency_sum += seconds;
+  latency_max = std::max(latency_max, seconds);
+}
+
+void ReplayStats::addError(double dx, double dy, double da)
+{
+  double e = sqrt(dx*dx + dy*dy);
+  ++errors;
+  error_sum += e;
+  error_sq_sum += e*e;
+  error_max = std::max(error_max, e);
+  yaw_error_sum += fabs(atan2(sin(da), cos(da)));
+}
+
+double ReplayStats::rmsError() const
+{
+  return errors > 0 ? sqrt(error_sq_sum / errors) : 0.0;
+}
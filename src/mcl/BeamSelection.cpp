@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cmath>
+#include "mcl/BeamSelection.h"
+
+bool beamSelectionByName(const std::string& name, beam_selection_t* selection)
+{
+  if(name == "stride")
+    *selection = BEAM_SELECTION_STRIDE;
+  else if(name == "information")
+    *selection = BEAM_SELECTION_INFORMATION;
+  else if(name == "stratified")
+    *selection = BEAM_SELECTION_STRATIFIED;
+  else if(name == "random")
+    *selection = BEAM_SELECTION_RANDOM;
+  else
+    return false;
+  return true;
+}
+
+double BeamSelector::endpointSlope(const double (*ranges)[2], int i, const map_t* map, const pf_vector_t& pose) const
+{
+  double x = pose.v[0] + ranges[i][0]*cos(pose.v[2] + ranges[i][1]);
+  double y = pose.v[1] + ranges[i][0]*sin(pose.v[2] + ranges[i][1]);
+  int mi = MAP_GXWX(map, x);
+  int mj = MAP_GYWY(map, y);
+  if(!MAP_VALID(map, mi-1, mj-1) || !MAP_VALID(map, mi+1, mj+1))
+    return 0.0;
+  //central differences, the field is flat where it saturates at max_occ_dist
+  double dx = map->cells[MAP_INDEX(map, mi+1, mj)].occ_dist - map->cells[MAP_INDEX(map, mi-1, mj)].occ_dist;
+  double dy = map->cells[MAP_INDEX(map, mi, mj+1)].occ_dist - map->cells[MAP_INDEX(map, mi, mj-1)].occ_dist;
+  return sqrt(dx*dx + dy*dy)/(2*map->scale);
+}
+
+const std::vector<int>& BeamSelector::select(beam_selection_t selection, const double (*ranges)[2], int count, int max_beams,
+                                             const map_t* map, const pf_vector_t& pose, Philox4x32& rng)
+{
+  valid_.clear();
+  for(int i = 0 ; i < count ; ++i)
+    if(ranges[i][0] == ranges[i][0])
+      valid_.push_back(i);
+  beams_.clear();
+  const int n = valid_.size();
+  if(selection == BEAM_SELECTION_STRIDE || n <= max_beams || max_beams <= 0)
+  {
+    beams_.swap(valid_);
+    return beams_;
+  }
+  switch(selection)
+  {
+    case BEAM_SELECTION_INFORMATION:
+      //one beam per sector of consecutive beams keeps the bearings spread, within a sector the steepest
+      //endpoint wins since a small pose error changes its likelihood most, ties go to the sector middle
+      for(int s = 0 ; s < max_beams ; ++s)
+      {
+        int beg = (int)((long long)s*n/max_beams);
+        int end = (int)((long long)(s+1)*n/max_beams);
+        int best = valid_[(beg + end)/2];
+        double best_slope = endpointSlope(ranges, best, map, pose);
+        for(int k = beg ; k < end ; ++k)
+        {
+          double slope = endpointSlope(ranges, valid_[k], map, pose);
+          if(slope > best_slope)
+          {
+            best = valid_[k];
+            best_slope = slope;
+          }
+        }
+        beams_.push_back(best);
+      }
+      break;
+    case BEAM_SELECTION_STRATIFIED:
+    {
+      //near and far returns are covered alike, one beam is drawn from each range quantile
+      std::sort(valid_.begin(), valid_.end(), [ranges](int a, int b) { return ranges[a][0] < ranges[b][0]; });
+      for(int s = 0 ; s < max_beams ; ++s)
+      {
+        int beg = (int)((long long)s*n/max_beams);
+        int end = (int)((long long)(s+1)*n/max_beams);
+        beams_.push_back(valid_[std::min(beg + (int)(rng.uniform01()*(end - beg)), end - 1)]);
+      }
+      std::sort(beams_.begin(), beams_.end());
+      break;
+    }
+    case BEAM_SELECTION_RANDOM:
+    default:
+      //partial Fisher-Yates shuffle
+      for(int k = 0 ; k < max_beams ; ++k)
+      {
+        int j = std::min(k + (int)(rng.uniform01()*(n - k)), n - 1);
+        std::swap(valid_[k], valid_[j]);
+        beams_.push_back(valid_[k]);
+      }
+      std::sort(beams_.begin(), beams_.end());
+      break;
+  }
+  return beams_;
+}
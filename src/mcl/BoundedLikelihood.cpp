@@ -0,0 +1,78 @@
+#include <cmath>
+#include "mcl/BoundedLikelihood.h"
+
+void BoundedLikelihoodField::setScan(amcl::AMCLLaserData* ldata)
+{
+  laser_ = (amcl::AMCLLaser*)ldata->sensor;
+  z_hit_denom_ = 2 * laser_->sigma_hit * laser_->sigma_hit;
+  z_rand_term_ = laser_->z_rand / ldata->range_max;
+  log_pz_max_ = log(laser_->z_hit + z_rand_term_);
+  //the beams the model strides over, max range readings and NaN add nothing
+  int step = laser_->max_beams > 1 ? (ldata->range_count - 1) / (laser_->max_beams - 1) : 1;
+  if(step < 1)
+    step = 1;
+  std::vector<int> beams;
+  for(int i = 0 ; i < ldata->range_count ; i += step)
+    if(ldata->ranges[i][0] < ldata->range_max)
+      beams.push_back(i);
+  //bit reversed order, every prefix is spread over the scan and bounds the pose by all its bearings
+  int n = beams.size();
+  int bits = 0;
+  while((1 << bits) < n)
+    ++bits;
+  ranges_.clear();
+  bearings_.clear();
+  for(int k = 0 ; k < (1 << bits) ; ++k)
+  {
+    int r = 0;
+    for(int b = 0 ; b < bits ; ++b)
+      if(k & (1 << b))
+        r |= 1 << (bits - 1 - b);
+    if(r < n)
+    {
+      ranges_.push_back(ldata->ranges[beams[r]][0]);
+      bearings_.push_back(ldata->ranges[beams[r]][1]);
+    }
+  }
+}
+
+double BoundedLikelihoodField::logLikelihood(const pf_vector_t& robot_pose, double bound, bool* complete) const
+{
+  const map_t* map = laser_->map;
+  pf_vector_t pose = pf_vector_coord_add(laser_->laser_pose, robot_pose);
+  const int n = ranges_.size();
+  double log_weight = 0.0;
+  for(int k = 0 ; k < n ; ++k)
+  {
+    //the remaining beams can add log_pz_max_ each at most
+    double upper = log_weight + (n - k) * log_pz_max_;
+    if(upper < bound)
+    {
+      if(complete)
+        *complete = false;
+      return upper;
+    }
+    double x = pose.v[0] + ranges_[k] * cos(pose.v[2] + bearings_[k]);
+    double y = pose.v[1] + ranges_[k] * sin(pose.v[2] + bearings_[k]);
+    int mi = MAP_GXWX(map, x);
+    int mj = MAP_GYWY(map, y);
+    //off-map penalized as max distance
+    double z = MAP_VALID(map, mi, mj) ? map->cells[MAP_INDEX(map, mi, mj)].occ_dist : map->max_occ_dist;
+    log_weight += log(laser_->z_hit * exp(-(z * z) / z_hit_denom_) + z_rand_term_);
+  }
+  if(complete)
+    *complete = true;
+  return log_weight;
+}
+
+bool BoundedLikelihoodField::evaluate(pf_sample_t* sample, double bound) const
+{
+  bool complete;
+  sample->logLikelihood = logLikelihood(sample->pose, bound, &complete);
+  sample->likelihood = exp(sample->logLikelihood);
+  sample->preWeight = sample->weight;
+  //in the log domain first, the product may underflow
+  sample->logWeight = log(sample->weight) + sample->logLikelihood;
+  sample->weight *= sample->likelihood;
+  return complete;
+}
@@ -0,0 +1,4 @@
+#include "mcl/Drand48Stream.h"
+
+//one for the process like drand48 itself, whatever filters are instantiated
+boost::mutex Drand48Stream::mutex_;
@@ -0,0 +1,176 @@
+#include <cstdio>
+#include <cstring>
+#include "mcl/FreeSpaceIndex.h"
+#include "mcl/MapPreprocess.h"
+#include "mcl/parallel.h"
+
+//on-disk layout: header, cells[count], then prob[count] and alias[count] if weighted
+typedef struct
+{
+  char magic[8];
+  uint64_t hash;
+  int32_t size_x;
+  int32_t size_y;
+  int32_t count;
+  int32_t weighted;
+} free_space_header_t;
+
+static const char free_space_magic[8] = {'F','S','I','D','X','0','1','\0'};
+
+FreeSpaceIndex::FreeSpaceIndex():
+  map_(NULL),
+  hash_(0)
+{
+}
+
+uint64_t FreeSpaceIndex::mapHash(const map_t* map, double dt_weight)
+{
+  //the distance map only matters when cells are weighted by it
+  double params[2] = {dt_weight, map->max_occ_dist};
+  return ::mapHash(map, params, dt_weight > 0.0 ? 2 : 1);
+}
+
+bool FreeSpaceIndex::build(const map_t* map, double dt_weight, const std::string& cache_dir)
+{
+  map_ = map;
+  hash_ = mapHash(map, dt_weight);
+  std::string path;
+  if(!cache_dir.empty())
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "/free_space_%016llx.bin", (unsigned long long)hash_);
+    path = cache_dir + name;
+    if(load(path))
+      return true;
+  }
+  //row-major scan, so the ids come out sorted
+  cells_.clear();
+  for(int j = 0 ; j < map->size_y ; ++j)
+    for(int i = 0 ; i < map->size_x ; ++i)
+      if(map->cells[MAP_INDEX(map, i, j)].occ_state == -1)
+        cells_.push_back(MAP_INDEX(map, i, j));
+  prob_.clear();
+  alias_.clear();
+  if(dt_weight > 0.0 && !cells_.empty())
+  {
+    std::vector<double> weights(cells_.size());
+    for(size_t k = 0 ; k < cells_.size() ; ++k)
+      weights[k] = 1.0 + dt_weight * map->cells[cells_[k]].occ_dist;
+    buildAliasTable(weights);
+  }
+  if(!path.empty())
+    save(path);
+  return false;
+}
+
+//Vose's alias method, cell k keeps probability prob_[k] and hands the rest to alias_[k]
+void FreeSpaceIndex::buildAliasTable(const std::vector<double>& weights)
+{
+  int n = weights.size();
+  double total = 0.0;
+  for(auto w : weights)
+    total += w;
+  std::vector<double> scaled(n);
+  std::vector<int32_t> small, large;
+  for(int k = 0 ; k < n ; ++k)
+  {
+    scaled[k] = weights[k] * n / total;
+    if(scaled[k] < 1.0)
+      small.push_back(k);
+    else
+      large.push_back(k);
+  }
+  prob_.assign(n, 1.0f);
+  alias_.resize(n);
+  for(int k = 0 ; k < n ; ++k)
+    alias_[k] = k;
+  while(!small.empty() && !large.empty())
+  {
+    int32_t s = small.back(), l = large.back();
+    small.pop_back();
+    prob_[s] = scaled[s];
+    alias_[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if(scaled[l] < 1.0)
+    {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  //whatever is left is 1 up to rounding and keeps prob_ = 1
+}
+
+void FreeSpaceIndex::samplePoses(const Philox4x32& streams, int count, pf_vector_t* poses) const
+{
+  parallelFor(count, [&](int beg, int end)
+  {
+    for(int i = beg ; i < end ; ++i)
+    {
+      Philox4x32::Block r = streams.block(i, 0);
+      int k = drawCell(Philox4x32::toUniform(r.v[0]), Philox4x32::toUniform(r.v[1]));
+      poses[i] = pose(k, Philox4x32::toUniform(r.v[2]) * 2 * M_PI - M_PI);
+    }
+  });
+}
+
+size_t FreeSpaceIndex::bytes() const
+{
+  return (cells_.capacity() + alias_.capacity())*sizeof(int32_t) + prob_.capacity()*sizeof(float);
+}
+
+bool FreeSpaceIndex::save(const std::string& path) const
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file)
+    return false;
+  free_space_header_t header;
+  memcpy(header.magic, free_space_magic, sizeof(header.magic));
+  header.hash = hash_;
+  header.size_x = map_->size_x;
+  header.size_y = map_->size_y;
+  header.count = cells_.size();
+  header.weighted = weighted();
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(cells_.data(), sizeof(int32_t), cells_.size(), file) == cells_.size();
+  if(ok && weighted())
+    ok = fwrite(prob_.data(), sizeof(float), prob_.size(), file) == prob_.size() &&
+         fwrite(alias_.data(), sizeof(int32_t), alias_.size(), file) == alias_.size();
+  fclose(file);
+  if(!ok)
+    remove(path.c_str());
+  return ok;
+}
+
+bool FreeSpaceIndex::load(const std::string& path)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file)
+    return false;
+  free_space_header_t header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, free_space_magic, sizeof(header.magic)) == 0 &&
+            header.hash == hash_ && header.size_x == map_->size_x && header.size_y == map_->size_y &&
+            header.count >= 0;
+  if(ok)
+  {
+    cells_.resize(header.count);
+    ok = fread(cells_.data(), sizeof(int32_t), cells_.size(), file) == cells_.size();
+  }
+  prob_.clear();
+  alias_.clear();
+  if(ok && header.weighted)
+  {
+    prob_.resize(header.count);
+    alias_.resize(header.count);
+    ok = fread(prob_.data(), sizeof(float), prob_.size(), file) == prob_.size() &&
+         fread(alias_.data(), sizeof(int32_t), alias_.size(), file) == alias_.size();
+  }
+  fclose(file);
+  if(!ok)
+  {
+    cells_.clear();
+    prob_.clear();
+    alias_.clear();
+  }
+  return ok;
+}
@@ -1,18 +1,26 @@
+#include <climits>
 #include "mcl/MCL.h"
+#include "mcl/parallel.h"
+#include "amcl/pf/pf_cluster.h"
 
 template<class D>
-MCL<D>::MCL() :
+MCL<D>::MCL(const std::string& ns) :
     sent_first_transform_(false),
     latest_tf_valid_(false),
     map_(NULL),
+    fusion_count_(0),
     pf_(NULL),
     resample_count_(0),
+    ess_(-1.0),
     odom_(NULL),
     laser_(NULL),
-    private_nh_("~"),
+    nh_(ns),
+    private_nh_(ns.empty() ? std::string("~") : "~/" + ns),
     initial_pose_hyp_(NULL),
     first_map_received_(false),
-    first_reconfigure_call_(true)
+    first_reconfigure_call_(true),
+    map_stage_ready_(false),
+    heaviest_cluster_first_(false)
 {
   boost::recursive_mutex::scoped_lock l(configuration_mutex_);
   // Grab params off the param server
@@ -27,6 +35,17 @@ MCL<D>::MCL() :
   private_nh_.param("laser_min_range", laser_min_range_, -1.0);
   private_nh_.param("laser_max_range", laser_max_range_, -1.0);
   private_nh_.param("laser_max_beams", max_beams_, 30);
+  std::string tmp_beam_selection;
+  private_nh_.param("laser_beam_selection", tmp_beam_selection, std::string("stride"));
+  if(!beamSelectionByName(tmp_beam_selection, &beam_selection_))
+  {
+    ROS_WARN("Unknown beam selection \"%s\"; defaulting to stride", tmp_beam_selection.c_str());
+    beam_selection_ = BEAM_SELECTION_STRIDE;
+  }
+  private_nh_.param("laser_termination_margin", termination_margin_, -1.0);
+  if(termination_margin_ >= 0 && termination_margin_ < 5.0)
+    ROS_WARN("laser_termination_margin %f lets the given up samples weigh up to %f of the best one together",
+             termination_margin_, exp(-termination_margin_));
   private_nh_.param("min_particles", min_particles_, 100);
   private_nh_.param("max_particles", max_particles_, 5000);
   private_nh_.param("kld_err", pf_err_, 0.01);
@@ -39,7 +58,7 @@ MCL<D>::MCL() :
   private_nh_.param("do_beamskip", do_beamskip_, false);
   private_nh_.param("beam_skip_distance", beam_skip_distance_, 0.5);
   private_nh_.param("beam_skip_threshold", beam_skip_threshold_, 0.3);
-  private_nh_.param("beam_skip_error_threshold_", beam_skip_error_threshold_, 0.9);
+  private_nh_.param("beam_skip_error_threshold", beam_skip_error_threshold_, 0.9);
   private_nh_.param("laser_z_hit", z_hit_, 0.95);
   private_nh_.param("laser_z_short", z_short_, 0.1);
   private_nh_.param("laser_z_max", z_max_, 0.05);
@@ -83,25 +102,40 @@ MCL<D>::MCL() :
   private_nh_.param("base_frame_id", base_frame_id_, std::string("base_link"));
   private_nh_.param("global_frame_id", global_frame_id_, std::string("map"));
   private_nh_.param("resample_interval", resample_interval_, 2);
+  double fusion_window;
+  private_nh_.param("laser_fusion_window", fusion_window, 0.0);
+  fusion_window_.fromSec(fusion_window);
+  private_nh_.param("free_space_dt_weight", free_space_dt_weight_, 0.0);
+  private_nh_.param("free_space_cache_dir", free_space_cache_dir_, std::string(""));
+  private_nh_.param("map_cache_dir", map_cache_dir_, std::string(""));
+  distance_map_max_dist_ = -1.0;
+  //0 keeps the fixed interval
+  private_nh_.param("resample_ess_fraction", resample_ess_fraction_, 0.0);
   double tmp_tol;
   private_nh_.param("transform_tolerance", tmp_tol, 0.1);
   transform_tolerance_.fromSec(tmp_tol);
   private_nh_.param("recovery_alpha_slow", alpha_slow_, 0.001);
   private_nh_.param("recovery_alpha_fast", alpha_fast_, 0.1);
   private_nh_.param("tf_broadcast", tf_broadcast_, true);
+  //a negative seed is drawn and logged, setting it again repeats the run
+  int random_seed;
+  private_nh_.param("random_seed", random_seed, -1);
+  if(random_seed < 0)
+    random_seed = (int)(RandomStreams::randomSeed() & INT_MAX);
+  random_.reseed(random_seed);
+  //amcl's own samplers are only repeatable through drand48
+  drand48_.reseed(random_seed);
+  ROS_INFO("random_seed: %d", random_seed);
   double bag_scan_period;
   private_nh_.param("bag_scan_period", bag_scan_period, -1.0);
   bag_scan_period_.fromSec(bag_scan_period);
+  private_nh_.param("bag_scan_topic", bag_scan_topic_, std::string("/p3dx/laser/scan"));
+  private_nh_.param("bag_ground_truth_topic", bag_ground_truth_topic_, std::string("/p3dx/base_pose_ground_truth"));
 
-  //resmaple options, augmented, KLD, low-variance
+  //resmaple options, augmented, KLD, low-variance and the schemes of pf_resample_function
   private_nh_.param("resample_type", tmp_model_type, std::string("kld"));
-  if(tmp_model_type == "kld")
-    resample_function_ = &pf_update_resample_kld;
-  else if(tmp_model_type == "lowvariance")
-    resample_function_ = &pf_update_resample_lowvariance;
-  else if(tmp_model_type == "augmented")
-    resample_function_ = &pf_update_resample;
-  else
+  resample_function_ = pf_resample_function(tmp_model_type);
+  if(!resample_function_)
     resample_function_ = &pf_update_resample_kld;
      
 
@@ -113,6 +147,11 @@ MCL<D>::MCL() :
   pose_pub_ = nh_.advertise<geometry_msgs::PoseWithCovarianceStamped>("mcl_pose", 2, true);
   particlecloud_pub_ = nh_.advertise<geometry_msgs::PoseArray>("particlecloud", 2, true);
   wpc_pub_ = nh_.advertise<stamped_std_msgs::StampedFloat64MultiArray>("weighted_pc", 2, true);
+  ess_pub_ = nh_.advertise<stamped_std_msgs::StampedFloat64MultiArray>("resample_ess", 2, true);
+  //0 publishes the best hypothesis only
+  private_nh_.param("hypotheses_count", hypotheses_count_, 0);
+  if(hypotheses_count_ > 0)
+    hypotheses_pub_ = nh_.advertise<stamped_std_msgs::StampedFloat64MultiArray>("hypotheses", 2, true);
 
   //generic services
   //nomotionUpdateCallback is generic
@@ -127,6 +166,8 @@ MCL<D>::MCL() :
   laser_scan_sub_ = new message_filters::Subscriber<sensor_msgs::LaserScan>(nh_, scan_topic_, 100);
   initial_pose_sub_ = nh_.subscribe("initialpose", 2, &MCL::initialPoseReceived, this);
 
+  //applied when the first map arrives
+  private_nh_.param("global_localization", global_localization_, false);
   if(use_map_topic_) {
     map_sub_ = nh_.subscribe("map", 1, &MCL::mapReceived, this);
     ROS_INFO("Subscribed to map topic.");
@@ -137,7 +178,7 @@ MCL<D>::MCL() :
 
   tfb_ = new tf::TransformBroadcaster();
   tf_ = new TransformListenerWrapper();
-  dsrv_ = new dynamic_reconfigure::Server<amcl::AMCLConfig>(ros::NodeHandle("~"));
+  dsrv_ = new dynamic_reconfigure::Server<amcl::AMCLConfig>(private_nh_);
   dynamic_reconfigure::Server<amcl::AMCLConfig>::CallbackType cb = boost::bind(&MCL<D>::reconfigureCB, this, _1, _2);
   dsrv_->setCallback(cb);
 
@@ -146,16 +187,6 @@ MCL<D>::MCL() :
   check_laser_timer_ = nh_.createTimer(laser_check_interval_, 
                                        boost::bind(&MCL<D>::checkLaserReceived, this, _1));
 
-  private_nh_.param("global_localization", global_localization_, false);
-  if(global_localization_)
-  {
-    ROS_INFO("Initializing with uniform distribution");
-    pf_init_model(pf_, (pf_init_model_fn_t)MCL::uniformPoseGenerator,
-                  (void *)map_);
-
-    ROS_INFO("Global initialisation done!");
-    pf_init_ = false;
-  }
   this->printInfo();
 }
 
@@ -171,6 +202,7 @@ MCL<D>::reconfigureCB(amcl::AMCLConfig &config, uint32_t level)
   {
     first_reconfigure_call_ = false;
     default_config_ = config;
+    last_config_ = config;
     return;
   }
 
@@ -230,6 +262,29 @@ MCL<D>::reconfigureCB(amcl::AMCLConfig &config, uint32_t level)
     config.max_particles = config.min_particles;
   }
 
+  //only the components whose parameters changed are touched, the filter keeps its samples
+  bool filter_resized = config.min_particles != last_config_.min_particles ||
+                        config.max_particles != last_config_.max_particles;
+  bool odom_changed = config.odom_model_type != last_config_.odom_model_type ||
+                      config.odom_alpha1 != last_config_.odom_alpha1 ||
+                      config.odom_alpha2 != last_config_.odom_alpha2 ||
+                      config.odom_alpha3 != last_config_.odom_alpha3 ||
+                      config.odom_alpha4 != last_config_.odom_alpha4 ||
+                      config.odom_alpha5 != last_config_.odom_alpha5;
+  bool laser_changed = config.laser_model_type != last_config_.laser_model_type ||
+                       config.laser_max_beams != last_config_.laser_max_beams ||
+                       config.laser_z_hit != last_config_.laser_z_hit ||
+                       config.laser_z_short != last_config_.laser_z_short ||
+                       config.laser_z_max != last_config_.laser_z_max ||
+                       config.laser_z_rand != last_config_.laser_z_rand ||
+                       config.laser_sigma_hit != last_config_.laser_sigma_hit ||
+                       config.laser_lambda_short != last_config_.laser_lambda_short ||
+                       config.laser_likelihood_max_dist != last_config_.laser_likelihood_max_dist ||
+                       config.do_beamskip != last_config_.do_beamskip ||
+                       config.beam_skip_distance != last_config_.beam_skip_distance ||
+                       config.beam_skip_threshold != last_config_.beam_skip_threshold ||
+                       config.beam_skip_error_threshold != last_config_.beam_skip_error_threshold;
+
   min_particles_ = config.min_particles;
   max_particles_ = config.max_particles;
   alpha_slow_ = config.recovery_alpha_slow;
@@ -239,63 +294,36 @@ MCL<D>::reconfigureCB(amcl::AMCLConfig &config, uint32_t level)
   do_beamskip_= config.do_beamskip; 
   beam_skip_distance_ = config.beam_skip_distance; 
   beam_skip_threshold_ = config.beam_skip_threshold; 
+  beam_skip_error_threshold_ = config.beam_skip_error_threshold;
 
-  pf_ = pf_alloc(min_particles_, max_particles_,
-                 alpha_slow_, alpha_fast_,
-                 (pf_init_model_fn_t)MCL::uniformPoseGenerator,
-                 (void *)map_);
   pf_err_ = config.kld_err; 
   pf_z_ = config.kld_z; 
+
+  odom_frame_id_ = config.odom_frame_id;
+  base_frame_id_ = config.base_frame_id;
+  global_frame_id_ = config.global_frame_id;
+  last_config_ = config;
+
+  //without a map there is nothing to update, handleMapMessage builds everything from the members
+  if(map_ == NULL || pf_ == NULL)
+    return;
+
+  if(filter_resized)
+    pf_resize(pf_, min_particles_, max_particles_);
+  pf_->alpha_slow = alpha_slow_;
+  pf_->alpha_fast = alpha_fast_;
   pf_->pop_err = pf_err_;
   pf_->pop_z = pf_z_;
 
-  // Initialize the filter
-  pf_vector_t pf_init_pose_mean = pf_vector_zero();
-  pf_init_pose_mean.v[0] = last_published_pose.pose.pose.position.x;
-  pf_init_pose_mean.v[1] = last_published_pose.pose.pose.position.y;
-  pf_init_pose_mean.v[2] = tf::getYaw(last_published_pose.pose.pose.orientation);
-  pf_matrix_t pf_init_pose_cov = pf_matrix_zero();
-  pf_init_pose_cov.m[0][0] = last_published_pose.pose.covariance[6*0+0];
-  pf_init_pose_cov.m[1][1] = last_published_pose.pose.covariance[6*1+1];
-  pf_init_pose_cov.m[2][2] = last_published_pose.pose.covariance[6*5+5];
-  pf_init(pf_, pf_init_pose_mean, pf_init_pose_cov);
-  pf_init_ = false;
-
-  // Instantiate the sensor objects
   // Odometry
-  delete odom_;
-  odom_ = new amcl::AMCLOdom();
-  ROS_ASSERT(odom_);
-  odom_->SetModel( odom_model_type_, alpha1_, alpha2_, alpha3_, alpha4_, alpha5_ );
-  // Laser
-  delete laser_;
-  laser_ = new amcl::AMCLLaser(max_beams_, map_);
-  ROS_ASSERT(laser_);
-  if(laser_model_type_ == amcl::LASER_MODEL_BEAM)
-  {
-    laser_->SetModelBeam(z_hit_, z_short_, z_max_, z_rand_,
-                         sigma_hit_, lambda_short_, 0.0);
-  }
-  else if(laser_model_type_ == amcl::LASER_MODEL_LIKELIHOOD_FIELD_PROB)
+  if(odom_changed)
+    odom_->SetModel( odom_model_type_, alpha1_, alpha2_, alpha3_, alpha4_, alpha5_ );
+  // Laser, the per-frame copies are dropped so that they pick up the new model
+  if(laser_changed)
   {
-    ROS_INFO("Initializing likelihood field model; this can take some time on large maps...");
-    laser_->SetModelLikelihoodFieldProb(z_hit_, z_rand_, sigma_hit_,
-					laser_likelihood_max_dist_, 
-					do_beamskip_, beam_skip_distance_, 
-					beam_skip_threshold_, beam_skip_error_threshold_);
-    ROS_INFO("Done initializing likelihood field model with probabilities.");
+    initLaserModel();
+    clearLasers();
   }
-  else if(laser_model_type_ == amcl::LASER_MODEL_LIKELIHOOD_FIELD)
-  {
-    ROS_INFO("Initializing likelihood field model; this can take some time on large maps...");
-    laser_->SetModelLikelihoodField(z_hit_, z_rand_, sigma_hit_,
-                                    laser_likelihood_max_dist_);
-    ROS_INFO("Done initializing likelihood field model.");
-  }
-
-  odom_frame_id_ = config.odom_frame_id;
-  base_frame_id_ = config.base_frame_id;
-  global_frame_id_ = config.global_frame_id;
 
   //move build_density_tree to Derived::reconfigureCB()
   static_cast<D*>(this)->RCCB();
@@ -323,6 +351,14 @@ MCL<D>::setMapCallback(nav_msgs::SetMap::Request& req,
   return true;
 }
 
+template<class D>
+void
+MCL<D>::setMap(const nav_msgs::OccupancyGrid& msg)
+{
+  handleMapMessage(msg);
+  first_map_received_ = true;
+}
+
 template<class D>
 void
 MCL<D>::initialPoseReceived(const geometry_msgs::PoseWithCovarianceStampedConstPtr& msg)
@@ -372,13 +408,13 @@ MCL<D>::handleMapMessage(const nav_msgs::OccupancyGrid& msg)
            msg.info.height,
            msg.info.resolution);
 
+  bool first_map = map_ == NULL;
   freeMapDependentMemory();
   // Clear queued laser objects because they hold pointers to the existing
   // map, #5202.
-  lasers_.clear();
-  lasers_update_.clear();
-  frame_to_laser_.clear();
+  clearLasers();
   map_ = convertMap(msg);
+  distance_map_max_dist_ = -1.0;
   mapx_.first = MAP_WXGX(map_, 0);
   mapx_.second = MAP_WXGX(map_, map_->size_x); 
   mapy_.first = MAP_WYGY(map_, 0);
@@ -386,20 +422,11 @@ MCL<D>::handleMapMessage(const nav_msgs::OccupancyGrid& msg)
   map_rng_x_ = mapx_.second - mapx_.first;
   map_rng_y_ = mapy_.second - mapy_.first;
 
-#if NEW_UNIFORM_SAMPLING
-  // Index of free space
-  MCL::free_space_indices.resize(0);
-  for(int i = 0; i < map_->size_x; i++)
-    for(int j = 0; j < map_->size_y; j++)
-      if(map_->cells[MAP_INDEX(map_,i,j)].occ_state == -1)
-        MCL::free_space_indices.push_back(std::make_pair(i,j));
-  ROS_INFO("free_space_indices.size() is %ld\n", MCL::free_space_indices.size());
-#endif
   // Create the particle filter
   pf_ = pf_alloc(min_particles_, max_particles_,
                  alpha_slow_, alpha_fast_,
                  (pf_init_model_fn_t)MCL::uniformPoseGenerator,
-                 (void *)map_);
+                 (void *)&free_space_);
   pf_->pop_err = pf_err_;
   pf_->pop_z = pf_z_;
 
@@ -414,7 +441,11 @@ MCL<D>::handleMapMessage(const nav_msgs::OccupancyGrid& msg)
   pf_init_pose_cov.m[1][1] = init_cov_[1];
   pf_init_pose_cov.m[2][2] = init_cov_[2];
   //update the filter
-  pf_init(pf_, pf_init_pose_mean, pf_init_pose_cov);
+  {
+    Drand48Stream::Lock l(drand48_);
+    pf_init(pf_, pf_init_pose_mean, pf_init_pose_cov);
+  }
+  heaviest_cluster_first_ = false;
   pf_init_ = false;
 
   // Instantiate the sensor objects
@@ -424,33 +455,30 @@ MCL<D>::handleMapMessage(const nav_msgs::OccupancyGrid& msg)
   ROS_ASSERT(odom_);
   odom_->SetModel( odom_model_type_, alpha1_, alpha2_, alpha3_, alpha4_, alpha5_ );
   // Laser
-  delete laser_;
-  laser_ = new amcl::AMCLLaser(max_beams_, map_);
-  ROS_ASSERT(laser_);
-  if(laser_model_type_ == amcl::LASER_MODEL_BEAM)
-    laser_->SetModelBeam(z_hit_, z_short_, z_max_, z_rand_,
-                         sigma_hit_, lambda_short_, 0.0);
-  else if(laser_model_type_ == amcl::LASER_MODEL_LIKELIHOOD_FIELD_PROB){
-    ROS_INFO("Initializing likelihood field model; this can take some time on large maps...");
-    laser_->SetModelLikelihoodFieldProb(z_hit_, z_rand_, sigma_hit_,
-					laser_likelihood_max_dist_, 
-					do_beamskip_, beam_skip_distance_, 
-					beam_skip_threshold_, beam_skip_error_threshold_);
-    ROS_INFO("Done initializing likelihood field model.");
-  }
-  else
-  {
-    ROS_INFO("Initializing likelihood field model; this can take some time on large maps...");
-    laser_->SetModelLikelihoodField(z_hit_, z_rand_, sigma_hit_,
-                                    laser_likelihood_max_dist_);
-    ROS_INFO("Done initializing likelihood field model.");
-  }
+  initLaserModel();
+  // Index of free space, the likelihood field models have filled occ_dist by now
+  if(free_space_dt_weight_ > 0.0 && laser_model_type_ == amcl::LASER_MODEL_BEAM)
+    prepareDistanceMap();
+  bool cached = free_space_.build(map_, free_space_dt_weight_, free_space_cache_dir_);
+  ROS_INFO("free space index of %d cells takes %lu bytes%s", free_space_.size(), free_space_.bytes(), cached ? ", read from cache" : "");
+  //Derived calls mapStage itself at the end of its constructor
+  if(map_stage_ready_)
+    static_cast<D*>(this)->mapStage();
 
   //update the filter
   // In case the initial pose message arrived before the first map,
   // try to apply the initial pose now that the map has arrived.
   applyInitialPose();
 
+  if(first_map && global_localization_)
+  {
+    ROS_INFO("Initializing with uniform distribution");
+    initUniformModel();
+
+    ROS_INFO("Global initialisation done!");
+    pf_init_ = false;
+  }
+
 }
 
 /**
@@ -472,17 +500,62 @@ MCL<D>::convertMap( const nav_msgs::OccupancyGrid& map_msg )
   // Convert to player format
   map->cells = (map_cell_t*)malloc(sizeof(map_cell_t)*map->size_x*map->size_y);
   ROS_ASSERT(map->cells);
-  for(int i=0;i<map->size_x * map->size_y;i++)
+  convertOccupancy(map_msg.data.data(), map);
+
+  return map;
+}
+
+template<class D>
+void
+MCL<D>::initLaserModel()
+{
+  delete laser_;
+  laser_ = new amcl::AMCLLaser(max_beams_, map_);
+  ROS_ASSERT(laser_);
+  if(laser_model_type_ == amcl::LASER_MODEL_BEAM)
   {
-    if(map_msg.data[i] == 0)
-      map->cells[i].occ_state = -1;
-    else if(map_msg.data[i] == 100)
-      map->cells[i].occ_state = +1;
-    else
-      map->cells[i].occ_state = 0;
+    laser_->SetModelBeam(z_hit_, z_short_, z_max_, z_rand_,
+                         sigma_hit_, lambda_short_, 0.0);
+    return;
   }
+  //the same fields SetModelLikelihoodField(Prob) sets, without its serial map_update_cspace
+  prepareDistanceMap();
+  laser_->model_type = laser_model_type_;
+  laser_->z_hit = z_hit_;
+  laser_->z_rand = z_rand_;
+  laser_->sigma_hit = sigma_hit_;
+  if(laser_model_type_ == amcl::LASER_MODEL_LIKELIHOOD_FIELD_PROB)
+  {
+    laser_->do_beamskip = do_beamskip_;
+    laser_->beam_skip_distance = beam_skip_distance_;
+    laser_->beam_skip_threshold = beam_skip_threshold_;
+    laser_->beam_skip_error_threshold = beam_skip_error_threshold_;
+  }
+}
 
-  return map;
+template<class D>
+void
+MCL<D>::clearLasers()
+{
+  for(size_t i = 0 ; i < lasers_.size() ; ++i)
+    delete lasers_[i];
+  lasers_.clear();
+  lasers_update_.clear();
+  frame_to_laser_.clear();
+  fusion_scans_.clear();
+  fusion_count_ = 0;
+}
+
+template<class D>
+void
+MCL<D>::prepareDistanceMap()
+{
+  if(distance_map_max_dist_ == laser_likelihood_max_dist_)
+    return;
+  ros::WallTime start = ros::WallTime::now();
+  bool cached = updateDistanceMap(map_, laser_likelihood_max_dist_, map_cache_dir_);
+  distance_map_max_dist_ = laser_likelihood_max_dist_;
+  ROS_INFO("likelihood field distance map %s in %.3f s", cached ? "read from cache" : "computed", (ros::WallTime::now() - start).toSec());
 }
 
 template<class D>
@@ -578,7 +651,11 @@ MCL<D>::applyInitialPose()
   boost::recursive_mutex::scoped_lock cfl(configuration_mutex_);
   if( initial_pose_hyp_ != NULL && map_ != NULL )
   {
-    pf_init(pf_, initial_pose_hyp_->pf_pose_mean, initial_pose_hyp_->pf_pose_cov);
+    {
+      Drand48Stream::Lock l(drand48_);
+      pf_init(pf_, initial_pose_hyp_->pf_pose_mean, initial_pose_hyp_->pf_pose_cov);
+    }
+    heaviest_cluster_first_ = false;
     pf_init_ = false;
 
     delete initial_pose_hyp_;
@@ -602,6 +679,69 @@ MCL<D>::checkLaserReceived(const ros::TimerEvent& event)
   }
 }
 
+template<class D>
+bool
+MCL<D>::resampleRequired(const ros::Time& stamp)
+{
+  pf_sample_set_t* set = pf_->sets + pf_->current_set;
+  //the sensor stages normalizing through pf_normalize_ess leave it behind, the others take a pass here
+  double ess = ess_ >= 0.0 ? ess_ : pf_effective_sample_size(set);
+  ess_ = -1.0;
+  double ess_fraction = set->sample_count > 0 ? ess/set->sample_count : 0.0;
+  ++resample_count_;
+  bool resample;
+  if(resample_ess_fraction_ > 0.0)
+    resample = ess_fraction < resample_ess_fraction_;
+  else
+    resample = !(resample_count_ % resample_interval_);
+  ROS_DEBUG("effective sample size %f of %d samples, resample: %d", ess, set->sample_count, resample);
+  if(ess_pub_.getNumSubscribers() > 0)
+  {
+    stamped_std_msgs::StampedFloat64MultiArray ess_msg;
+    ess_msg.header.frame_id = global_frame_id_;
+    ess_msg.header.stamp = stamp;
+    ess_msg.array.data.resize(3);
+    ess_msg.array.data[0] = ess;
+    ess_msg.array.data[1] = ess_fraction;
+    ess_msg.array.data[2] = resample ? 1.0 : 0.0;
+    ess_pub_.publish(ess_msg);
+  }
+  return resample;
+}
+
+template<class D>
+void
+MCL<D>::waitForMap()
+{
+  while (ros::ok())
+  {
+    {
+      boost::recursive_mutex::scoped_lock cfl(configuration_mutex_);
+      if (map_)
+      {
+        ROS_INFO("Map is ready");
+        break;
+      }
+    }
+    ROS_INFO("Waiting for map...");
+    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(1.0));
+  }
+}
+
+template<class D>
+void
+MCL<D>::logFinalLocation()
+{
+  const geometry_msgs::Quaternion & q(this->last_published_pose.pose.pose.orientation);
+  double yaw, pitch, roll;
+  tf::Matrix3x3(tf::Quaternion(q.x, q.y, q.z, q.w)).getEulerYPR(yaw,pitch,roll);
+  ROS_INFO("Final location %.3f, %.3f, %.3f with stamp=%f",
+            last_published_pose.pose.pose.position.x,
+            last_published_pose.pose.pose.position.y,
+            yaw, last_published_pose.header.stamp.toSec()
+            );
+}
+
 template<class D>
 void 
 MCL<D>::runFromBag(const std::string &in_bag_fn)
@@ -610,16 +750,13 @@ MCL<D>::runFromBag(const std::string &in_bag_fn)
   bag.open(in_bag_fn, rosbag::bagmode::Read);
   std::vector<std::string> topics;
   topics.push_back(std::string("/tf"));
-  //std::string scan_topic_name = "base_scan"; 
-  std::string scan_topic_name = "/p3dx/laser/scan"; 
-  topics.push_back(scan_topic_name);
-  std::string ground_truth_topic_name = "/p3dx/base_pose_ground_truth"; 
-  topics.push_back(ground_truth_topic_name);
+  topics.push_back(bag_scan_topic_);
+  topics.push_back(bag_ground_truth_topic_);
   rosbag::View view(bag, rosbag::TopicQuery(topics));
 
-  ros::Publisher laser_pub = nh_.advertise<sensor_msgs::LaserScan>(scan_topic_name, 100);
+  ros::Publisher laser_pub = nh_.advertise<sensor_msgs::LaserScan>(bag_scan_topic_, 100);
   ros::Publisher tf_pub = nh_.advertise<tf2_msgs::TFMessage>("/tf", 100);
-  ros::Publisher gt_pub = nh_.advertise<nav_msgs::Odometry>(ground_truth_topic_name, 100);
+  ros::Publisher gt_pub = nh_.advertise<nav_msgs::Odometry>(bag_ground_truth_topic_, 100);
 
   // Sleep for a second to let all subscribers connect
   ros::WallDuration(1.0).sleep();
@@ -627,19 +764,8 @@ MCL<D>::runFromBag(const std::string &in_bag_fn)
   ros::WallTime start(ros::WallTime::now());
 
   // Wait for map
-  while (ros::ok())
-  {
-    {
-      boost::recursive_mutex::scoped_lock cfl(configuration_mutex_);
-      if (map_)
-      {
-        ROS_INFO("Map is ready");
-        break;
-      }
-    }
-    ROS_INFO("Waiting for map...");
-    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(1.0));
-  }
+  waitForMap();
+
   int tfCount = 0;
   int scanCount = 0;
   int gtCount = 0;
@@ -708,18 +834,102 @@ MCL<D>::runFromBag(const std::string &in_bag_fn)
   double runtime = (ros::WallTime::now() - start).toSec();
   ROS_INFO("Bag complete, took %.1f seconds to process for %d tf msgs and %d scan msgs, shutting down", runtime, tfCount, scanCount);
 
-  const geometry_msgs::Quaternion & q(this->last_published_pose.pose.pose.orientation);
-  double yaw, pitch, roll;
-  tf::Matrix3x3(tf::Quaternion(q.x, q.y, q.z, q.w)).getEulerYPR(yaw,pitch,roll);
-  ROS_INFO("Final location %.3f, %.3f, %.3f with stamp=%f",
-            last_published_pose.pose.pose.position.x,
-            last_published_pose.pose.pose.position.y,
-            yaw, last_published_pose.header.stamp.toSec()
-            );
+  logFinalLocation();
 
   ros::shutdown();
 }
 
+template<class D>
+void
+MCL<D>::runFromBagFast(const std::string &in_bag_fn)
+{
+  BagRecording recording;
+  if(!recording.load(in_bag_fn, bag_scan_topic_, bag_ground_truth_topic_))
+  {
+    ros::shutdown();
+    return;
+  }
+  waitForMap();
+  ReplayStats stats;
+  replay(recording, stats);
+  ROS_INFO("Bag complete, took %.1f seconds to process %d scans (%d dropped), %d pose updates",
+           stats.runtime, stats.scans, stats.dropped, stats.updates);
+  ROS_INFO("Latency per scan: mean %.2f ms, max %.2f ms", stats.meanLatency()*1e3, stats.latency_max*1e3);
+  if(stats.errors > 0)
+    ROS_INFO("Position error over %d updates: mean %.3f m, rms %.3f m, max %.3f m, mean yaw error %.3f rad",
+             stats.errors, stats.meanError(), stats.rmsError(), stats.error_max, stats.meanYawError());
+  logFinalLocation();
+
+  ros::shutdown();
+}
+
+template<class D>
+void
+MCL<D>::replay(const BagRecording& recording, ReplayStats& stats)
+{
+  ros::WallTime start = ros::WallTime::now();
+  //scans wait until their odometric pose is known, as in laser_scan_filter_
+  const size_t queue_size = 100;
+  std::deque<std::pair<sensor_msgs::LaserScanConstPtr, nav_msgs::OdometryConstPtr> > pending;
+  nav_msgs::OdometryConstPtr truth;
+  for(size_t k = 0 ; k < recording.events.size() && ros::ok() ; ++k)
+  {
+    const BagRecording::event_t& event = recording.events[k];
+    switch(event.type)
+    {
+      case BagRecording::TF:
+      case BagRecording::TF_STATIC:
+      {
+        const tf2_msgs::TFMessage& tf_msg = *recording.tfs[event.index];
+        for (size_t ii=0; ii<tf_msg.transforms.size(); ++ii)
+          tf_->getBuffer().setTransform(tf_msg.transforms[ii], "rosbag_authority",
+                                        event.type == BagRecording::TF_STATIC);
+        break;
+      }
+      case BagRecording::SCAN:
+        pending.push_back(std::make_pair(recording.scans[event.index], truth));
+        if(pending.size() > queue_size)
+        {
+          pending.pop_front();
+          ++stats.dropped;
+        }
+        break;
+      case BagRecording::GROUND_TRUTH:
+        truth = recording.ground_truth[event.index];
+        break;
+    }
+    while(!pending.empty() &&
+          tf_->canTransform(odom_frame_id_, pending.front().first->header.frame_id,
+                            pending.front().first->header.stamp))
+    {
+      replayScan(pending.front().first, pending.front().second, stats);
+      pending.pop_front();
+    }
+  }
+  stats.dropped += pending.size();
+  stats.runtime = (ros::WallTime::now() - start).toSec();
+}
+
+template<class D>
+void
+MCL<D>::replayScan(const sensor_msgs::LaserScanConstPtr& scan, const nav_msgs::OdometryConstPtr& truth, ReplayStats& stats)
+{
+  ros::Time last_stamp = last_published_pose.header.stamp;
+  ros::WallTime beg = ros::WallTime::now();
+  laserReceived(scan);
+  stats.addLatency((ros::WallTime::now() - beg).toSec());
+  //a new pose carries the stamp of its scan
+  if(last_published_pose.header.stamp == last_stamp || last_published_pose.header.stamp != scan->header.stamp)
+    return;
+  ++stats.updates;
+  if(!truth)
+    return;
+  const geometry_msgs::Pose& p = last_published_pose.pose.pose;
+  const geometry_msgs::Pose& t = truth->pose.pose;
+  stats.addError(p.position.x - t.position.x, p.position.y - t.position.y,
+                 tf::getYaw(p.orientation) - tf::getYaw(t.orientation));
+}
+
 template<class D>
 bool
 MCL<D>::globalLocalizationCallback(std_srvs::Empty::Request& req,
@@ -730,8 +940,7 @@ MCL<D>::globalLocalizationCallback(std_srvs::Empty::Request& req,
   }
   boost::recursive_mutex::scoped_lock gl(configuration_mutex_);
   ROS_INFO("Initializing with uniform distribution");
-  pf_init_model(pf_, (pf_init_model_fn_t)MCL::uniformPoseGenerator,
-                (void *)map_);
+  initUniformModel();
 
   ROS_INFO("Global initialisation done!");
   pf_init_ = false;
@@ -862,21 +1071,34 @@ MCL<D>::getOdomPose(tf::Stamped<tf::Pose>& odom_pose,
   return true;
 }
 
+template<class D>
+void
+MCL<D>::initUniformModel()
+{
+  pf_sample_set_t* set = pf_->sets + pf_->current_set;
+  set->sample_count = pf_->max_samples;
+  std::vector<pf_vector_t> poses(set->sample_count);
+  free_space_.samplePoses(random_.next(RandomStreams::INITIAL), set->sample_count, poses.data());
+  for(int i = 0 ; i < set->sample_count ; ++i)
+  {
+    set->samples[i].pose = poses[i];
+    set->samples[i].weight = 1.0 / set->sample_count;
+  }
+  pf_->w_slow = pf_->w_fast = 0.0;
+  pf_cluster_stats_parallel(set);
+  heaviest_cluster_first_ = true;
+  pf_init_converged(pf_);
+}
+
 template<class D>
 pf_vector_t
 MCL<D>::uniformPoseGenerator(void* arg)
 {
-  map_t* map = (map_t*)arg;
+  const FreeSpaceIndex* free_space = (const FreeSpaceIndex*)arg;
 #if NEW_UNIFORM_SAMPLING
-  //unsigned int rand_index = drand48() * MCL::free_space_indices.size();
-  unsigned int rand_index = MCL::rng_.uniform01() * MCL::free_space_indices.size();
-  std::pair<int,int> free_point = MCL::free_space_indices[rand_index];
-  pf_vector_t p;
-  p.v[0] = MAP_WXGX(map, free_point.first);
-  p.v[1] = MAP_WYGY(map, free_point.second);
-  //p.v[2] = drand48() * 2 * M_PI - M_PI;
-  p.v[2] = MCL::rng_.uniform01() * 2 * M_PI - M_PI;
+  pf_vector_t p = free_space->samplePose(RandomStreams::bound());
 #else
+  const map_t* map = free_space->map();
   double min_x, max_x, min_y, max_y;
 
   min_x = (map->size_x * map->scale)/2.0 - map->origin_x;
@@ -892,9 +1114,10 @@ MCL<D>::uniformPoseGenerator(void* arg)
     /*p.v[0] = min_x + drand48() * (max_x - min_x);
     p.v[1] = min_y + drand48() * (max_y - min_y);
     p.v[2] = drand48() * 2 * M_PI - M_PI;*/
-    p.v[0] = min_x + MCL::rng_.uniform01() * (max_x - min_x);
-    p.v[1] = min_y + MCL::rng_.uniform01() * (max_y - min_y);
-    p.v[2] = MCL::rng_.uniform01() * 2 * M_PI - M_PI;
+    Philox4x32& rng = RandomStreams::bound();
+    p.v[0] = min_x + rng.uniform01() * (max_x - min_x);
+    p.v[1] = min_y + rng.uniform01() * (max_y - min_y);
+    p.v[2] = rng.uniform01() * 2 * M_PI - M_PI;
     // Check that it's a free cell
     int i,j;
     i = MAP_GXWX(map, p.v[0]);
@@ -961,5 +1184,531 @@ MCL<D>::createLaserData(int laser_index, amcl::AMCLLaserData& ldata, const senso
     ldata.ranges[i][1] = angle_min +
             (i * angle_increment);
   }
+  //the models stride over the beams they are given, so keeping only the selected ones in place applies the selection
+  if(beam_selection_ != BEAM_SELECTION_STRIDE && ldata.range_count > max_beams_ &&
+     static_cast<D*>(this)->beamSelectionSupported())
+  {
+    //the beam model leaves occ_dist empty unless free_space_dt_weight asked for the distance map
+    beam_selection_t selection = beam_selection_;
+    if(selection == BEAM_SELECTION_INFORMATION && distance_map_max_dist_ < 0)
+    {
+      ROS_WARN_ONCE("information beam selection needs the distance map of the likelihood field models; using stratified");
+      selection = BEAM_SELECTION_STRATIFIED;
+    }
+    Philox4x32 rng = random_.next(RandomStreams::BEAMS);
+    //cast from the filter mean of the last update
+    pf_vector_t pose = pf_vector_coord_add(lasers_[laser_index]->laser_pose, pf_->sets[pf_->current_set].mean);
+    const std::vector<int>& beams = beam_selector_.select(selection, ldata.ranges, ldata.range_count,
+                                                          max_beams_, map_, pose, rng);
+    for(size_t k = 0 ; k < beams.size() ; ++k)
+    {
+      ldata.ranges[k][0] = ldata.ranges[beams[k]][0];
+      ldata.ranges[k][1] = ldata.ranges[beams[k]][1];
+    }
+    ldata.range_count = beams.size();
+  }
+}
+
+
+template<class D>
+int
+MCL<D>::laserIndex(const sensor_msgs::LaserScanConstPtr& laser_scan)
+{
+  // Do we have the base->base_laser Tx yet?
+  std::map<std::string, int>::const_iterator it = frame_to_laser_.find(laser_scan->header.frame_id);
+  if(it != frame_to_laser_.end())
+    return it->second;
+
+  ROS_DEBUG("Setting up laser %d (frame_id=%s)", (int)frame_to_laser_.size(), laser_scan->header.frame_id.c_str());
+  tf::Stamped<tf::Pose> ident (tf::Transform(tf::createIdentityQuaternion(),
+                                           tf::Vector3(0,0,0)),
+                               ros::Time(), laser_scan->header.frame_id);
+  tf::Stamped<tf::Pose> laser_pose;
+  try
+  {
+    this->tf_->transformPose(base_frame_id_, ident, laser_pose);
+  }
+  catch(tf::TransformException& e)
+  {
+    ROS_ERROR("Couldn't transform from %s to %s, "
+              "even though the message notifier is in use",
+              laser_scan->header.frame_id.c_str(),
+              base_frame_id_.c_str());
+    return -1;
+  }
+
+  int laser_index = frame_to_laser_.size();
+  lasers_.push_back(new amcl::AMCLLaser(*laser_));
+  lasers_update_.push_back(true);
+  pf_vector_t laser_pose_v;
+  laser_pose_v.v[0] = laser_pose.getOrigin().x();
+  laser_pose_v.v[1] = laser_pose.getOrigin().y();
+  // laser mounting angle gets computed later -> set to 0 here!
+  laser_pose_v.v[2] = 0;
+  lasers_[laser_index]->SetLaserPose(laser_pose_v);
+  ROS_DEBUG("Received laser's pose wrt robot: %.3f %.3f %.3f",
+            laser_pose_v.v[0],
+            laser_pose_v.v[1],
+            laser_pose_v.v[2]);
+
+  frame_to_laser_[laser_scan->header.frame_id] = laser_index;
+  return laser_index;
+}
+
+template<class D>
+void
+MCL<D>::laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan)
+{
+  last_laser_received_ts_ = ros::Time::now();
+  if( map_ == NULL ) {
+    return;
+  }
+  boost::recursive_mutex::scoped_lock lr(configuration_mutex_);
+  int laser_index = laserIndex(laser_scan);
+  if(laser_index < 0)
+    return;
+  if(fusion_window_ <= ros::Duration(0))
+  {
+    updateFilter(laser_index, laser_scan, NULL);
+    return;
+  }
+  if(!static_cast<D*>(this)->fusionSupported())
+  {
+    ROS_WARN_ONCE("laser_fusion_window is ignored, this filter weights every scan on its own");
+    updateFilter(laser_index, laser_scan, NULL);
+    return;
+  }
+  //a second scan of a laser, or one later than the window allows, closes the window without it
+  fusion_scans_.resize(lasers_.size());
+  if(fusion_count_ > 0 &&
+     (fusion_scans_[laser_index] != NULL || laser_scan->header.stamp - fusion_start_ > fusion_window_))
+    flushFusionWindow();
+  if(fusion_count_ == 0)
+    fusion_start_ = laser_scan->header.stamp;
+  fusion_scans_[laser_index] = laser_scan;
+  //the window is complete once every laser known so far delivered its scan
+  if(++fusion_count_ == (int)lasers_.size())
+    flushFusionWindow();
+}
+
+template<class D>
+bool
+MCL<D>::updatePending(int laser_index, const std::vector<sensor_msgs::LaserScanConstPtr>* window) const
+{
+  if(lasers_update_[laser_index])
+    return true;
+  if(window)
+    for(size_t i = 0 ; i < window->size() ; ++i)
+      if((*window)[i] != NULL && lasers_update_[i])
+        return true;
+  return false;
 }
 
+template<class D>
+void
+MCL<D>::flushFusionWindow()
+{
+  int latest = -1;
+  for(size_t i = 0 ; i < fusion_scans_.size() ; ++i)
+    if(fusion_scans_[i] != NULL &&
+       (latest < 0 || fusion_scans_[i]->header.stamp > fusion_scans_[latest]->header.stamp))
+      latest = i;
+  if(latest >= 0)
+    updateFilter(latest, fusion_scans_[latest], &fusion_scans_);
+  for(size_t i = 0 ; i < fusion_scans_.size() ; ++i)
+    fusion_scans_[i].reset();
+  fusion_count_ = 0;
+}
+
+template<class D>
+void
+MCL<D>::updateFilter(int laser_index, const sensor_msgs::LaserScanConstPtr& laser_scan,
+                     const std::vector<sensor_msgs::LaserScanConstPtr>* window)
+{
+  D* derived = static_cast<D*>(this);
+  const ros::Time& stamp = laser_scan->header.stamp;
+
+  // Where was the robot when this scan was taken?
+  pf_vector_t pose;
+  if(!getOdomPose(latest_odom_pose_, pose.v[0], pose.v[1], pose.v[2],
+                  stamp, base_frame_id_))
+  {
+    ROS_ERROR("Couldn't determine robot's pose associated with laser scan");
+    return;
+  }
+
+  pf_vector_t delta = pf_vector_zero();
+
+  if(pf_init_)
+  {
+    // Compute change in pose
+    delta.v[0] = pose.v[0] - pf_odom_pose_.v[0];
+    delta.v[1] = pose.v[1] - pf_odom_pose_.v[1];
+    delta.v[2] = angle_diff(pose.v[2], pf_odom_pose_.v[2]);
+
+    // See if we should update the filter
+    bool update = fabs(delta.v[0]) > d_thresh_ ||
+                  fabs(delta.v[1]) > d_thresh_ ||
+                  fabs(delta.v[2]) > a_thresh_;
+    update = update || m_force_update;
+    m_force_update=false;
+
+    // Set the laser update flags
+    if(update)
+      for(unsigned int i=0; i < lasers_update_.size(); i++)
+        lasers_update_[i] = true;
+  }
+
+  bool force_publication = false;
+  if(!pf_init_)
+  {
+    // Pose at last filter update
+    pf_odom_pose_ = pose;
+
+    // Filter is now initialized
+    pf_init_ = true;
+
+    // Should update sensor data
+    for(unsigned int i=0; i < lasers_update_.size(); i++)
+      lasers_update_[i] = true;
+
+    force_publication = true;
+
+    resample_count_ = 0;
+
+    derived->initialStage();
+  }
+  // If the robot has moved, update the filter
+  else if(updatePending(laser_index, window))
+  {
+    amcl::AMCLOdomData odata;
+    odata.pose = pose;
+    // HACK
+    // Modify the delta in the action data so the filter gets
+    // updated correctly
+    odata.delta = delta;
+
+    // Use the action data to update the filter
+    derived->motionStage(odata);
+  }
+
+  bool resampled = false;
+  // If the robot has moved, update the filter
+  if(updatePending(laser_index, window))
+  {
+    if(window)
+    {
+      //built in place, amcl::AMCLLaserData owns its ranges and cannot be copied
+      std::deque<amcl::AMCLLaserData> ldatas;
+      std::vector<amcl::AMCLLaserData*> fused;
+      for(size_t i = 0 ; i < window->size() ; ++i)
+      {
+        if((*window)[i] == NULL)
+          continue;
+        ldatas.emplace_back();
+        createLaserData(i, ldatas.back(), (*window)[i]);
+        fused.push_back(&ldatas.back());
+        lasers_update_[i] = false;
+      }
+      derived->fusedSensorStage(fused, stamp);
+    }
+    else
+    {
+      amcl::AMCLLaserData ldata;
+      createLaserData(laser_index, ldata, laser_scan);
+      derived->sensorStage(ldata, stamp);
+    }
+
+    lasers_update_[laser_index] = false;
+
+    pf_odom_pose_ = pose;
+
+    // Resample the particles
+    resampled = derived->resampleStage(stamp, force_publication);
+    ROS_DEBUG("Num samples: %d", pf_->sets[pf_->current_set].sample_count);
+
+    // Publish the resulting cloud
+    if (!m_force_update)
+      publishParticleCloud(particlecloud_pub_, global_frame_id_, stamp, pf_);
+  }
+  else
+    resampled = derived->staticStage(laser_index, laser_scan);
+
+  publishHypotheses(stamp, resampled || force_publication);
+}
+
+template<class D>
+void
+MCL<D>::sensorStage(amcl::AMCLLaserData& ldata, const ros::Time& stamp)
+{
+  const BoundedLikelihoodField* bounded = boundedLikelihood(ldata);
+  if(!bounded)
+  {
+    double total = ldata.sensor->UpdateSensor(pf_, (amcl::AMCLSensorData*)&ldata);
+    double w_avg = pf_normalize_ess(pf_, total, &ess_);
+    pf_update_augmented_weight(pf_, w_avg);
+    return;
+  }
+  pf_sample_set_t* set = pf_->sets + pf_->current_set;
+  const int count = set->sample_count;
+  log_weight_.resize(count);
+  //the best log weight is taken from samples spread over the set and evaluated in full first, so that
+  //the bound does not depend on which thread finishes first and a run replays the same weights
+  const int stride = std::max(1, count/64);
+  double best = -std::numeric_limits<double>::infinity();
+  for(int i = 0 ; i < count ; i += stride)
+  {
+    log_weight_[i] = log(set->samples[i].weight) + bounded->logLikelihood(set->samples[i].pose, -std::numeric_limits<double>::infinity());
+    best = std::max(best, log_weight_[i]);
+  }
+  //a sample stopped below best - margin shares exp(-margin) of the best weight with the other stopped ones,
+  //whatever beam it stopped at, so that the pruned tail cannot outweigh the samples evaluated in full
+  const double log_bound = best - termination_margin_;
+  const double log_floor = log_bound - log((double)count);
+  auto worker = [&](int beg, int end)
+  {
+    for(int i = beg ; i < end ; ++i)
+    {
+      if(i % stride == 0)
+        continue;
+      double log_prior = log(set->samples[i].weight);
+      bool complete;
+      double log_likelihood = bounded->logLikelihood(set->samples[i].pose, log_bound - log_prior, &complete);
+      //a zero prior stops at once and stays out of the set
+      log_weight_[i] = complete || log_prior == -std::numeric_limits<double>::infinity() ? log_prior + log_likelihood : log_floor;
+    }
+  };
+  parallelFor(count, worker);
+  applyLogWeights();
+}
+
+template<class D>
+const BoundedLikelihoodField*
+MCL<D>::boundedLikelihood(amcl::AMCLLaserData& ldata)
+{
+  if(termination_margin_ < 0 || laser_model_type_ != amcl::LASER_MODEL_LIKELIHOOD_FIELD)
+    return NULL;
+  bounded_likelihood_.setScan(&ldata);
+  return &bounded_likelihood_;
+}
+
+template<class D>
+void
+MCL<D>::fusedSensorStage(std::vector<amcl::AMCLLaserData*>& ldatas, const ros::Time& stamp)
+{
+  pf_sample_set_t* set = pf_->sets + pf_->current_set;
+  const int count = set->sample_count;
+  log_weight_.resize(count);
+  //beam skipping keeps per-sample scratch inside the laser model, which cannot be shared by threads
+  bool parallel = !(laser_model_type_ == amcl::LASER_MODEL_LIKELIHOOD_FIELD_PROB && do_beamskip_);
+  //every range of samples is weighted by all scans while it is in cache, the log-likelihoods are summed
+  //because the models overwrite the weight of a sample
+  auto worker = [&](int beg, int end)
+  {
+    for(int i = beg ; i < end ; ++i)
+      log_weight_[i] = log(set->samples[i].weight);
+    pf_sample_set_t view = *set;
+    view.samples = set->samples + beg;
+    view.sample_count = end - beg;
+    for(size_t l = 0 ; l < ldatas.size() ; ++l)
+    {
+      ((amcl::AMCLLaser*)ldatas[l]->sensor)->UpdateSensorWithSet(&view, ldatas[l]);
+      for(int i = beg ; i < end ; ++i)
+        log_weight_[i] += set->samples[i].logLikelihood;
+    }
+  };
+  if(parallel)
+    parallelFor(count, worker);
+  else
+    worker(0, count);
+  applyLogWeights();
+}
+
+template<class D>
+void
+MCL<D>::applyLogWeights()
+{
+  pf_sample_set_t* set = pf_->sets + pf_->current_set;
+  const int count = set->sample_count;
+  //the log-domain normalization shared with the filters that weight in the log domain themselves,
+  //products of many beams or scans do not underflow there
+  for(int i = 0 ; i < count ; ++i)
+    set->samples[i].logWeight = log_weight_[i];
+  double log_total = pf_normalize_log_weights(set, &ess_);
+  //the average weight of the unscaled product drives the recovery
+  pf_update_augmented_weight(pf_, count > 0 ? exp(log_total)/count : 0.0);
+}
+
+template<class D>
+bool
+MCL<D>::resampleStage(const ros::Time& stamp, bool initial)
+{
+  if(!(resampleRequired(stamp) ||
+       (initial && !sent_first_transform_ && static_cast<D*>(this)->resampleInitialUpdate())))
+    return false;
+  if(resample_function_ == &pf_update_resample)
+  {
+    //augmented resampling draws from drand48 and only its injected poses come from the bound generator
+    RandomStreams::Scope scope(random_, RandomStreams::RECOVERY);
+    Drand48Stream::Lock l(drand48_);
+    resample_function_(pf_);
+  }
+  else
+  {
+    RandomStreams::Scope scope(random_, RandomStreams::RESAMPLE);
+    resample_function_(pf_);
+  }
+  heaviest_cluster_first_ = resample_function_ != &pf_update_resample;
+  return true;
+}
+
+template<class D>
+void
+MCL<D>::publishHypotheses(const ros::Time& stamp, bool updated)
+{
+  if(updated)
+  {
+    // Read out the current hypotheses
+    pf_sample_set_t* set = pf_->sets + pf_->current_set;
+    int max_weight_hyp = 0;
+    if(!heaviest_cluster_first_)
+      for(int hyp_count = 1; hyp_count < set->cluster_count; hyp_count++)
+        if(set->clusters[hyp_count].weight > set->clusters[max_weight_hyp].weight)
+          max_weight_hyp = hyp_count;
+
+    if(set->cluster_count == 0 || set->clusters[max_weight_hyp].weight <= 0.0)
+    {
+      ROS_ERROR("No pose!");
+      return;
+    }
+    const pf_vector_t& best = set->clusters[max_weight_hyp].mean;
+    ROS_DEBUG("Max weight pose: %.3f %.3f %.3f", best.v[0], best.v[1], best.v[2]);
+
+    //filled in place, only the entries written below are ever non zero
+    geometry_msgs::PoseWithCovarianceStamped& p = last_published_pose;
+    // Fill in the header
+    p.header.frame_id = global_frame_id_;
+    p.header.stamp = stamp;
+    // Copy in the pose
+    p.pose.pose.position.x = best.v[0];
+    p.pose.pose.position.y = best.v[1];
+    tf::quaternionTFToMsg(tf::createQuaternionFromYaw(best.v[2]),
+                          p.pose.pose.orientation);
+    // Copy in the covariance, converting from 3-D to 6-D
+    // Report the overall filter covariance, rather than the
+    // covariance for the highest-weight cluster
+    for(int i=0; i<2; i++)
+      for(int j=0; j<2; j++)
+        p.pose.covariance[6*i+j] = set->cov.m[i][j];
+    p.pose.covariance[6*5+5] = set->cov.m[2][2];
+    pose_pub_.publish(p);
+    if(hypotheses_count_ > 0)
+      publishTopHypotheses(stamp);
+
+    ROS_DEBUG("New pose: %6.3f %6.3f %6.3f", best.v[0], best.v[1], best.v[2]);
+
+    // subtracting base to odom from map to base and send map to odom instead
+    tf::Stamped<tf::Pose> odom_to_map;
+    try
+    {
+      tf::Transform tmp_tf(tf::createQuaternionFromYaw(best.v[2]),
+                           tf::Vector3(best.v[0], best.v[1], 0.0));
+      tf::Stamped<tf::Pose> tmp_tf_stamped (tmp_tf.inverse(),
+                                            stamp,
+                                            base_frame_id_);
+      this->tf_->transformPose(odom_frame_id_,
+                               tmp_tf_stamped,
+                               odom_to_map);
+    }
+    catch(tf::TransformException)
+    {
+      ROS_DEBUG("Failed to subtract base to odom transform");
+      return;
+    }
+
+    latest_tf_ = tf::Transform(tf::Quaternion(odom_to_map.getRotation()),
+                               tf::Point(odom_to_map.getOrigin()));
+    latest_tf_valid_ = true;
+
+    if (tf_broadcast_ == true)
+    {
+      // We want to send a transform that is good up until a
+      // tolerance time so that odom can be used
+      ros::Time transform_expiration = (stamp + transform_tolerance_);
+      tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
+                                          transform_expiration,
+                                          global_frame_id_, odom_frame_id_);
+      this->tfb_->sendTransform(tmp_tf_stamped);
+      sent_first_transform_ = true;
+    }
+  }
+  else if(latest_tf_valid_)
+  {
+    if (tf_broadcast_ == true)
+    {
+      // Nothing changed, so we'll just republish the last transform, to keep
+      // everybody happy.
+      ros::Time transform_expiration = (stamp + transform_tolerance_);
+      tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
+                                          transform_expiration,
+                                          global_frame_id_, odom_frame_id_);
+      this->tfb_->sendTransform(tmp_tf_stamped);
+    }
+
+    // Is it time to save our last pose to the param server
+    ros::Time now = ros::Time::now();
+    if((save_pose_period.toSec() > 0.0) &&
+       (now - save_pose_last_time) >= save_pose_period)
+    {
+      this->savePoseToServer();
+      save_pose_last_time = now;
+    }
+  }
+}
+
+template<class D>
+void
+MCL<D>::publishTopHypotheses(const ros::Time& stamp)
+{
+  const int columns = 8;
+  pf_sample_set_t* set = pf_->sets + pf_->current_set;
+  if((int)hyps_.size() < set->cluster_max_count)
+    hyps_.resize(set->cluster_max_count);
+  for(int i = 0 ; i < set->cluster_count ; ++i)
+  {
+    hyps_[i].weight = set->clusters[i].weight;
+    hyps_[i].pf_pose_mean = set->clusters[i].mean;
+    hyps_[i].pf_pose_cov = set->clusters[i].cov;
+  }
+  int count = std::min(hypotheses_count_, set->cluster_count);
+  hyp_order_.resize(set->cluster_count);
+  for(size_t i = 0 ; i < hyp_order_.size() ; ++i)
+    hyp_order_[i] = i;
+  std::partial_sort(hyp_order_.begin(), hyp_order_.begin() + count, hyp_order_.end(),
+                    [this](int a, int b){ return hyps_[a].weight > hyps_[b].weight; });
+  stamped_std_msgs::StampedFloat64MultiArray& msg = hypotheses_msg_;
+  msg.header.frame_id = global_frame_id_;
+  msg.header.stamp = stamp;
+  msg.array.layout.dim.resize(2);
+  msg.array.layout.dim[0].label = "hypothesis";
+  msg.array.layout.dim[0].size = count;
+  msg.array.layout.dim[0].stride = count * columns;
+  msg.array.layout.dim[1].label = "wxyawcov";
+  msg.array.layout.dim[1].size = columns;
+  msg.array.layout.dim[1].stride = columns;
+  msg.array.data.resize(count * columns);
+  for(int k = 0 ; k < count ; ++k)
+  {
+    const amcl_hyp_t& hyp = hyps_[hyp_order_[k]];
+    double* row = &msg.array.data[k * columns];
+    row[0] = hyp.weight;
+    row[1] = hyp.pf_pose_mean.v[0];
+    row[2] = hyp.pf_pose_mean.v[1];
+    row[3] = hyp.pf_pose_mean.v[2];
+    row[4] = hyp.pf_pose_cov.m[0][0];
+    row[5] = hyp.pf_pose_cov.m[0][1];
+    row[6] = hyp.pf_pose_cov.m[1][1];
+    row[7] = hyp.pf_pose_cov.m[2][2];
+  }
+  hypotheses_pub_.publish(msg);
+}
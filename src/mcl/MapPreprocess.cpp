@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "mcl/MapPreprocess.h"
+#include "mcl/parallel.h"
+
+//on-disk layout: header, then occ_dist[size_x*size_y] as float
+typedef struct
+{
+  char magic[8];
+  uint64_t hash;
+  int32_t size_x;
+  int32_t size_y;
+  double max_occ_dist;
+} distance_map_header_t;
+
+static const char distance_map_magic[8] = {'M','A','P','D','T','0','1','\0'};
+//distance maps of this process, the most recent at the back
+typedef struct
+{
+  distance_map_header_t header;
+  std::shared_ptr<const std::vector<float> > dist;
+} distance_map_entry_t;
+static std::mutex memory_cache_mutex;
+static std::deque<distance_map_entry_t> memory_cache;
+static int memory_cache_entries = 0;
+
+//squared distance of cells without any occupied cell in reach, finite so that the parabolas stay well defined
+static const double edt_far = 1e20;
+
+uint64_t mapHash(const map_t* map, const double* params, int count)
+{
+  uint64_t h = 1469598103934665603ULL;
+  auto mix = [&h](const void* data, size_t size)
+  {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for(size_t i = 0 ; i < size ; ++i)
+    {
+      h ^= bytes[i];
+      h *= 1099511628211ULL;
+    }
+  };
+  mix(&map->size_x, sizeof(map->size_x));
+  mix(&map->size_y, sizeof(map->size_y));
+  mix(&map->scale, sizeof(map->scale));
+  mix(&map->origin_x, sizeof(map->origin_x));
+  mix(&map->origin_y, sizeof(map->origin_y));
+  for(int k = 0 ; k < count ; ++k)
+    mix(params + k, sizeof(double));
+  for(int i = 0 ; i < map->size_x*map->size_y ; ++i)
+  {
+    signed char occ = map->cells[i].occ_state;
+    mix(&occ, 1);
+  }
+  return h;
+}
+
+void convertOccupancy(const int8_t* data, map_t* map)
+{
+  parallelFor(map->size_x*map->size_y, [&](int beg, int end)
+  {
+    for(int i = beg ; i < end ; ++i)
+    {
+      if(data[i] == 0)
+        map->cells[i].occ_state = -1;
+      else if(data[i] == 100)
+        map->cells[i].occ_state = +1;
+      else
+        map->cells[i].occ_state = 0;
+    }
+  });
+}
+
+//squared distance transform of the sampled function f of length n, the lower envelope of parabolas
+static void distanceTransform1D(const double* f, int n, double* d, int* v, double* z)
+{
+  int k = 0;
+  v[0] = 0;
+  z[0] = -edt_far*n;
+  z[1] = edt_far*n;
+  for(int q = 1 ; q < n ; ++q)
+  {
+    double s = ((f[q] + (double)q*q) - (f[v[k]] + (double)v[k]*v[k])) / (2.0*q - 2.0*v[k]);
+    while(s <= z[k])
+    {
+      --k;
+      s = ((f[q] + (double)q*q) - (f[v[k]] + (double)v[k]*v[k])) / (2.0*q - 2.0*v[k]);
+    }
+    ++k;
+    v[k] = q;
+    z[k] = s;
+    z[k+1] = edt_far*n;
+  }
+  k = 0;
+  for(int q = 0 ; q < n ; ++q)
+  {
+    while(z[k+1] < q)
+      ++k;
+    d[q] = (double)(q - v[k])*(q - v[k]) + f[v[k]];
+  }
+}
+
+void distanceTransform(map_t* map, double max_occ_dist)
+{
+  int sx = map->size_x, sy = map->size_y;
+  int n = std::max(sx, sy);
+  std::vector<double> sq((size_t)sx*sy);
+  //columns, from the occupied cells
+  parallelFor(sx, [&](int beg, int end)
+  {
+    std::vector<double> f(n), d(n), z(n+1);
+    std::vector<int> v(n);
+    for(int i = beg ; i < end ; ++i)
+    {
+      for(int j = 0 ; j < sy ; ++j)
+        f[j] = map->cells[MAP_INDEX(map, i, j)].occ_state == +1 ? 0.0 : edt_far;
+      distanceTransform1D(f.data(), sy, d.data(), v.data(), z.data());
+      for(int j = 0 ; j < sy ; ++j)
+        sq[MAP_INDEX(map, i, j)] = d[j];
+    }
+  });
+  //rows, from the column distances
+  double max_sq = (max_occ_dist/map->scale)*(max_occ_dist/map->scale);
+  parallelFor(sy, [&](int beg, int end)
+  {
+    std::vector<double> d(n), z(n+1);
+    std::vector<int> v(n);
+    for(int j = beg ; j < end ; ++j)
+    {
+      double* row = &sq[MAP_INDEX(map, 0, j)];
+      distanceTransform1D(row, sx, d.data(), v.data(), z.data());
+      for(int i = 0 ; i < sx ; ++i)
+        map->cells[MAP_INDEX(map, i, j)].occ_dist = d[i] < max_sq ? sqrt(d[i])*map->scale : max_occ_dist;
+    }
+  });
+  map->max_occ_dist = max_occ_dist;
+}
+
+void setDistanceMapMemoryCache(int entries)
+{
+  std::lock_guard<std::mutex> lock(memory_cache_mutex);
+  memory_cache_entries = std::max(entries, 0);
+  while((int)memory_cache.size() > memory_cache_entries)
+    memory_cache.pop_front();
+}
+
+static void copyDistanceMap(const std::vector<float>& dist, map_t* map)
+{
+  parallelFor(map->size_x*map->size_y, [&](int beg, int end)
+  {
+    for(int i = beg ; i < end ; ++i)
+      map->cells[i].occ_dist = dist[i];
+  });
+}
+
+bool updateDistanceMap(map_t* map, double max_occ_dist, const std::string& cache_dir)
+{
+  int size = map->size_x*map->size_y;
+  std::string path;
+  distance_map_header_t header;
+  memcpy(header.magic, distance_map_magic, sizeof(header.magic));
+  header.hash = mapHash(map, &max_occ_dist, 1);
+  header.size_x = map->size_x;
+  header.size_y = map->size_y;
+  header.max_occ_dist = max_occ_dist;
+  //held throughout, so that filters asking for the same map at once wait for the first one
+  std::unique_lock<std::mutex> lock(memory_cache_mutex, std::defer_lock);
+  if(memory_cache_entries > 0)
+  {
+    lock.lock();
+    for(auto it = memory_cache.begin() ; it != memory_cache.end() ; ++it)
+      if(memcmp(&it->header, &header, sizeof(header)) == 0)
+      {
+        copyDistanceMap(*it->dist, map);
+        map->max_occ_dist = max_occ_dist;
+        return true;
+      }
+  }
+  bool keep = lock.owns_lock() || !cache_dir.empty();
+  std::shared_ptr<std::vector<float> > dist = std::make_shared<std::vector<float> >(keep ? size : 0);
+  bool cached = false;
+  if(!cache_dir.empty())
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "/distance_map_%016llx.bin", (unsigned long long)header.hash);
+    path = cache_dir + name;
+    FILE* file = fopen(path.c_str(), "rb");
+    if(file)
+    {
+      distance_map_header_t on_disk;
+      cached = fread(&on_disk, sizeof(on_disk), 1, file) == 1 &&
+               memcmp(&on_disk, &header, sizeof(header)) == 0 &&
+               fread(dist->data(), sizeof(float), size, file) == (size_t)size;
+      fclose(file);
+    }
+  }
+  if(cached)
+  {
+    copyDistanceMap(*dist, map);
+    map->max_occ_dist = max_occ_dist;
+  }
+  else
+  {
+    distanceTransform(map, max_occ_dist);
+    if(keep)
+      for(int i = 0 ; i < size ; ++i)
+        (*dist)[i] = map->cells[i].occ_dist;
+    if(!path.empty())
+    {
+      FILE* file = fopen(path.c_str(), "wb");
+      if(file)
+      {
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(dist->data(), sizeof(float), size, file) == (size_t)size;
+        fclose(file);
+        if(!ok)
+          remove(path.c_str());
+      }
+    }
+  }
+  if(lock.owns_lock())
+  {
+    distance_map_entry_t entry;
+    entry.header = header;
+    entry.dist = dist;
+    memory_cache.push_back(entry);
+    if((int)memory_cache.size() > memory_cache_entries)
+      memory_cache.pop_front();
+  }
+  return cached;
+}
@@ -38,6 +38,10 @@ main(int argc, char** argv)
   {
     mixmcl_node_ptr->runFromBag(argv[2]);
   }
+  else if ((argc == 3) && (std::string(argv[1]) == "--run-from-bag-fast"))
+  {
+    mixmcl_node_ptr->runFromBagFast(argv[2]);
+  }
 
   // Without this, our boost locks are not shut down nicely
   mixmcl_node_ptr.reset();
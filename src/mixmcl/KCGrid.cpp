@@ -1,3 +1,4 @@
+#include <algorithm>
 #include "mixmcl/KCGrid.h"
 
 using namespace boost;
@@ -221,6 +222,7 @@ void KCGrid::convert(map<string, any>& m, double loch, double orih)
           make_pair(
             idx, TreeMap::mapped_type(new nuklei::KernelCollection)));
       tree_map_.at(idx)->add(k);
+      cells_[idx].poses.push_back(p);
     }
   else
     while(datain_ptr_->readALine(p, f))
@@ -244,6 +246,7 @@ void KCGrid::convert(map<string, any>& m, double loch, double orih)
           make_pair(
             idx, TreeMap::mapped_type(new nuklei::KernelCollection)));
       tree_map_.at(idx)->add(k);
+      cells_[idx].poses.push_back(p);
     }
 
 
@@ -257,6 +260,18 @@ void KCGrid::convert(map<string, any>& m, double loch, double orih)
     throw ios_base::failure(ss.str());
   }
 
+  //every kernel has weight 1 before normalization
+  loch_ = loch;
+  orih_ = orih;
+  for(auto& cell : cells_)
+  {
+    std::vector<double>& c = cell.second.c;
+    c.resize(cell.second.poses.size() + 1);
+    c[0] = 0.0;
+    for(size_t i = 0 ; i < cell.second.poses.size() ; ++i)
+      c[i+1] = c[i] + 1.0;
+  }
+
   data_matrix_.reset( new float[3*tree_map_.size()]);
   float* temp_ptr = data_matrix_.get();
   vector<size_t> temp_vec;
@@ -301,6 +316,34 @@ void KCGrid::convert(map<string, any>& m, double loch, double orih)
   flann_index_->buildIndex();
 }
 
+void KCGrid::samplePoses(size_t cell, const Philox4x32& streams, int count, pf_vector_t* poses) const
+{
+  const kernel_cell_t& kernels = cells_.at(cell);
+  const int n = kernels.poses.size();
+  const double* c = kernels.c.data();
+  const double step = c[n]/count;
+  parallelFor(count, [&](int beg, int end)
+  {
+    for(int i = beg ; i < end ; ++i)
+    {
+      //one stratum, two location offsets and a heading offset per pose
+      Philox4x32::Block r0 = streams.block(i, 0);
+      Philox4x32::Block r1 = streams.block(i, 1);
+      double u = (i + Philox4x32::toUniform(r0.v[0]))*step;
+      int k = std::upper_bound(c, c + n + 1, u) - c - 1;
+      k = std::min(std::max(k, 0), n - 1);
+      double gx, gy, ga, unused;
+      Philox4x32::toGaussians(r0.v[1], r0.v[2], gx, gy);
+      Philox4x32::toGaussians(r1.v[0], r1.v[1], ga, unused);
+      const pf_vector_t& mean = kernels.poses[k];
+      poses[i].v[0] = mean.v[0] + loch_*gx;
+      poses[i].v[1] = mean.v[1] + loch_*gy;
+      double a = mean.v[2] + orih_*ga;
+      poses[i].v[2] = a - 2*M_PI*floor((a + M_PI)/(2*M_PI));
+    }
+  });
+}
+
 size_t KCGrid::nnSearch(float x, float y, float d)
 {
   nnSearch(x, y, d, std::cout);
@@ -83,18 +83,23 @@ SamplingNode::sampling()
   //uniformly generate a Pose
   pf_vector_t rpose;
   if(!brute_force_)
-    rpose = MCL::uniformPoseGenerator((void*)map_);
+  {
+    if(pose_batch_.empty())
+    {
+      pose_batch_.resize(std::max(1, std::min(1024, max_data_count_ - data_count_)));
+      free_space_.samplePoses(random_.next(RandomStreams::SAMPLING), pose_batch_.size(), pose_batch_.data());
+    }
+    rpose = pose_batch_.back();
+    pose_batch_.pop_back();
+  }
   else
   {
     if((data_count_ % 10) == 0)
     {
-      space_idx_++;// = space_idx_ % MCL::free_space_indices.size();
+      space_idx_++;// = space_idx_ % free_space_.size();
     }
-    std::pair<int,int> free_point = MCL::free_space_indices[space_idx_-1];
-    ROS_DEBUG("space index: %d, map coord: [%d %d], free space size: %ld", space_idx_-1, free_point.first, free_point.second,MCL::free_space_indices.size());
-    rpose.v[0] = MAP_WXGX(map_, free_point.first);
-    rpose.v[1] = MAP_WYGY(map_, free_point.second);
-    rpose.v[2] = ((data_count_ % 10)/10.0)*2*M_PI - M_PI;
+    ROS_DEBUG("space index: %d, map coord: [%d %d], free space size: %d", space_idx_-1, free_space_.cellX(space_idx_-1), free_space_.cellY(space_idx_-1), free_space_.size());
+    rpose = free_space_.pose(space_idx_-1, ((data_count_ % 10)/10.0)*2*M_PI - M_PI);
   }
   // 2. ray-casting
   amcl::AMCLLaserData ldata;
@@ -175,13 +180,13 @@ SamplingNode::sampling()
     slms100_pub_.publish(laser_scan);
   }
   if( (!brute_force_ && data_count_ >= max_data_count_ ) 
-      || ( brute_force_ && space_idx_ > free_space_indices.size()/* || data_count_ >= 10000*/ ) ) 
+      || ( brute_force_ && space_idx_ > (unsigned int)free_space_.size()/* || data_count_ >= 10000*/ ) ) 
     ros::shutdown();
   else
   {
     double progress;
     if(brute_force_)
-      progress = (space_idx_-1.0)/((double)free_space_indices.size());
+      progress = (space_idx_-1.0)/((double)free_space_.size());
     else
       progress = ((double)data_count_) / ((double)max_data_count_);
     if(data_count_%10000 == 0 )
@@ -200,34 +205,9 @@ SamplingNode::laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan)
     if( map_ == NULL ) {
       return;
     }
-    int laser_index = -1;
-  
-    // Do we have the base->base_laser Tx yet?
+    //the sampler also needs the full base to laser transform of a new laser
     if(frame_to_laser_.find(laser_scan->header.frame_id) == frame_to_laser_.end())
     {
-      ROS_DEBUG("Setting up laser %d (frame_id=%s)\n", (int)frame_to_laser_.size(), laser_scan->header.frame_id.c_str());
-      lasers_.push_back(new amcl::AMCLLaser(*laser_));
-      lasers_update_.push_back(true);
-      laser_index = frame_to_laser_.size();
-  
-      tf::Stamped<tf::Pose> ident (tf::Transform(tf::createIdentityQuaternion(),
-                                               tf::Vector3(0,0,0)),
-                                   ros::Time(), laser_scan->header.frame_id);
-      tf::Stamped<tf::Pose> laser_pose;
-      try
-      {
-        this->tf_->transformPose(base_frame_id_, ident, laser_pose);
-        //TODO publish this transform from sbase to slms100
-      }
-      catch(tf::TransformException& e)
-      {
-        ROS_ERROR("Couldn't transform from %s to %s, "
-                  "even though the message notifier is in use",
-                  laser_scan->header.frame_id.c_str(),
-                  base_frame_id_.c_str());
-        return;
-      }
-  
       try
       {
         this->tf_->lookupTransform(base_frame_id_, laser_scan->header.frame_id, ros::Time(0), tf_base_2_lms_);
@@ -240,83 +220,16 @@ SamplingNode::laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan)
                   base_frame_id_.c_str());
         return;
       }
-
-      pf_vector_t laser_pose_v;
-      laser_pose_v.v[0] = laser_pose.getOrigin().x();
-      laser_pose_v.v[1] = laser_pose.getOrigin().y();
-      // laser mounting angle gets computed later -> set to 0 here!
-      laser_pose_v.v[2] = 0;
-      lasers_[laser_index]->SetLaserPose(laser_pose_v);
-      ROS_DEBUG("Received laser's pose wrt robot: %.3f %.3f %.3f",
-                laser_pose_v.v[0],
-                laser_pose_v.v[1],
-                laser_pose_v.v[2]);
-  
-      frame_to_laser_[laser_scan->header.frame_id] = laser_index;
-    } else {
-      // we have the laser pose, retrieve laser index
-      laser_index = frame_to_laser_[laser_scan->header.frame_id];
     }
+    int laser_index = MCL::laserIndex(laser_scan);
+    if(laser_index < 0)
+      return;
   
     //convert laser_scan into LaserData
     amcl::AMCLLaserData ldata;
-    ldata.sensor = lasers_[laser_index];
-    ldata.range_count = laser_scan->ranges.size();
-    // To account for lasers that are mounted upside-down, we determine the
-    // min, max, and increment angles of the laser in the base frame.
-    //
-    // Construct min and max angles of laser, in the base_link frame.
-    tf::Quaternion q;
-    q.setRPY(0.0, 0.0, laser_scan->angle_min);
-    tf::Stamped<tf::Quaternion> min_q(q, laser_scan->header.stamp,
-                                      laser_scan->header.frame_id);
-    q.setRPY(0.0, 0.0, laser_scan->angle_min + laser_scan->angle_increment);
-    tf::Stamped<tf::Quaternion> inc_q(q, laser_scan->header.stamp,
-                                      laser_scan->header.frame_id);
-    try
-    {
-      tf_->transformQuaternion(base_frame_id_, min_q, min_q);
-      tf_->transformQuaternion(base_frame_id_, inc_q, inc_q);
-    }
-    catch(tf::TransformException& e)
-    {
-      ROS_WARN("Unable to transform min/max laser angles into base frame: %s",
-               e.what());
+    MCL::createLaserData(laser_index, ldata, laser_scan);
+    if(ldata.ranges == NULL)
       return;
-    }
-  
-    double angle_min = tf::getYaw(min_q);
-    double angle_increment = tf::getYaw(inc_q) - angle_min;
-  
-    // wrapping angle to [-pi .. pi]
-    angle_increment = fmod(angle_increment + 5*M_PI, 2*M_PI) - M_PI;
-    ROS_DEBUG("Laser %d angles in base frame: min: %.3f inc: %.3f", laser_index, angle_min, angle_increment);
-  
-    // Apply range min/max thresholds, if the user supplied them
-    if(laser_max_range_ > 0.0)
-      ldata.range_max = std::min(laser_scan->range_max, (float)laser_max_range_);
-    else
-      ldata.range_max = laser_scan->range_max;
-    double range_min;
-    if(laser_min_range_ > 0.0)
-      range_min = std::max(laser_scan->range_min, (float)laser_min_range_);
-    else
-      range_min = laser_scan->range_min;
-    // The AMCLLaserData destructor will free this memory
-    ldata.ranges = new double[ldata.range_count][2];
-    ROS_ASSERT(ldata.ranges);
-    for(int i=0;i<ldata.range_count;i++)
-    {
-      // amcl doesn't (yet) have a concept of min range.  So we'll map short
-      // readings to max range.
-      if(laser_scan->ranges[i] <= range_min)
-        ldata.ranges[i][0] = ldata.range_max;
-      else
-        ldata.ranges[i][0] = laser_scan->ranges[i];
-      // Compute bearing
-      ldata.ranges[i][1] = angle_min +
-              (i * angle_increment);
-    }
     //update parameters every single time because there is possibility for reconfiguration.
     lrnum = laser_scan->ranges.size();
     lrmin = laser_scan->range_min;
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+// roscpp
+#include "ros/ros.h"
+
+#include "amcl/AmclNode.h"
+#include "mixmcl/MixmclNode.h"
+#include "mcmcl/McmclNode.h"
+#include "aismcl/AismclNode.h"
+#include "markov/MarkovNode.h"
+#include "mcl/parallel.h"
+
+//Parameter sweep over one bag file. The bag is decoded once, the map is requested once and every
+//configuration runs a filter of its own under ~/run_<k> on a pool of threads, replaying the shared
+//recording in-process. The likelihood field is computed once and shared through the in-memory cache.
+//
+//private parameters
+//  filter        amcl, mixmcl, mcmcl, aismcl or markov
+//  bagfile       bag to replay
+//  results_file  one line per run, csv
+//  threads       concurrent runs, the cores are split evenly between them for their sensor updates.
+//                every run draws from Philox streams and a drand48 state of its own, seeded by random_seed
+//  repeats       runs per configuration
+//  random_seed   repeat r of every configuration runs with random_seed + r, negative draws a seed per run
+//  sweep         map of parameter name to the list of its values, every combination is one configuration
+//every other scalar private parameter is handed to all runs, the swept ones are overridden per run
+
+typedef std::vector<std::pair<std::string, XmlRpc::XmlRpcValue> > run_params_t;
+
+typedef struct
+{
+  run_params_t params;
+  int repeat;
+  ReplayStats stats;
+} run_t;
+
+//every combination of the values in sweep, the parameter first in alphabetical order varies slowest
+static std::vector<run_params_t> combinations(XmlRpc::XmlRpcValue& sweep)
+{
+  std::vector<run_params_t> configs(1);
+  if(sweep.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+    return configs;
+  for(XmlRpc::XmlRpcValue::iterator it = sweep.begin() ; it != sweep.end() ; ++it)
+  {
+    XmlRpc::XmlRpcValue& values = it->second;
+    std::vector<run_params_t> next;
+    for(size_t c = 0 ; c < configs.size() ; ++c)
+    {
+      if(values.getType() != XmlRpc::XmlRpcValue::TypeArray)
+      {
+        next.push_back(configs[c]);
+        next.back().push_back(std::make_pair(it->first, values));
+        continue;
+      }
+      for(int v = 0 ; v < values.size() ; ++v)
+      {
+        next.push_back(configs[c]);
+        next.back().push_back(std::make_pair(it->first, values[v]));
+      }
+    }
+    configs.swap(next);
+  }
+  return configs;
+}
+
+static std::string toString(XmlRpc::XmlRpcValue& value)
+{
+  char buf[64];
+  switch(value.getType())
+  {
+    case XmlRpc::XmlRpcValue::TypeBoolean:
+      return static_cast<bool>(value) ? "true" : "false";
+    case XmlRpc::XmlRpcValue::TypeInt:
+      snprintf(buf, sizeof(buf), "%d", static_cast<int>(value));
+      return buf;
+    case XmlRpc::XmlRpcValue::TypeDouble:
+      snprintf(buf, sizeof(buf), "%g", static_cast<double>(value));
+      return buf;
+    case XmlRpc::XmlRpcValue::TypeString:
+      return static_cast<std::string&>(value);
+    default:
+      return "?";
+  }
+}
+
+//private parameters of run k, the shared scalars of ~ followed by the swept ones
+static std::string setRunParams(int k, XmlRpc::XmlRpcValue& shared, const run_t& run)
+{
+  const run_params_t& params = run.params;
+  char name[32];
+  snprintf(name, sizeof(name), "run_%d", k);
+  ros::NodeHandle run_nh(ros::NodeHandle("~"), name);
+  for(XmlRpc::XmlRpcValue::iterator it = shared.begin() ; it != shared.end() ; ++it)
+    if(it->second.getType() != XmlRpc::XmlRpcValue::TypeStruct &&
+       it->second.getType() != XmlRpc::XmlRpcValue::TypeArray)
+      run_nh.setParam(it->first, it->second);
+  //the map is handed over by setMap and nobody listens to the transforms of a run
+  run_nh.setParam("use_map_topic", true);
+  run_nh.setParam("tf_broadcast", false);
+  //the configurations share the seeds of their repeats
+  if(shared.hasMember("random_seed") && shared["random_seed"].getType() == XmlRpc::XmlRpcValue::TypeInt &&
+     static_cast<int>(shared["random_seed"]) >= 0)
+    run_nh.setParam("random_seed", static_cast<int>(shared["random_seed"]) + run.repeat);
+  for(size_t p = 0 ; p < params.size() ; ++p)
+    run_nh.setParam(params[p].first, params[p].second);
+  return name;
+}
+
+template<class Node>
+void runSweep(std::vector<run_t>& runs, XmlRpc::XmlRpcValue& shared, const BagRecording& recording,
+              const nav_msgs::OccupancyGrid& map, int threads)
+{
+  std::atomic<int> next(0);
+  std::mutex params_mutex;
+  auto worker = [&]()
+  {
+    for(int k = next++ ; k < (int)runs.size() && ros::ok() ; k = next++)
+    {
+      std::string ns;
+      {
+        std::lock_guard<std::mutex> lock(params_mutex);
+        ns = setRunParams(k, shared, runs[k]);
+      }
+      ros::WallTime start = ros::WallTime::now();
+      boost::shared_ptr<Node> node(new Node(ns));
+      node->setMap(map);
+      ROS_INFO("run %d set up in %.2f s", k, (ros::WallTime::now() - start).toSec());
+      node->replay(recording, runs[k].stats);
+      ROS_INFO("run %d: %d scans in %.1f s, mean position error %.3f m",
+               k, runs[k].stats.scans, runs[k].stats.runtime, runs[k].stats.meanError());
+    }
+  };
+  std::vector<std::thread> pool;
+  for(int t = 0 ; t < threads ; ++t)
+    pool.push_back(std::thread(worker));
+  for(auto&& thread : pool)
+    thread.join();
+}
+
+static bool writeResults(const std::string& path, std::vector<run_t>& runs)
+{
+  FILE* file = fopen(path.c_str(), "w");
+  if(!file)
+    return false;
+  fprintf(file, "run");
+  if(!runs.empty())
+    for(size_t p = 0 ; p < runs[0].params.size() ; ++p)
+      fprintf(file, ",%s", runs[0].params[p].first.c_str());
+  fprintf(file, ",scans,dropped,updates,mean_error,rms_error,max_error,mean_yaw_error,mean_latency_ms,max_latency_ms,runtime\n");
+  for(size_t k = 0 ; k < runs.size() ; ++k)
+  {
+    const ReplayStats& s = runs[k].stats;
+    fprintf(file, "%lu", k);
+    for(size_t p = 0 ; p < runs[k].params.size() ; ++p)
+      fprintf(file, ",%s", toString(runs[k].params[p].second).c_str());
+    fprintf(file, ",%d,%d,%d,%f,%f,%f,%f,%f,%f,%f\n",
+            s.scans, s.dropped, s.updates, s.meanError(), s.rmsError(), s.error_max,
+            s.meanYawError(), s.meanLatency()*1e3, s.latency_max*1e3, s.runtime);
+  }
+  fclose(file);
+  return true;
+}
+
+int
+main(int argc, char** argv)
+{
+  ros::init(argc, argv, "sweep");
+  ros::NodeHandle private_nh("~");
+
+  std::string filter, bagfile, results_file, scan_topic, ground_truth_topic;
+  int threads, repeats;
+  private_nh.param("filter", filter, std::string("amcl"));
+  private_nh.param("bagfile", bagfile, std::string(""));
+  private_nh.param("results_file", results_file, std::string("sweep_results.csv"));
+  private_nh.param("threads", threads, parallelThreadCount());
+  private_nh.param("repeats", repeats, 1);
+  private_nh.param("bag_scan_topic", scan_topic, std::string("/p3dx/laser/scan"));
+  private_nh.param("bag_ground_truth_topic", ground_truth_topic, std::string("/p3dx/base_pose_ground_truth"));
+
+  BagRecording recording;
+  if(!recording.load(bagfile, scan_topic, ground_truth_topic))
+    return 1;
+
+  // get map via RPC
+  nav_msgs::GetMap::Request  req;
+  nav_msgs::GetMap::Response resp;
+  ROS_INFO("Requesting the map...");
+  while(ros::ok() && !ros::service::call("static_map", req, resp))
+  {
+    ROS_WARN("Request for map failed; trying again...");
+    ros::Duration d(0.5);
+    d.sleep();
+  }
+  //one likelihood field per max distance is enough for all runs
+  setDistanceMapMemoryCache(2);
+
+  XmlRpc::XmlRpcValue shared, sweep;
+  ros::param::get(ros::this_node::getName(), shared);
+  private_nh.getParam("sweep", sweep);
+  std::vector<run_params_t> configs = combinations(sweep);
+  std::vector<run_t> runs;
+  for(size_t c = 0 ; c < configs.size() ; ++c)
+    for(int r = 0 ; r < repeats ; ++r)
+    {
+      runs.push_back(run_t());
+      runs.back().params = configs[c];
+      runs.back().repeat = r;
+    }
+  if(threads < 1)
+    threads = 1;
+  //concurrent runs would oversubscribe the cores if each spread its updates over all of them
+  if(threads > 1)
+    parallelThreadLimit() = std::max(1, parallelThreadCount()/threads);
+  ROS_INFO("Sweeping %lu configurations %d times with %s on %d threads", configs.size(), repeats, filter.c_str(), threads);
+
+  ros::WallTime start = ros::WallTime::now();
+  if(filter == "amcl")
+    runSweep<AmclNode>(runs, shared, recording, resp.map, threads);
+  else if(filter == "mixmcl")
+    runSweep<MixmclNode>(runs, shared, recording, resp.map, threads);
+  else if(filter == "mcmcl")
+    runSweep<McmclNode>(runs, shared, recording, resp.map, threads);
+  else if(filter == "aismcl")
+    runSweep<AismclNode>(runs, shared, recording, resp.map, threads);
+  else if(filter == "markov")
+    runSweep<MarkovNode>(runs, shared, recording, resp.map, threads);
+  else
+  {
+    ROS_ERROR("Unknown filter %s", filter.c_str());
+    return 1;
+  }
+  ROS_INFO("Sweep of %lu runs took %.1f s", runs.size(), (ros::WallTime::now() - start).toSec());
+
+  if(!writeResults(results_file, runs))
+  {
+    ROS_ERROR("Couldn't write %s", results_file.c_str());
+    return 1;
+  }
+  ROS_INFO("Results written to %s", results_file.c_str());
+  return(0);
+}